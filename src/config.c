@@ -606,6 +606,57 @@ static Config  config[] =
 	  "#",
 	"motion_burst_frames",  "3", FALSE, {.value = &pikrellcam.motion_burst_frames},      config_value_int_set},
 
+	{ "# Use NEON (or SSE2) code for motion vector filtering if PiKrellCam\n"
+	  "# was compiled with it enabled.  The results are the same as the plain\n"
+	  "# C code.  Pi Zero/1 have no NEON and always use the C code.\n"
+	  "#",
+	"motion_simd",  "on", FALSE, {.value = &pikrellcam.motion_simd},      config_value_bool_set},
+
+	{ "# Find connected groups (blobs) of passing motion vectors.  A blob of\n"
+	  "# at least motion_magnitude_limit_count vectors moving the same way is\n"
+	  "# motion in the region holding its center, even if the region vector\n"
+	  "# failed because of other motion in the region.  The largest motion\n"
+	  "# blob sets the frame vector and the preview thumbnail area.\n"
+	  "#",
+	"motion_blobs",  "off", FALSE, {.value = &pikrellcam.motion_blobs},      config_value_bool_set},
+
+	{ "# Keep a running average of how often each macroblock has motion and\n"
+	  "# ignore blocks with motion more than this percent of the time, such as\n"
+	  "# trees or water moving in the wind.  The average follows about the last\n"
+	  "# 64 motion frames.  Set to zero to not ignore any blocks.\n"
+	  "#",
+	"motion_noise_percent",  "0", FALSE, {.value = &pikrellcam.motion_noise_percent},      config_value_int_set},
+
+	{ "# Second motion detect channel from the encoder's per macroblock SAD\n"
+	  "# (how badly the block matched the previous frame).  Each block keeps a\n"
+	  "# SAD baseline and a motion detect is triggered when a region has this\n"
+	  "# many blocks over twice their baseline for 3 motion frames in a row.\n"
+	  "# This can catch slow objects the vectors miss.  Changes over most of\n"
+	  "# the frame (lights, exposure) are ignored.  Set to zero to disable.\n"
+	  "#",
+	"motion_sad_count",  "0", FALSE, {.value = &pikrellcam.motion_sad_count},      config_value_int_set},
+
+	{ "# Pixel motion detect channel for low bitrate or night video where the\n"
+	  "# vectors are mostly noise.  The preview (mjpeg) frames are compared\n"
+	  "# to a running average background and a motion detect is triggered when\n"
+	  "# a region has this many 16x16 preview pixel blocks differing by more\n"
+	  "# than motion_pixel_level for 3 motion frames in a row.  Changes over\n"
+	  "# most of the frame are ignored.  Set to zero to disable.\n"
+	  "#",
+	"motion_pixel_count",  "0", FALSE, {.value = &pikrellcam.motion_pixel_count},      config_value_int_set},
+
+	{ "# Average brightness difference (0 - 255) of a preview pixel block from\n"
+	  "# the background for it to count for motion_pixel_count.  Range 2 - 100\n"
+	  "#",
+	"motion_pixel_level",  "12", FALSE, {.value = &pikrellcam.motion_pixel_level},      config_value_int_set},
+
+	{ "# Count motion activity per macroblock into the memory mapped file\n"
+	  "# tmpfs_dir/motion-heatmap for the web page or scripts to read.  Counts\n"
+	  "# are halved every hour.  See MotionHeatmapHeader in src/pikrellcam.h\n"
+	  "# for the file layout.\n"
+	  "#",
+	"motion_heatmap",  "off", FALSE, {.value = &pikrellcam.motion_heatmap},      config_value_bool_set},
+
 	{ "# Percent to dim image when drawing motion vectors.  Range 30 - 60\n"
 	  "#",
 	"motion_vectors_dimming", "45", FALSE, {.value = &pikrellcam.motion_vectors_dimming}, config_value_int_set},
@@ -616,6 +667,28 @@ static Config  config[] =
 	  "#",
 	"motion_confirm_gap",   "4", TRUE, {.value = &pikrellcam.motion_times.confirm_gap},  config_value_int_set },
 
+	{ "# Instead of motion_confirm_gap, follow motion from frame to frame and\n"
+	  "# trigger a motion event only when a tracked object has been detected in\n"
+	  "# this many motion frames (there are video_fps / mjpeg_divider motion\n"
+	  "# frames per second) and has moved motion_track_distance macroblocks\n"
+	  "# (16 video pixels) from where it was first seen.  Set to zero to use\n"
+	  "# motion_confirm_gap.\n"
+	  "#",
+	"motion_track_frames",   "0", FALSE, {.value = &pikrellcam.motion_track_frames},  config_value_int_set },
+
+	{ "# Macroblocks a tracked object must move, see motion_track_frames.\n"
+	  "#",
+	"motion_track_distance",   "3", FALSE, {.value = &pikrellcam.motion_track_distance},  config_value_int_set },
+
+	{ "# Instead of motion_confirm_gap, trigger a motion event only when a\n"
+	  "# region has had motion in this many motion frames in a row with a\n"
+	  "# steady direction and a centroid that moves no faster than its vectors.\n"
+	  "# Rain, insects and camera glitches rarely hold a trajectory.\n"
+	  "# 2 - 8, or zero to use motion_confirm_gap.  Not used if motion_track_frames\n"
+	  "# is set.\n"
+	  "#",
+	"motion_coherence_frames",   "0", FALSE, {.value = &pikrellcam.motion_coherence_frames},  config_value_int_set },
+
 	{ "# event_gap seconds since the last motion detect event must pass\n"
 	  "# before a motion video record can end.  Each motion detect within\n"
 	  "# an event_gap resets a new full event_gap period.  When an event gap period\n"
@@ -691,6 +764,12 @@ static Config  config[] =
 	  "#",
 	"motion_stats",  "off", FALSE, {.value = &pikrellcam.motion_stats}, config_value_bool_set },
 
+	{ "# Write the motion statistics as a binary .mstats file instead of .csv.\n"
+	  "# The files are smaller and have per region results.  Convert with:\n"
+	  "#     motion-stats [-r] file.mstats > file.csv\n"
+	  "#",
+	"motion_stats_binary",  "off", FALSE, {.value = &pikrellcam.motion_stats_binary}, config_value_bool_set },
+
 
 	{ "\n# --------------------- Video Record Options -----------------------\n"
 	  "#\n"
@@ -707,8 +786,8 @@ static Config  config[] =
 	  "# A video_filename may use these pikrellcam substitution vvariables:\n"
 	  "#     $M - The video_manual_tag or video_motion_tag string\n"
 	  "#     $N - The video_manual_sequence  or video_motion_sequence number\n"
-	  "# If the name has a .mp4 suffix, the video file will be boxed into a\n"
-	  "# mp4 container using the MP4Box program.  Otherwise you should give the\n"
+	  "# If the name has a .mp4 suffix, the video file will be written in a\n"
+	  "# mp4 container (see video_mp4_muxer).  Otherwise you should give the\n"
 	  "# name a .h264 suffix since that is the format of the Pi camera video\n"
 	  "# output.  Note that omxplayer can play a raw h264 video, but that other\n"
 	  "# programs like vlc and mplayer will need a mp4 video.\n"
@@ -741,7 +820,13 @@ static Config  config[] =
 	  "#",
 	"video_fps",      "24", FALSE, {.value = &pikrellcam.camera_adjust.video_fps},        config_value_int_set },
 
-	{ "# MP4Box output frames per second if video filename is a .mp4\n"
+	{ "# Write .mp4 videos with the built in mp4 muxer as they are recorded.\n"
+	  "# If off, a .h264 video is written and then boxed into the .mp4 by\n"
+	  "# running MP4Box when the record stops.\n"
+	  "#",
+	"video_mp4_muxer", "on", FALSE, {.value = &pikrellcam.video_mp4_muxer}, config_value_bool_set },
+
+	{ "# Output frames per second if video filename is a .mp4\n"
 	  "# If this is different from video_fps, the final mp4 will be a\n"
 	  "# slow or fast motion video.\n"
 	  "#",
@@ -757,6 +842,18 @@ static Config  config[] =
 	  "#",
 	"video_bitrate",  "6000000", TRUE, {.value = &pikrellcam.camera_adjust.video_bitrate},    config_value_int_set },
 
+	{ "# Directory for a file backing the video circular buffer.  If empty the\n"
+	  "# buffer is all in memory.  Long pre_capture or event_gap times at a\n"
+	  "# high bitrate can need a buffer that is a large part of a Pi's memory.\n"
+	  "# With the buffer in a file on a disk or SSD, only the newest few seconds\n"
+	  "# of video are kept in memory and older video is written out to the file\n"
+	  "# in order by a separate thread.  If the disk can't keep up, the video\n"
+	  "# not yet written out is lost and logged.  The file is unlinked so it is\n"
+	  "# never seen in the directory.  Do not use the SD card.\n"
+	  "# Takes effect at the next circular buffer resize or PiKrellCam start.\n"
+	  "#",
+	"video_buffer_dir", "", TRUE, {.string = &pikrellcam.video_buffer_dir}, config_string_set },
+
 	{ "# Pixel width of the stream jpeg file. Aspect ratio is determined by the video.\n"
 	  "#",
 	"mjpeg_width",    "640",  TRUE, {.value = &pikrellcam.mjpeg_width},      config_value_int_set },
@@ -773,6 +870,17 @@ static Config  config[] =
 	  "#",
 	"mjpeg_divider",  "4", FALSE, {.value = &pikrellcam.mjpeg_divider},    config_value_int_set },
 
+	{ "# Percent of one CPU core that motion checking and drawing on the stream\n"
+	  "# jpeg may use.  If they use more (or the jpeg encoder can't keep up),\n"
+	  "# the motion check rate is lowered below video_fps / mjpeg_divider and\n"
+	  "# is raised again when the load drops.  Set to zero for a fixed rate.\n"
+	  "#",
+	"motion_load_percent",  "0", FALSE, {.value = &pikrellcam.motion_load_percent},    config_value_int_set },
+
+	{ "# With motion_load_percent, the lowest motion check rate (per second).\n"
+	  "#",
+	"motion_load_min_fps",  "2", FALSE, {.value = &pikrellcam.motion_load_min_fps},    config_value_int_set },
+
 
 	{ "\n# ------------------ Still Capture Options -----------------------\n"
 	  "#\n"
@@ -998,6 +1106,38 @@ config_load(char *config_file)
 	if (pikrellcam.motion_burst_frames < 2)
 		pikrellcam.motion_burst_frames = 2;
 
+	if (pikrellcam.motion_noise_percent < 0)
+		pikrellcam.motion_noise_percent = 0;
+	if (pikrellcam.motion_noise_percent > 100)
+		pikrellcam.motion_noise_percent = 100;
+
+	if (pikrellcam.motion_sad_count < 0)
+		pikrellcam.motion_sad_count = 0;
+	if (pikrellcam.motion_pixel_count < 0)
+		pikrellcam.motion_pixel_count = 0;
+	if (pikrellcam.motion_pixel_level < 2)
+		pikrellcam.motion_pixel_level = 2;
+	if (pikrellcam.motion_pixel_level > 100)
+		pikrellcam.motion_pixel_level = 100;
+
+	if (pikrellcam.motion_load_percent < 0)
+		pikrellcam.motion_load_percent = 0;
+	if (pikrellcam.motion_load_percent > 100)
+		pikrellcam.motion_load_percent = 100;
+	if (pikrellcam.motion_load_min_fps < 1)
+		pikrellcam.motion_load_min_fps = 1;
+
+	if (pikrellcam.motion_track_frames < 0)
+		pikrellcam.motion_track_frames = 0;
+	if (pikrellcam.motion_track_distance < 0)
+		pikrellcam.motion_track_distance = 0;
+	if (pikrellcam.motion_coherence_frames < 0)
+		pikrellcam.motion_coherence_frames = 0;
+	if (pikrellcam.motion_coherence_frames == 1)
+		pikrellcam.motion_coherence_frames = 2;
+	if (pikrellcam.motion_coherence_frames > MOTION_COHERENCE_MAX)
+		pikrellcam.motion_coherence_frames = MOTION_COHERENCE_MAX;
+
 	if (pikrellcam.motion_vectors_dimming < 30)
 		pikrellcam.motion_vectors_dimming = 30;
 	if (pikrellcam.motion_vectors_dimming > 60)
@@ -176,7 +176,6 @@ static void
 i420_dim_frame(uint8_t *i420)
 	{
 	MotionFrame	*mf = &motion_frame;
-	int16_t		*ptrig;			/* ptr to motion frame trigger data */
 	int			x, y, x_mv, y_mv;
 	uint8_t		*pY,		/* ptr to I420 intensity (Y) data */
 				Ydim, Ytrig, Ys;
@@ -188,7 +187,6 @@ i420_dim_frame(uint8_t *i420)
 		for (x = 0; x < pikrellcam.mjpeg_width; ++x)
 			{
 			x_mv = MJPEG_TO_MOTION_VECTOR_X(x);
-			ptrig = mf->trigger + x_mv + mf->width * y_mv;
 
 			pY = i420 + x + y * pikrellcam.mjpeg_width;
 
@@ -206,11 +204,13 @@ i420_dim_frame(uint8_t *i420)
 				Ytrig += 20;
 			else if (Ytrig < 245)
 				Ytrig += 10;
-			if (*ptrig > 2)			/* passing vector */
-				*pY = Ytrig;
-			else if (*ptrig == 2)	/* direction reject */
+			if (MF_BIT(mf, reject, x_mv, y_mv))			/* direction reject */
 				*pY = Ydim + (Ytrig - Ydim) / 4;
-			else if (*ptrig == 1)	/* sparkle */
+			else if (MF_BIT(mf, above, x_mv, y_mv))		/* passing vector */
+				*pY = Ytrig;
+			else if (MF_BIT(mf, noisy, x_mv, y_mv))		/* noise average */
+				*pY = Ydim / 2;
+			else if (MF_BIT(mf, sparkle, x_mv, y_mv))	/* sparkle */
 				{
 				Ys = (Ytrig - Ydim) / 2;
 				if (Ys <= Ydim)
@@ -224,6 +224,24 @@ i420_dim_frame(uint8_t *i420)
 		}
 	}
 
+  /* Polygon region outline with a shadow like the rectangle regions.
+  */
+static void
+polygon_draw(DrawArea *da, MotionRegion *mreg)
+	{
+	int		i, j, x0, y0, x1, y1;
+
+	for (i = 0, j = mreg->n_points - 1; i < mreg->n_points; j = i++)
+		{
+		x0 = mreg->xfp[j] * pikrellcam.mjpeg_width;
+		y0 = mreg->yfp[j] * pikrellcam.mjpeg_height;
+		x1 = mreg->xfp[i] * pikrellcam.mjpeg_width;
+		y1 = mreg->yfp[i] * pikrellcam.mjpeg_height;
+		glcd_draw_line(glcd, da, 0, x0 + 1, y0 + 1, x1 + 1, y1 + 1);
+		glcd_draw_line(glcd, da, 0xf0, x0, y0, x1, y1);
+		}
+	}
+
 static void
 motion_draw(uint8_t *i420)
 	{
@@ -231,7 +249,8 @@ motion_draw(uint8_t *i420)
 	VideoCircularBuffer *vcb = &video_circular_buffer;
 	DrawArea        *da;
 	MotionFrame     *mf = &motion_frame;
-	MotionRegion    *mreg;
+	MotionRegionSet *rs;
+	MotionRegion    *mreg, *result;
 	CompositeVector *vec;
 	SList           *mrlist;
 	char            *msg, info[100], status[100];
@@ -263,6 +282,7 @@ motion_draw(uint8_t *i420)
 
 	if (!inform_shown && mf->show_regions)
 		{
+		rs = motion_region_set_get(mf);
 		for (mrlist = mf->motion_region_list; mrlist; mrlist = mrlist->next)
 			{
 			mreg = (MotionRegion *) mrlist->data;
@@ -272,35 +292,50 @@ motion_draw(uint8_t *i420)
 			dx = MOTION_VECTOR_TO_MJPEG_X(mreg->dx);
 			dy = MOTION_VECTOR_TO_MJPEG_Y(mreg->dy);
 
-			glcd_draw_rectangle(glcd, da, 0, x + 1, y + 1, dx, dy);
-			glcd_draw_rectangle(glcd, da, 0xf0, x, y, dx, dy);
+			if (mreg->n_points == 0)
+				{
+				glcd_draw_rectangle(glcd, da, 0, x + 1, y + 1, dx, dy);
+				glcd_draw_rectangle(glcd, da, 0xf0, x, y, dx, dy);
+				}
+			else
+				polygon_draw(da, mreg);
 
 			if (mreg->region_number == mf->selected_region)
 				{
-				snprintf(info, sizeof(info), "[%d]", mreg->region_number);
+				snprintf(info, sizeof(info), mreg->exclude ? "[x%d]" : "[%d]",
+						mreg->region_number);
 				font = large_font;
 				}
 			else
 				{
-				snprintf(info, sizeof(info), "%d", mreg->region_number);
+				snprintf(info, sizeof(info), mreg->exclude ? "x%d" : "%d",
+						mreg->region_number);
 				font = normal_font;
 				}
 			i420_draw_string(draw_area, font, 0xff, x + 2, y + 1, info);
 
-			if (mreg->vector.mag2_count >= mf->mag2_limit_count)
+			/* Motion results are in the region set copy of the region.
+			*/
+			if (   !rs || mreg->map_bit < 0 || mreg->map_bit >= rs->n_regions
+			    || rs->regions[mreg->map_bit].region_number != mreg->region_number
+			   )
+				continue;
+			result = &rs->regions[mreg->map_bit];
+
+			if (result->vector.mag2_count >= mf->mag2_limit_count)
 				{
-				color = (mreg->motion > 0) ? 0xff : 0xb0;
+				color = (result->motion > 0) ? 0xff : 0xb0;
 				snprintf(info, sizeof(info), "cnt: %d",
-						mreg->vector.mag2_count);
+						result->vector.mag2_count);
 				i420_draw_string(draw_area, normal_font, color,
 						x + 2, y + dy - normal_font->char_height - 1, info);
 
 				snprintf(info, sizeof(info), "mag: %d",
-						(int) sqrt(mreg->vector.mag2));
+						(int) sqrt(result->vector.mag2));
 				i420_draw_string(draw_area, normal_font, color,
 						x + 2, y + dy - 2 * normal_font->char_height - 1, info);
 
-				vec = &mreg->vector;
+				vec = &result->vector;
 				x  = MOTION_VECTOR_TO_MJPEG_X(vec->x - vec->box_w / 2);
 				y  = MOTION_VECTOR_TO_MJPEG_Y(vec->y - vec->box_h / 2);
 				dx = MOTION_VECTOR_TO_MJPEG_X(vec->box_w);
@@ -313,7 +348,7 @@ motion_draw(uint8_t *i420)
 				dx = -vec->vx * r_unit;
 				dy = -vec->vy * r_unit;
 				glcd_draw_line(glcd, da, color, x, y, x + dx, y + dy);
-				if (mreg->motion > 0)
+				if (result->motion > 0)
 					glcd_fill_circle(glcd, da, color, x + dx, y + dy, 6);
 				else
 					glcd_draw_circle(glcd, da, color, x + dx, y + dy, 6);
@@ -334,6 +369,34 @@ motion_draw(uint8_t *i420)
 					}
 				}
 			}
+		motion_region_set_put(rs);
+		for (i = 0; i < mf->n_blobs; ++i)
+			{
+			color = mf->blobs[i].motion ? 0xff : 0xb0;
+			x  = MOTION_VECTOR_TO_MJPEG_X(mf->blobs[i].x0);
+			y  = MOTION_VECTOR_TO_MJPEG_Y(mf->blobs[i].y0);
+			dx = MOTION_VECTOR_TO_MJPEG_X(mf->blobs[i].x1 - mf->blobs[i].x0 + 1);
+			dy = MOTION_VECTOR_TO_MJPEG_Y(mf->blobs[i].y1 - mf->blobs[i].y0 + 1);
+			glcd_draw_rectangle(glcd, da, color, x, y, dx, dy);
+			snprintf(info, sizeof(info), "%d", mf->blobs[i].count);
+			i420_draw_string(draw_area, normal_font, color, x + 2, y + 1, info);
+			}
+
+		for (i = 0; i < MOTION_TRACKS_MAX; ++i)
+			{
+			if (!mf->tracks[i].active || mf->tracks[i].hits < 2)
+				continue;
+			color = mf->tracks[i].confirmed ? 0xff : 0xb0;
+			x  = MOTION_VECTOR_TO_MJPEG_X((int) mf->tracks[i].x_start);
+			y  = MOTION_VECTOR_TO_MJPEG_Y((int) mf->tracks[i].y_start);
+			dx = MOTION_VECTOR_TO_MJPEG_X((int) mf->tracks[i].x);
+			dy = MOTION_VECTOR_TO_MJPEG_Y((int) mf->tracks[i].y);
+			glcd_draw_line(glcd, da, color, x, y, dx, dy);
+			glcd_draw_circle(glcd, da, color, dx, dy, 4);
+			snprintf(info, sizeof(info), "#%d", mf->tracks[i].id);
+			i420_draw_string(draw_area, normal_font, color, dx + 6, dy - 6, info);
+			}
+
 		snprintf(info, sizeof(info), "Magnitude limit: %d",
 								(int) sqrt(mf->mag2_limit));
 		i420_print(&top_status_area, normal_font, 0xff, 0, 1, 0,
@@ -356,10 +419,18 @@ motion_draw(uint8_t *i420)
 			snprintf(status, sizeof(status), "confirming[%d]", mf->frame_window);
 			msg = status;
 			}
+		else if (   mf->motion_status == MOTION_PENDING
+		         && pikrellcam.motion_track_frames > 0
+		        )
+			msg = "tracking";
 		else if (mf->motion_status & MOTION_DETECTED)
 			{
 			if (mf->motion_status & MOTION_BURST)
 				msg = "burst motion";
+			else if (mf->motion_status & MOTION_SAD)
+				msg = "sad motion";
+			else if (mf->motion_status & MOTION_PIXEL)
+				msg = "pixel motion";
 			else
 				msg = "motion";
 			}
@@ -446,6 +446,7 @@ state_file_write(void)
 
 	fprintf(f, "video_last %s\n",
 			pikrellcam.video_last ? pikrellcam.video_last : "none");
+	fprintf(f, "video_write_overruns %d\n", pikrellcam.video_write_overruns);
 	fprintf(f, "still_last %s\n",
 			pikrellcam.still_last ? pikrellcam.still_last : "none");
 
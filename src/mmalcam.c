@@ -20,6 +20,9 @@
 
 #include "pikrellcam.h"
 #include "mmal_status.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <errno.h>
 
 CameraObject	camera;
 CameraObject	still_jpeg_encoder;
@@ -30,9 +33,27 @@ CameraObject	stream_resizer;
 
 VideoCircularBuffer video_circular_buffer;
 
-static boolean      motion_frame_event;
+static boolean      motion_frame_event;		/* set by the motion thread */
 static int          mjpeg_do_preview_save;
 
+static MotionQueue  motion_queue;
+
+  /* Busy time of motion_frame_process() and display_draw() and the mjpeg
+  |  frames skipped for a busy encoder, taken once a second by
+  |  motion_load_adapt().
+  */
+static uint64_t     motion_load_ns;
+static unsigned int motion_load_skips;
+
+static uint64_t
+monotonic_ns(void)
+	{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+
 static pthread_mutex_t mjpeg_encoder_count_lock;
 static unsigned int	   mjpeg_encoder_send_count,
                        mjpeg_encoder_recv_count;
@@ -261,12 +282,28 @@ I420_video_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
 	static struct timeval timer;
 	int                   utime;
 	static int            encoder_busy_count;
+	uint64_t              t0;
 
 	if (   buffer->length > 0
-	    && motion_frame_event
+	    && __atomic_load_n(&motion_frame_event, __ATOMIC_ACQUIRE)
 	   )
 		{
-		motion_frame_event = FALSE;
+		__atomic_store_n(&motion_frame_event, FALSE, __ATOMIC_RELAXED);
+
+		/* Pixel motion needs the frame before the OSD is drawn on it.
+		|  MMAL pads I420 frames to 32 pixel widths and 16 row heights.
+		*/
+		if (pikrellcam.motion_pixel_count > 0)
+			{
+			t0 = monotonic_ns();
+			mmal_buffer_header_mem_lock(buffer);
+			motion_pixel_process(&motion_frame, buffer->data,
+					VCOS_ALIGN_UP(port->format->es->video.width, 32),
+					VCOS_ALIGN_UP(port->format->es->video.height, 16));
+			mmal_buffer_header_mem_unlock(buffer);
+			__atomic_add_fetch(&motion_load_ns, monotonic_ns() - t0,
+						__ATOMIC_RELAXED);
+			}
 
 		/* Do not send buffer to encoder if it has not received the previous
 		|  one we sent unless this is the frame we want for a preview save.
@@ -288,7 +325,10 @@ I420_video_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
 					memcpy(buffer_in->data, buffer->data, buffer->length);
 					buffer_in->length = buffer->length;
 					mmal_buffer_header_mem_unlock(buffer);
+					t0 = monotonic_ns();
 					display_draw(buffer_in->data);
+					__atomic_add_fetch(&motion_load_ns, monotonic_ns() - t0,
+								__ATOMIC_RELAXED);
 
 					if (motion_frame.do_preview_save)
 						{
@@ -315,6 +355,7 @@ I420_video_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
 		else
 			{
 			++encoder_busy_count;
+			__atomic_add_fetch(&motion_load_skips, 1, __ATOMIC_RELAXED);
 			if (pikrellcam.debug)
 				printf("encoder not clear (%d) -> skipping mjpeg frame.\n",
 					   encoder_busy_count);
@@ -337,67 +378,858 @@ I420_video_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
 	}
 
 
+  /* The circular buffer RAM ring is a memfd, or an unlinked /dev/shm file
+  |  on kernels before 3.17, so it can be mapped more than once.
+  */
+static int
+circular_buffer_fd(size_t size)
+	{
+	char	path[] = "/dev/shm/pikrellcam-vcb-XXXXXX";
+	int		fd = -1;
+
+#ifdef SYS_memfd_create
+	fd = syscall(SYS_memfd_create, "pikrellcam-vcb", 0);
+#endif
+	if (fd < 0 && (fd = mkstemp(path)) >= 0)
+		unlink(path);
+	if (fd >= 0 && ftruncate(fd, size) < 0)
+		{
+		close(fd);
+		fd = -1;
+		}
+	return fd;
+	}
+
+  /* The file ring for a video_buffer_dir, unlinked so it is never seen in
+  |  the directory.  The blocks are allocated up front so a full disk fails
+  |  here rather than with spill write errors later.  Returns -1 to keep
+  |  the buffer all in memory.
+  */
+static int
+circular_buffer_file(size_t size)
+	{
+	char	*path = NULL;
+	int		fd, err;
+
+	asprintf(&path, "%s/pikrellcam-vcb-XXXXXX", pikrellcam.video_buffer_dir);
+	if ((fd = mkstemp(path)) >= 0)
+		{
+		unlink(path);
+		if ((err = posix_fallocate(fd, 0, size)) != 0)
+			{
+			close(fd);
+			fd = -1;
+			errno = err;
+			}
+		}
+	if (fd < 0)
+		log_printf("Could not create circular buffer file in %s, using memory.  %m\n",
+				pikrellcam.video_buffer_dir);
+	free(path);
+	return fd;
+	}
+
+  /* Map the circular buffer memory twice, back to back, so data[size + n]
+  |  is data[n].  Any span of up to size bytes starting in the ring is then
+  |  contiguous and writes, fwrites and sends never split at the wrap.
+  |  Video writers make their own mapping so a buffer resize can't unmap
+  |  data out from under them.
+  */
+static int8_t *
+circular_buffer_map(int fd, size_t size)
+	{
+	int8_t	*base;
+
+	/* Reserve both halves first so nothing else can land in the second.
+	*/
+	base = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (   base == MAP_FAILED
+	    || mmap(base, size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+	    || mmap(base + size, size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+	   )
+		{
+		if (base != MAP_FAILED)
+			munmap(base, 2 * size);
+		base = NULL;
+		}
+	return base;
+	}
+
+  /* ================ Circular Buffer Spill =============== */
+
+  /* Copies the RAM ring out to the file ring in order, a chunk at a time
+  |  with the mutex unlocked.  After video_spill_stop() it unmaps and
+  |  frees on its own.
+  */
+static void *
+video_spill_thread(void *arg)
+	{
+	VideoSpill	*spill = (VideoSpill *) arg;
+	int8_t		*data;
+	uint64_t	serial, generation;
+	int			length, offset, n, losses = 0, spill_losses;
+	time_t		t_logged = 0;
+	boolean		ok, write_error = FALSE;
+
+	pthread_mutex_lock(&spill->mutex);
+	while (!spill->stop)
+		{
+		if (spill->serial == spill->data_serial)
+			{
+			pthread_cond_wait(&spill->cond, &spill->mutex);
+			continue;
+			}
+		serial = spill->serial;
+		length = MIN(spill->data_serial - serial, VIDEO_WRITER_CHUNK);
+		generation = spill->generation;
+		spill_losses = spill->losses;
+		pthread_mutex_unlock(&spill->mutex);
+
+		if (spill_losses != losses && time(NULL) >= t_logged + 60)
+			{
+			log_printf("Video buffer file writes fell behind, video lost %d times.\n",
+					spill_losses - losses);
+			losses = spill_losses;
+			t_logged = time(NULL);
+			}
+
+		/* The RAM ring mirror has the chunk contiguous, the file ring can
+		|  wrap.
+		*/
+		data = spill->data + serial % spill->ram_size;
+		offset = serial % spill->file_size;
+		n = MIN(length, spill->file_size - offset);
+		ok = (   pwrite(spill->fd, data, n, offset) == n
+		      && (   n == length
+		          || pwrite(spill->fd, data + n, length - n, 0) == length - n
+		         )
+		     );
+		if (!ok && !write_error)
+			log_printf("Video buffer file write failed.  %m\n");
+		write_error = !ok;
+		if (!ok)
+			sleep(1);
+
+		pthread_mutex_lock(&spill->mutex);
+		if (ok && spill->generation == generation)
+			spill->serial = serial + length;
+		}
+	pthread_mutex_unlock(&spill->mutex);
+
+	munmap(spill->data, 2 * (size_t) spill->ram_size);
+	close(spill->fd);
+	pthread_mutex_destroy(&spill->mutex);
+	pthread_cond_destroy(&spill->cond);
+	free(spill);
+	return NULL;
+	}
+
+  /* The spill thread has its own RAM ring mapping and file descriptor so
+  |  a buffer resize can't close them out from under it.
+  */
+static VideoSpill *
+video_spill_start(VideoCircularBuffer *vcb)
+	{
+	VideoSpill		*spill;
+	pthread_attr_t	attr;
+	pthread_t		thread;
+	int				err;
+
+	spill = calloc(1, sizeof(VideoSpill));
+	if ((spill->data = circular_buffer_map(vcb->fd, vcb->ram_size)) == NULL)
+		{
+		free(spill);
+		return NULL;
+		}
+	if ((spill->fd = dup(vcb->file_fd)) < 0)
+		{
+		munmap(spill->data, 2 * (size_t) vcb->ram_size);
+		free(spill);
+		return NULL;
+		}
+	spill->ram_size = vcb->ram_size;
+	spill->file_size = vcb->size;
+	pthread_mutex_init(&spill->mutex, NULL);
+	pthread_cond_init(&spill->cond, NULL);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&thread, &attr, video_spill_thread, spill);
+	pthread_attr_destroy(&attr);
+	if (err != 0)
+		{
+		munmap(spill->data, 2 * (size_t) spill->ram_size);
+		close(spill->fd);
+		pthread_mutex_destroy(&spill->mutex);
+		pthread_cond_destroy(&spill->cond);
+		free(spill);
+		errno = err;
+		return NULL;
+		}
+	return spill;
+	}
+
+static void
+video_spill_stop(VideoSpill *spill)
+	{
+	if (!spill)
+		return;
+	pthread_mutex_lock(&spill->mutex);
+	spill->stop = TRUE;
+	pthread_cond_signal(&spill->cond);
+	pthread_mutex_unlock(&spill->mutex);
+	}
+
+  /* Called before length bytes are copied in at the head.  Data the spill
+  |  thread has not copied out that the head would write over is lost, the
+  |  file then has nothing before the new spill serial.
+  */
+static void
+video_spill_check(VideoCircularBuffer *vcb, int length)
+	{
+	VideoSpill	*spill = vcb->spill;
+
+	if (!spill)
+		return;
+	pthread_mutex_lock(&spill->mutex);
+	if (vcb->data_serial + length > spill->serial + vcb->ram_size)
+		{
+		spill->serial = vcb->data_serial + length - vcb->ram_size;
+		spill->generation += 1;
+		spill->losses += 1;
+		vcb->file_first = spill->serial;
+		}
+	vcb->spill_serial = spill->serial;
+	pthread_mutex_unlock(&spill->mutex);
+	}
+
+  /* Called after data is copied in at the head.
+  */
+static void
+video_spill_signal(VideoCircularBuffer *vcb)
+	{
+	VideoSpill	*spill = vcb->spill;
+
+	if (!spill)
+		return;
+	pthread_mutex_lock(&spill->mutex);
+	spill->data_serial = vcb->data_serial;
+	pthread_cond_signal(&spill->cond);
+	pthread_mutex_unlock(&spill->mutex);
+	}
+
 void
 circular_buffer_init()
 	{
 	VideoCircularBuffer *vcb = &video_circular_buffer;
-	int					i, seconds, size;
+	uint64_t			bytes, max;
+	int					n, seconds, size, ram_size, page;
+	boolean				new_buffer = FALSE;
 
 	/* When waiting for motion, we need at least pre_capture in the circular
 	|  buffer, and after motion recording starts, we need the event_gap time
-	|  in the buffer.  So make sure either will fit.
+	|  in the buffer.  So make sure either will fit.  The mirror mapping
+	|  needs a page multiple.
 	*/
 	seconds = MAX(pikrellcam.motion_times.event_gap,
 							pikrellcam.motion_times.pre_capture) + 5;
-	size = pikrellcam.camera_adjust.video_bitrate * seconds / 8;
+	bytes = (uint64_t) pikrellcam.camera_adjust.video_bitrate * seconds / 8;
+	page = sysconf(_SC_PAGESIZE);
+	bytes = (bytes + page - 1) / page * page;
+
+	/* Ring offsets are ints and spans can reach twice the size, and the
+	|  mirror mapping needs twice the size of address space.
+	*/
+	max = MIN((uint64_t) INT_MAX / 2, (uint64_t) SIZE_MAX / 4) / page * page;
+	if (bytes > max)
+		{
+		log_printf("circular buffer %.2f MBytes (%d seconds at %.1f Mbits/sec) is too large, limiting to %.2f MBytes.\n",
+				(double) bytes / 1000000.0, seconds,
+				(double)pikrellcam.camera_adjust.video_bitrate / 1000000.0,
+				(double) max / 1000000.0);
+		bytes = max;
+		}
+	size = (int) bytes;
 
 	if (size != vcb->size)
 		{
+		/* A recording can't continue into a new buffer.
+		*/
+		if (vcb->writer)
+			{
+			log_printf("Stopping video record for a circular buffer resize.\n");
+			video_record_stop(vcb);
+			}
 		if (vcb->data)
-			free(vcb->data);
-		vcb->data = (int8_t *)malloc(size);
-		log_printf("circular buffer allocate: %.2f MBytes (%d seconds at %.1f Mbits/sec)\n",
+			{
+			munmap(vcb->data, 2 * (size_t) vcb->ram_size);
+			close(vcb->fd);
+			}
+		if (vcb->spill)
+			{
+			video_spill_stop(vcb->spill);
+			close(vcb->file_fd);
+			}
+		vcb->data = NULL;
+		vcb->spill = NULL;
+		vcb->file_fd = -1;
+
+		/* With a video_buffer_dir only the newest seconds are kept in RAM,
+		|  but at least a few writer chunks.
+		*/
+		ram_size = size;
+		bytes = (uint64_t) pikrellcam.camera_adjust.video_bitrate
+					* VIDEO_BUFFER_RAM_SECONDS / 8;
+		bytes = MAX(bytes, 4 * VIDEO_WRITER_CHUNK);
+		bytes = (bytes + page - 1) / page * page;
+		if (   pikrellcam.video_buffer_dir && *pikrellcam.video_buffer_dir
+		    && bytes < size
+		    && (vcb->file_fd = circular_buffer_file(size)) >= 0
+		   )
+			ram_size = (int) bytes;
+		vcb->size = size;
+		vcb->ram_size = ram_size;
+
+		if ((vcb->fd = circular_buffer_fd(ram_size)) >= 0)
+			vcb->data = circular_buffer_map(vcb->fd, ram_size);
+		if (vcb->data && vcb->file_fd >= 0)
+			{
+			if ((vcb->spill = video_spill_start(vcb)) == NULL)
+				{
+				munmap(vcb->data, 2 * (size_t) ram_size);
+				vcb->data = NULL;
+				}
+			}
+		new_buffer = TRUE;
+		if (vcb->file_fd >= 0)
+			log_printf("circular buffer allocate: %.2f MBytes in %s, %.2f MBytes memory (%d seconds at %.1f Mbits/sec)\n",
+				(float) size / 1000000.0, pikrellcam.video_buffer_dir,
+				(float) ram_size / 1000000.0, seconds,
+				(double)pikrellcam.camera_adjust.video_bitrate / 1000000.0);
+		else
+			log_printf("circular buffer allocate: %.2f MBytes (%d seconds at %.1f Mbits/sec)\n",
 				(float) size / 1000000.0, seconds,
 				(double)pikrellcam.camera_adjust.video_bitrate / 1000000.0);
 		}
 	if (!vcb->data)
 		{
-		log_printf("Aborting because circular buffer malloc() failed.\n");
+		log_printf("Aborting because circular buffer setup failed. %m\n");
 		exit(1);
 		}
-	vcb->size = size;
+
+	/* A new buffer, or a camera restart with a new encoder stream, starts
+	|  empty.  Otherwise (a pre_capture or event_gap change that fits the
+	|  same size) the running buffer, its index and any writer are left as
+	|  they are.
+	*/
+	if (!new_buffer && vcb->state != VCB_STATE_RESTARTING)
+		return;
 	vcb->head = 0;
-	vcb->cur_frame_index = 0;
-	vcb->pre_frame_index = 0;
-	vcb->in_keyframe = FALSE;
-	for (i = 0; i < KEYFRAME_SIZE; ++i)
+	vcb->tail = vcb->data_serial = 0;
+	vcb->spill_serial = vcb->file_first = 0;
+	if (vcb->spill)
+		{
+		pthread_mutex_lock(&vcb->spill->mutex);
+		vcb->spill->serial = vcb->spill->data_serial = 0;
+		vcb->spill->generation += 1;
+		pthread_mutex_unlock(&vcb->spill->mutex);
+		}
+
+	/* Room for the buffer's seconds of frames twice over to start with.
+	*/
+	for (n = 1024; n < 2 * seconds * pikrellcam.camera_adjust.video_fps; n *= 2)
+		;
+	if (n != vcb->frames_mask + 1)
+		{
+		free(vcb->frames);
+		vcb->frames = malloc(n * sizeof(VideoFrame));
+		vcb->frames_mask = n - 1;
+		}
+	vcb->frame_first = vcb->frame_next = vcb->keyframe_last = 0;
+	vcb->in_frame = FALSE;
+	}
+
+  /* Drop index entries whose data the head has overwritten or a spill
+  |  thread that fell behind lost.
+  */
+static void
+video_frame_trim(VideoCircularBuffer *vcb)
+	{
+	while (   vcb->frame_first < vcb->frame_next
+	       && (   vcb->data_serial - VIDEO_FRAME(vcb, vcb->frame_first)->byte
+					> vcb->size
+	           || VIDEO_FRAME(vcb, vcb->frame_first)->byte < vcb->file_first
+	          )
+	      )
+		++vcb->frame_first;
+	}
+
+  /* Add an index entry for a frame starting at the head.  A full index
+  |  doubles rather than lose frames still in the buffer.
+  */
+static void
+video_frame_start(VideoCircularBuffer *vcb, MMAL_BUFFER_HEADER_T *mmalbuf)
+	{
+	VideoFrame		*vf, *frames;
+	struct timespec	ts;
+	uint64_t		serial, mask;
+
+	video_frame_trim(vcb);
+	if (vcb->frame_next - vcb->frame_first > vcb->frames_mask)
+		{
+		mask = 2 * vcb->frames_mask + 1;
+		frames = malloc((mask + 1) * sizeof(VideoFrame));
+		for (serial = vcb->frame_first; serial < vcb->frame_next; ++serial)
+			frames[serial & mask] = *VIDEO_FRAME(vcb, serial);
+		free(vcb->frames);
+		vcb->frames = frames;
+		vcb->frames_mask = mask;
+		log_printf("video frame index grown to %d frames\n", (int) mask + 1);
+		}
+	vf = VIDEO_FRAME(vcb, vcb->frame_next);
+	vf->byte = vcb->data_serial;
+	vf->size = 0;
+	vf->flags = 0;
+	if (mmalbuf->pts != MMAL_TIME_UNKNOWN)
+		vf->usec = mmalbuf->pts;
+	else
+		{
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		vf->usec = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+		}
+	if (mmalbuf->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME)
+		{
+		vf->flags |= VIDEO_FRAME_KEYFRAME;
+		vcb->keyframe_last = vcb->frame_next;
+		}
+	vcb->frame_next += 1;
+	}
+
+  /* Serial of the first frame at or after usec, frame_next if none.
+  */
+static uint64_t
+video_frame_find(VideoCircularBuffer *vcb, uint64_t usec)
+	{
+	uint64_t	lo = vcb->frame_first, hi = vcb->frame_next, mid;
+
+	while (lo < hi)
+		{
+		mid = lo + (hi - lo) / 2;
+		if (VIDEO_FRAME(vcb, mid)->usec < usec)
+			lo = mid + 1;
+		else
+			hi = mid;
+		}
+	return lo;
+	}
+
+  /* Where a motion record starts: the latest keyframe at or before
+  |  pre_capture seconds back from the newest frame, else the oldest
+  |  keyframe after that.  frame_next (the head) if there is no keyframe.
+  */
+static uint64_t
+video_frame_pre_capture(VideoCircularBuffer *vcb)
+	{
+	VideoFrame	*vf;
+	uint64_t	serial, target, pre_usec;
+
+	video_frame_trim(vcb);
+	if (vcb->frame_first == vcb->frame_next)
+		return vcb->frame_next;
+	vf = VIDEO_FRAME(vcb, vcb->frame_next - 1);
+	pre_usec = (uint64_t) pikrellcam.motion_times.pre_capture * 1000000;
+	target = vf->usec > pre_usec ? vf->usec - pre_usec : 0;
+
+	serial = video_frame_find(vcb, target);
+	if (   serial > vcb->frame_first
+	    && (serial == vcb->frame_next || VIDEO_FRAME(vcb, serial)->usec > target)
+	   )
+		--serial;
+	for ( ; ; --serial)
+		{
+		if (VIDEO_FRAME(vcb, serial)->flags & VIDEO_FRAME_KEYFRAME)
+			return serial;
+		if (serial == vcb->frame_first)
+			break;
+		}
+	for ( ; serial < vcb->frame_next; ++serial)
+		if (VIDEO_FRAME(vcb, serial)->flags & VIDEO_FRAME_KEYFRAME)
+			return serial;
+	return vcb->frame_next;
+	}
+
+  /* Byte serial of a frame, the head's for frame_next.
+  */
+static uint64_t
+video_frame_byte(VideoCircularBuffer *vcb, uint64_t serial)
+	{
+	if (serial >= vcb->frame_next || serial < vcb->frame_first)
+		return vcb->data_serial;
+	return VIDEO_FRAME(vcb, serial)->byte;
+	}
+
+  /* Queue the complete frames from the tail to the head to an mp4 writer.
+  |  If the tail was moved since the last publish (record start, pause or
+  |  resync), queueing starts over at the frame at the tail.
+  */
+static void
+vcb_video_write_frames(VideoCircularBuffer *vcb, VideoWriter *vw)
+	{
+	VideoFrame	*vf;
+	uint64_t	complete;
+
+	if (vcb->tail != vw->tail_serial)
+		{
+		vw->frame_serial = vcb->frame_first;
+		while (   vw->frame_serial < vcb->frame_next
+		       && VIDEO_FRAME(vcb, vw->frame_serial)->byte < vcb->tail
+		      )
+			++vw->frame_serial;
+		}
+	if (vw->frame_serial < vcb->frame_first)
+		vw->frame_serial = vcb->frame_first;
+	complete = vcb->frame_next - (vcb->in_frame ? 1 : 0);
+
+	for ( ; vw->frame_serial < complete; ++vw->frame_serial)
 		{
-		vcb->key_frame[i].position = 0;
-		vcb->key_frame[i].t_frame = 0;
-		vcb->key_frame[i].frame_count = 0;
+		if (vw->frame_in - vw->frame_out > vw->frames_mask)
+			{
+			vw->resync = TRUE;		/* queue full, same as a lag overrun */
+			vw->frame_out = vw->frame_in;
+			vw->length = 0;
+			vw->overruns += 1;
+			pikrellcam.video_write_overruns += 1;
+			break;
+			}
+		vf = VIDEO_FRAME(vcb, vw->frame_serial);
+		if (vw->frame_in == vw->frame_out)
+			vw->position = vf->byte;
+		vw->frames[vw->frame_in++ & vw->frames_mask] = *vf;
+		vw->length += vf->size;
 		}
+	vw->tail_serial = vcb->data_serial;
 	}
 
-  /* Write circular buffer data from the tail to head and upate the tail.
+  /* Publish circular buffer data from the tail to head to the video writer
+  |  and update the tail.  An idle writer starts at the tail, a busy one
+  |  just has its range extended to the head.
   */
 void
 vcb_video_write(VideoCircularBuffer *vcb)
 	{
-	if (!vcb || !vcb->file)
+	VideoWriter	*vw;
+
+	if (!vcb || (vw = vcb->writer) == NULL)
 		return;
 
-	if (vcb->tail < vcb->head)
+	pthread_mutex_lock(&vw->mutex);
+	if (!vw->resync)
+		{
+		if (vw->mux)
+			vcb_video_write_frames(vcb, vw);
+		else
+			{
+			if (vw->length == 0)
+				vw->position = vcb->tail;
+			vw->length = vcb->data_serial - vw->position;
+			}
+		pthread_cond_signal(&vw->cond);
+		}
+	pthread_mutex_unlock(&vw->mutex);
+	vcb->tail = vcb->data_serial;
+	}
+
+  /* Called before length bytes are copied in at the head.  The overrun
+  |  policy: if the head would come too close to data the writer has not
+  |  written, or a spill thread that fell behind lost it, drop that data and
+  |  resync at the next keyframe.  A RAM ring copy the head is about to
+  |  write over is counted so the writer redoes it, from the file by then.
+  */
+static void
+video_writer_lag_check(VideoCircularBuffer *vcb, int length)
+	{
+	VideoWriter	*vw = vcb->writer;
+	uint64_t	lag;
+
+	if (!vw || vw->resync)
+		return;
+	pthread_mutex_lock(&vw->mutex);
+	vw->spill_serial = vcb->spill_serial;
+	if (   vcb->data_serial + length > vcb->ram_size
+	    && vw->ram_read < vcb->data_serial + length - vcb->ram_size
+	   )
+		vw->ram_overwrites += 1;
+	if (vw->length > 0)
 		{
-		fwrite(vcb->data + vcb->tail, vcb->head - vcb->tail, 1, vcb->file);
-		pikrellcam.video_size += vcb->head - vcb->tail;
+		lag = vcb->data_serial + length - vw->position;
+		if (   lag > vcb->size / 100 * VIDEO_WRITER_LAG_PERCENT
+		    || vw->position < vcb->file_first
+		   )
+			{
+			vw->resync = TRUE;
+			vw->length = 0;
+			vw->frame_out = vw->frame_in;
+			vw->overruns += 1;
+			pikrellcam.video_write_overruns += 1;
+			}
 		}
+	pthread_mutex_unlock(&vw->mutex);
+	}
+
+  /* At a keyframe, a writer that overran starts over.
+  */
+static void
+video_writer_resync(VideoCircularBuffer *vcb)
+	{
+	VideoWriter	*vw = vcb->writer;
+
+	if (!vw || !vw->resync)
+		return;
+	pthread_mutex_lock(&vw->mutex);
+	vw->position = vcb->data_serial;
+	vw->length = 0;
+	vw->resync = FALSE;
+	pthread_mutex_unlock(&vw->mutex);
+	vcb->tail = vcb->data_serial;
+	}
+
+  /* Called with the writer locked, copies length bytes at serial into buf
+  |  with it unlocked.  Bytes the spill thread had copied out when the
+  |  callback last looked come from the file, newer ones from the RAM ring.
+  |  Returns FALSE if an overrun or a RAM ring overwrite happened meanwhile
+  |  and the copy can't be used.
+  */
+static boolean
+video_writer_copy(VideoWriter *vw, int8_t *buf, uint64_t serial, int length)
+	{
+	uint64_t	spill_serial = vw->spill_serial;
+	int			overruns = vw->overruns,
+				ram_overwrites = vw->ram_overwrites,
+				n = 0, offset, part;
+
+	if (serial + length > spill_serial)
+		vw->ram_read = MAX(serial, spill_serial);
+	pthread_mutex_unlock(&vw->mutex);
+
+	if (serial < spill_serial)
+		{
+		n = MIN(length, spill_serial - serial);
+		offset = serial % vw->size;
+		part = MIN(n, vw->size - offset);
+		if (   pread(vw->file_fd, buf, part, offset) != part
+		    || (part < n && pread(vw->file_fd, buf + part, n - part, 0) != n - part)
+		   )
+			{
+			log_printf("Video writer buffer file read failed.  %m\n");
+			memset(buf, 0, n);
+			}
+		}
+	if (n < length)
+		memcpy(buf + n, vw->data + (serial + n) % vw->ram_size, length - n);
+
+	pthread_mutex_lock(&vw->mutex);
+	vw->ram_read = UINT64_MAX;
+	return (vw->overruns == overruns && vw->ram_overwrites == ram_overwrites);
+	}
+
+  /* Write queued frames through the mp4 muxer.  Like the h264 writer, a
+  |  frame is copied out and then dropped if an overrun happened meanwhile.
+  */
+static void
+video_writer_mp4(VideoWriter *vw)
+	{
+	VideoFrame	vf;
+
+	pthread_mutex_lock(&vw->mutex);
+	while (1)
+		{
+		while (vw->frame_out == vw->frame_in && !vw->closing)
+			pthread_cond_wait(&vw->cond, &vw->mutex);
+		if (vw->frame_out == vw->frame_in)
+			break;
+
+		vf = vw->frames[vw->frame_out & vw->frames_mask];
+		if (vf.size > vw->buf_size)
+			{
+			vw->buf_size = vf.size;
+			vw->buf = realloc(vw->buf, vw->buf_size);
+			}
+		if (!video_writer_copy(vw, vw->buf, vf.byte, vf.size))
+			continue;
+		vw->frame_out += 1;
+		vw->length -= vf.size;
+		if (vw->frame_out != vw->frame_in)
+			vw->position = vw->frames[vw->frame_out & vw->frames_mask].byte;
+		pthread_mutex_unlock(&vw->mutex);
+
+		mp4_mux_frame(vw->mux, (uint8_t *) vw->buf, vf.size, vf.usec,
+					(vf.flags & VIDEO_FRAME_KEYFRAME) ? TRUE : FALSE);
+		pthread_mutex_lock(&vw->mutex);
+		}
+	pthread_mutex_unlock(&vw->mutex);
+	vw->written = mp4_mux_close(vw->mux);
+	vw->mux = NULL;
+	free(vw->frames);
+	vw->frames = NULL;
+	}
+
+static void
+video_writer_h264(VideoWriter *vw)
+	{
+	uint64_t	position;
+	int			length;
+
+	if (fwrite(vw->header, vw->header_size, 1, vw->file) == 1)
+		vw->written += vw->header_size;
+
+	pthread_mutex_lock(&vw->mutex);
+	while (1)
+		{
+		while (vw->length == 0 && !vw->closing)
+			pthread_cond_wait(&vw->cond, &vw->mutex);
+		if (vw->length == 0)
+			break;
+
+		/* Copy out a chunk so an overrun can't change data being written.
+		|  If the callback overran during the copy, the chunk is dropped.
+		*/
+		position = vw->position;
+		length = MIN(vw->length, VIDEO_WRITER_CHUNK);
+		if (!video_writer_copy(vw, vw->buf, position, length))
+			continue;
+		vw->position = position + length;
+		vw->length -= length;
+		pthread_mutex_unlock(&vw->mutex);
+
+		if (fwrite(vw->buf, length, 1, vw->file) == 1)
+			vw->written += length;
+		pthread_mutex_lock(&vw->mutex);
+		}
+	pthread_mutex_unlock(&vw->mutex);
+	}
+
+static void *
+video_writer_thread(void *arg)
+	{
+	VideoWriter	*vw = (VideoWriter *) arg;
+
+	if (vw->mux)
+		video_writer_mp4(vw);
 	else
+		video_writer_h264(vw);
+
+	fclose(vw->file);
+	vw->file = NULL;
+	munmap(vw->data, 2 * (size_t) vw->ram_size);
+	if (vw->file_fd >= 0)
+		close(vw->file_fd);
+	free(vw->buf);
+	pthread_mutex_destroy(&vw->mutex);
+	pthread_cond_destroy(&vw->cond);
+
+	/* The rest of the record stop (MP4Box, notify, end command) needs the
+	|  file finished, so it runs from the event loop.
+	*/
+	event_add("video record finish", pikrellcam.t_now, 0,
+				video_record_finish, vw);
+	return NULL;
+	}
+
+  /* Called from video_record_start() with the vcb locked.  The writer gets
+  |  the file, writes the h264 header and then whatever is published.
+  |  With mp4mux the file is written by the mp4 muxer.
+  */
+VideoWriter *
+video_writer_open(VideoCircularBuffer *vcb, FILE *file, char *path,
+			boolean motion, boolean mp4box, boolean mp4mux)
+	{
+	VideoWriter		*vw;
+	pthread_attr_t	attr;
+	pthread_t		thread;
+
+	vw = calloc(1, sizeof(VideoWriter));
+	if ((vw->data = circular_buffer_map(vcb->fd, vcb->ram_size)) == NULL)
+		{
+		log_printf("Video writer mapping failed.  %m\n");
+		free(vw);
+		return NULL;
+		}
+	vw->file_fd = vcb->spill ? dup(vcb->file_fd) : -1;
+	if (mp4mux)
+		{
+		vw->mux = mp4_mux_open(file, vcb->h264_header,
+					vcb->h264_header_position,
+					pikrellcam.camera_config.video_width,
+					pikrellcam.camera_config.video_height,
+					pikrellcam.camera_adjust.video_fps,
+					pikrellcam.camera_adjust.video_mp4box_fps);
+		if (!vw->mux)
+			{
+			munmap(vw->data, 2 * (size_t) vcb->ram_size);
+			if (vw->file_fd >= 0)
+				close(vw->file_fd);
+			free(vw);
+			return NULL;
+			}
+		vw->frames_mask = vcb->frames_mask;
+		vw->frames = malloc((vw->frames_mask + 1) * sizeof(VideoFrame));
+		vw->tail_serial = UINT64_MAX;
+		}
+	vw->buf = malloc(VIDEO_WRITER_CHUNK);
+	vw->buf_size = VIDEO_WRITER_CHUNK;
+	vw->size = vcb->size;
+	vw->ram_size = vcb->ram_size;
+	vw->spill_serial = vcb->spill_serial;
+	vw->ram_read = UINT64_MAX;
+	vw->file = file;
+	vw->path = strdup(path);
+	vw->motion = motion;
+	vw->mp4box = mp4box;
+	vw->mp4mux = mp4mux;
+	memcpy(vw->header, vcb->h264_header, vcb->h264_header_position);
+	vw->header_size = vcb->h264_header_position;
+	pthread_mutex_init(&vw->mutex, NULL);
+	pthread_cond_init(&vw->cond, NULL);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, video_writer_thread, vw) != 0)
 		{
-		fwrite(vcb->data + vcb->tail, vcb->size - vcb->tail, 1, vcb->file);
-		fwrite(vcb->data, vcb->head, 1, vcb->file);
-		pikrellcam.video_size += vcb->head + vcb->size - vcb->tail;
+		log_printf("Video writer thread create failed.  %m\n");
+		munmap(vw->data, 2 * (size_t) vw->ram_size);
+		if (vw->file_fd >= 0)
+			close(vw->file_fd);
+		free(vw->buf);
+		free(vw->frames);
+		free(vw->mux);		/* nothing written or allocated yet */
+		pthread_mutex_destroy(&vw->mutex);
+		pthread_cond_destroy(&vw->cond);
+		free(vw->path);
+		free(vw);
+		vw = NULL;
 		}
-	vcb->tail = vcb->head;
+	pthread_attr_destroy(&attr);
+	vcb->writer = vw;
+	return vw;
+	}
+
+  /* Called from video_record_stop() with the vcb locked.  The writer
+  |  finishes what was published on its own.
+  */
+void
+video_writer_close(VideoCircularBuffer *vcb)
+	{
+	VideoWriter	*vw = vcb->writer;
+
+	if (!vw)
+		return;
+	vcb->writer = NULL;
+	pthread_mutex_lock(&vw->mutex);
+	vw->closing = TRUE;
+	pthread_cond_signal(&vw->cond);
+	pthread_mutex_unlock(&vw->mutex);
 	}
 
 static void
@@ -419,11 +1251,275 @@ h264_header_save(MMAL_BUFFER_HEADER_T *mmalbuf)
 		}
 	}
 
+  /* Start/stop capturing motion vectors to a file for motion-replay.
+  |  vcb should be locked.  The file is written by a motion writer thread.
+  */
+void
+motion_vectors_capture(boolean enable)
+	{
+	MotionFrame			*mf = &motion_frame;
+	MotionCaptureHeader	header;
+	char				*path;
+	int					size;
+
+	if (!enable)
+		{
+		if (mf->capture)
+			{
+			motion_writer_close(mf->capture);
+			mf->capture = NULL;
+			log_printf("Motion vector capture stopped.\n");
+			}
+		return;
+		}
+	if (mf->capture)
+		return;
+
+	/* Room for about a second of side info buffers in each of the writer's
+	|  two buffers.
+	*/
+	size = (sizeof(MotionCaptureFrame) + mf->vectors_size)
+				* MAX(pikrellcam.camera_adjust.video_fps, 8);
+	path = media_pathname(pikrellcam.media_dir, "vectors_%F_%H.%M.%S.mvec",
+						'\0', NULL, '\0', NULL);
+	if ((mf->capture = motion_writer_open(path, size)) != NULL)
+		{
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, MOTION_CAPTURE_MAGIC, sizeof(header.magic));
+		header.version = MOTION_CAPTURE_VERSION;
+		header.header_size = sizeof(header);
+		header.width = mf->width;
+		header.height = mf->height;
+		header.video_width = pikrellcam.camera_config.video_width;
+		header.video_height = pikrellcam.camera_config.video_height;
+		header.video_fps = pikrellcam.camera_adjust.video_fps;
+		header.mjpeg_divider = pikrellcam.mjpeg_divider;
+		header.vectors_size = mf->vectors_size;
+		motion_writer_put(mf->capture, &header, sizeof(header), NULL, 0);
+		log_printf("Motion vector capture: %s ...\n", path);
+		}
+	free(path);
+	}
+
+  /* Every side info buffer is captured, not just the mjpeg_divider ones,
+  |  so a replay can use a different divider.  Only copies into the
+  |  writer's buffer, the callback never waits on the file.
+  */
+static void
+motion_vectors_capture_write(MotionFrame *mf, MMAL_BUFFER_HEADER_T *mmalbuf)
+	{
+	MotionCaptureFrame	frame;
+	struct timeval		tv;
+
+	gettimeofday(&tv, NULL);
+	frame.usec = (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+	frame.length = mmalbuf->length;
+	frame.reserved = 0;
+	motion_writer_put(mf->capture, &frame, sizeof(frame),
+				mmalbuf->data, mmalbuf->length);
+	}
+
+  /* Called from the h264 callback.  If the motion thread has fallen
+  |  behind by a full queue the frame is dropped and counted rather than
+  |  holding up the encoder.
+  */
+static void
+motion_queue_put(MotionQueue *mq, MMAL_BUFFER_HEADER_T *mmalbuf)
+	{
+	MotionFrame		*mf = &motion_frame;
+	unsigned int	head = mq->head,
+					tail = __atomic_load_n(&mq->tail, __ATOMIC_ACQUIRE);
+
+	if (!mq->running)
+		return;
+	if (head - tail >= MOTION_QUEUE_SIZE)
+		{
+		/* Log at 1, 2, 4, 8 ... so a long overload does not flood the log.
+		*/
+		++mq->overflows;
+		if ((mq->overflows & (mq->overflows - 1)) == 0)
+			log_printf("motion thread behind: %u motion frames dropped\n",
+					mq->overflows);
+		return;
+		}
+	mmal_buffer_header_mem_lock(mmalbuf);
+	memcpy(mq->vectors[head & (MOTION_QUEUE_SIZE - 1)], mmalbuf->data,
+				MIN(mmalbuf->length, mf->vectors_size));
+	mmal_buffer_header_mem_unlock(mmalbuf);
+	__atomic_store_n(&mq->head, head + 1, __ATOMIC_RELEASE);
+	sem_post(&mq->sem);
+	}
+
+  /* Motion analysis runs here instead of in the h264 callback.  The
+  |  queued buffer is swapped with motion_frame.vectors so there's no second
+  |  copy.  motion_frame_process() locks the vcb only for its status and
+  |  record decisions, which publish a record start to the h264 callback through
+  |  vcb->state and the preview save flags to the I420 and mjpeg callbacks.
+  |  motion_frame_event then tells the I420 callback the motion frame is
+  |  ready to draw.
+  */
+static void *
+motion_thread(void *arg)
+	{
+	MotionQueue		*mq = (MotionQueue *) arg;
+	MotionFrame		*mf = &motion_frame;
+	MotionVector	*vectors, **slot;
+	unsigned int	tail;
+	uint64_t		t0;
+
+	while (1)
+		{
+		if (sem_wait(&mq->sem) != 0)
+			continue;
+		pthread_mutex_lock(&mf->process_mutex);
+		tail = mq->tail;
+		if (tail != __atomic_load_n(&mq->head, __ATOMIC_ACQUIRE))
+			{
+			slot = &mq->vectors[tail & (MOTION_QUEUE_SIZE - 1)];
+			vectors = mf->vectors;
+			mf->vectors = *slot;
+			*slot = vectors;
+			__atomic_store_n(&mq->tail, tail + 1, __ATOMIC_RELEASE);
+
+			t0 = monotonic_ns();
+			motion_frame_process(&video_circular_buffer, mf);
+			__atomic_add_fetch(&motion_load_ns, monotonic_ns() - t0,
+						__ATOMIC_RELAXED);
+			__atomic_store_n(&motion_frame_event, TRUE, __ATOMIC_RELEASE);
+			}
+		pthread_mutex_unlock(&mf->process_mutex);
+		}
+	return NULL;
+	}
+
+  /* Called from motion_init() with the process_mutex held, after the new
+  |  vectors_size is set and before motion_frame.vectors is reallocated, so
+  |  the motion thread can't swap an old size buffer in.  The vcb lock
+  |  keeps the h264 callback out of motion_queue_put().  Anything queued
+  |  from before a restart is dropped, and so are its semaphore posts.
+  */
+void
+motion_queue_reset(void)
+	{
+	MotionQueue	*mq = &motion_queue;
+	MotionFrame	*mf = &motion_frame;
+	int			i;
+
+	pthread_mutex_lock(&video_circular_buffer.mutex);
+	for (i = 0; i < MOTION_QUEUE_SIZE; ++i)
+		{
+		if (mq->vectors[i])
+			free(mq->vectors[i]);
+		mq->vectors[i] = calloc(1, mf->vectors_size);
+		}
+	mq->head = mq->tail = 0;
+	if (mq->running)
+		while (sem_trywait(&mq->sem) == 0)
+			;
+	else
+		sem_init(&mq->sem, 0, 0);
+	if (mq->overflows > 0)
+		log_printf("motion thread: %u motion frames dropped since last start\n",
+				mq->overflows);
+	mq->overflows = 0;
+	pthread_mutex_unlock(&video_circular_buffer.mutex);
+	}
+
+  /* Called from camera_start() after motion_init() has set up the queue.
+  */
+void
+motion_thread_start(void)
+	{
+	MotionQueue	*mq = &motion_queue;
+
+	if (mq->running)
+		return;
+	if (pthread_create(&mq->thread, NULL, motion_thread, mq) != 0)
+		{
+		log_printf("Aborting because the motion thread could not be created.\n");
+		exit(1);
+		}
+	mq->running = TRUE;
+	}
+
+#define MOTION_LOAD_UP_SECONDS		2
+#define MOTION_LOAD_DOWN_SECONDS	10
+
+  /* Called once a second from the main loop.  The motion frame divider is
+  |  raised a step after MOTION_LOAD_UP_SECONDS over motion_load_percent
+  |  (or with mjpeg frames skipped) and lowered a step after
+  |  MOTION_LOAD_DOWN_SECONDS where the load scaled to the lower divider
+  |  would still be under 80% of the limit, so it does not hunt between
+  |  two rates.  It never goes above the motion_load_min_fps floor.
+  */
+void
+motion_load_adapt(void)
+	{
+	MotionFrame		*mf = &motion_frame;
+	uint64_t		now, busy;
+	unsigned int	skips;
+	int				load, max_divider, divider = mf->divider;
+	static uint64_t	t_prev;
+	static int		over_seconds, under_seconds;
+
+	now = monotonic_ns();
+	busy = __atomic_exchange_n(&motion_load_ns, 0, __ATOMIC_RELAXED);
+	skips = __atomic_exchange_n(&motion_load_skips, 0, __ATOMIC_RELAXED);
+	if (t_prev == 0 || now <= t_prev)
+		{
+		t_prev = now;
+		return;
+		}
+	load = busy * 100 / (now - t_prev);
+	t_prev = now;
+
+	if (pikrellcam.motion_load_percent == 0)
+		{
+		over_seconds = under_seconds = 0;
+		mf->divider = pikrellcam.mjpeg_divider;
+		return;
+		}
+	max_divider = MAX(pikrellcam.mjpeg_divider,
+			pikrellcam.camera_adjust.video_fps / pikrellcam.motion_load_min_fps);
+
+	if (load > pikrellcam.motion_load_percent || skips > 0)
+		{
+		under_seconds = 0;
+		if (++over_seconds >= MOTION_LOAD_UP_SECONDS)
+			{
+			over_seconds = 0;
+			divider += 1;
+			}
+		}
+	else if (   divider > pikrellcam.mjpeg_divider
+	         && load * divider / (divider - 1)
+	                  < pikrellcam.motion_load_percent * 8 / 10
+	        )
+		{
+		over_seconds = 0;
+		if (++under_seconds >= MOTION_LOAD_DOWN_SECONDS)
+			{
+			under_seconds = 0;
+			divider -= 1;
+			}
+		}
+	else
+		over_seconds = under_seconds = 0;
+
+	divider = MIN(divider, max_divider);
+	divider = MAX(divider, pikrellcam.mjpeg_divider);
+	if (divider != mf->divider)
+		log_printf("motion load %d%% (%u mjpeg skips): motion frames %d/sec\n",
+				load, skips, pikrellcam.camera_adjust.video_fps / divider);
+	mf->divider = divider;
+	}
+
 void
 video_h264_encoder_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *mmalbuf)
 	{
 	VideoCircularBuffer *vcb = &video_circular_buffer;
-	int            i, end_space, event = 0;
+	int            event = 0;
+	uint64_t       serial;
 	time_t         t_cur = pikrellcam.t_now;
 	static int     fps_count;
 	static time_t  t_prev;
@@ -442,59 +1538,33 @@ video_h264_encoder_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *mmalbuf)
 		h264_header_save(mmalbuf);
 	else if (mmalbuf->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO)
 		{
-		if (++fps_count >= pikrellcam.mjpeg_divider)
+		if (motion_frame.capture)
 			{
-			motion_frame_event = TRUE;		/* synchronize with i420 callback */
-			fps_count = 0;
 			mmal_buffer_header_mem_lock(mmalbuf);
-			memcpy(motion_frame.vectors, mmalbuf->data, motion_frame.vectors_size);
+			motion_vectors_capture_write(&motion_frame, mmalbuf);
 			mmal_buffer_header_mem_unlock(mmalbuf);
-			motion_frame_process(vcb, &motion_frame);
+			}
+		if (++fps_count >= motion_frame.divider)
+			{
+			fps_count = 0;
+			motion_queue_put(&motion_queue, mmalbuf);
 			}
 		}
 	else
 		{
-		if (  (mmalbuf->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME)
-		    && !vcb->in_keyframe
-		   )
+		if (!vcb->in_frame)
 			{
-			/* Keep key_frame[cur_frame_index] always pointing to the latest
-			|  keyframe (this one) in the video buffer.  Then adjust the
-			|  key_frame[pre_frame_index] to point to a keyframe
-			|  in the video buffer that is pre_capture time behind.
-			|  If paused, always keep tail pointing to the latest keyframe.
+			/* First buffer of a frame.  If paused, always keep tail
+			|  pointing to the latest keyframe.
 			*/
-			vcb->in_keyframe = TRUE;
-			vcb->cur_frame_index = (vcb->cur_frame_index + 1) % KEYFRAME_SIZE;
-			vcb->key_frame[vcb->cur_frame_index].position = vcb->head;
-			vcb->key_frame[vcb->cur_frame_index].frame_count = 0;
-			if (vcb->pause && vcb->state == VCB_STATE_MANUAL_RECORD)
-				vcb->tail = vcb->head;
-			vcb->key_frame[vcb->cur_frame_index].t_frame = t_cur;
-
-			while (t_cur - vcb->key_frame[vcb->pre_frame_index].t_frame
-						 > pikrellcam.motion_times.pre_capture)
-				{
-				vcb->pre_frame_index = (vcb->pre_frame_index + 1) % KEYFRAME_SIZE;
-				if (vcb->pre_frame_index == vcb->cur_frame_index)
-					break;
-				}
-			}
-		if (mmalbuf->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)
-			{
-			vcb->in_keyframe = FALSE;
-			i = vcb->pre_frame_index; 
-			while (1)
+			vcb->in_frame = TRUE;
+			video_frame_start(vcb, mmalbuf);
+			if (mmalbuf->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME)
 				{
-				vcb->key_frame[i].frame_count += 1;
-				if (i++ == vcb->cur_frame_index)
-					break;
-				i %= KEYFRAME_SIZE;
+				if (vcb->pause && vcb->state == VCB_STATE_MANUAL_RECORD)
+					vcb->tail = vcb->data_serial;
+				video_writer_resync(vcb);
 				}
-			if (vcb->state == VCB_STATE_MOTION_RECORD)
-				vcb->frame_count += 1;
-			else
-				vcb->frame_count = vcb->key_frame[vcb->pre_frame_index].frame_count;
 			}
 		if (t_cur > t_prev)
 			{
@@ -517,19 +1587,20 @@ video_h264_encoder_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *mmalbuf)
 
 		if (vcb->state == VCB_STATE_MOTION_RECORD_START)
 			{
-			/* Write mp4 header and set tail to beginning of pre_capture
-			|  video data, then write the entire pre_capture time data.
-			|  The keyframe data we collected above keeps a pointer to
-			|  video data close to the pre_capture time we want.
+			/* The writer has the mp4 header, so set tail to beginning of
+			|  pre_capture video data, then publish the entire pre_capture
+			|  time data.  The frame index finds the keyframe closest to
+			|  the pre_capture time we want.
 			*/
-			fwrite(vcb->h264_header, 1, vcb->h264_header_position, vcb->file);
-			pikrellcam.video_header_size = vcb->h264_header_position;
-			pikrellcam.video_size = vcb->h264_header_position;
-			vcb->tail = vcb->key_frame[vcb->pre_frame_index].position;
+			serial = video_frame_pre_capture(vcb);
+			vcb->tail = video_frame_byte(vcb, serial);
 			vcb_video_write(vcb);
-			vcb->record_start = t_cur - pikrellcam.motion_times.pre_capture;
+			vcb->record_start = t_cur;
+			if (serial < vcb->frame_next)
+				vcb->record_start -= (VIDEO_FRAME(vcb, vcb->frame_next - 1)->usec
+						- VIDEO_FRAME(vcb, serial)->usec + 500000) / 1000000;
 			vcb->motion_sync_time = t_cur + pikrellcam.motion_times.post_capture;
-//			vcb->frame_count = vcb->key_frame[vcb->pre_frame_index].frame_count;
+			vcb->frame_count = vcb->frame_next - serial;
 			vcb->state = VCB_STATE_MOTION_RECORD;
 
 			/* Schedule any motion begin command.
@@ -539,13 +1610,14 @@ video_h264_encoder_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *mmalbuf)
 
 		if (vcb->state == VCB_STATE_MANUAL_RECORD_START)
 			{
-			/* Write mp4 header and set tail to most recent keyframe.
-			|  So manual records may have up to about a sec pre_capture.
+			/* The writer has the mp4 header, so set tail to most recent
+			|  keyframe.  So manual records may have up to about a sec
+			|  pre_capture.
 			*/
-			fwrite(vcb->h264_header, 1, vcb->h264_header_position, vcb->file);
-			pikrellcam.video_header_size = vcb->h264_header_position;
-			pikrellcam.video_size = vcb->h264_header_position;
-			vcb->tail = vcb->key_frame[vcb->cur_frame_index].position;
+			if (vcb->keyframe_last >= vcb->frame_first)
+				vcb->tail = video_frame_byte(vcb, vcb->keyframe_last);
+			else
+				vcb->tail = vcb->data_serial;
 			vcb->record_start = t_cur;
 			vcb->state = VCB_STATE_MANUAL_RECORD;
 			event |= EVENT_PREVIEW_SAVE;
@@ -556,26 +1628,26 @@ video_h264_encoder_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *mmalbuf)
 
 		/* Save video data into the circular buffer.
 		*/
+		video_spill_check(vcb, mmalbuf->length);
+		video_writer_lag_check(vcb, mmalbuf->length);
 		mmal_buffer_header_mem_lock(mmalbuf);
-		end_space = vcb->size - vcb->head;
-		if (mmalbuf->length <= end_space)
-			{
-			memcpy(vcb->data + vcb->head, mmalbuf->data, mmalbuf->length);
-			if(h264_conn_status == H264_TCP_SEND_DATA) 
-				tcp_send_h264_data("data 1",vcb->data + vcb->head, mmalbuf->length);
-			}
-		else
+		memcpy(vcb->data + vcb->head, mmalbuf->data, mmalbuf->length);
+		if (h264_conn_status == H264_TCP_SEND_DATA)
+			tcp_send_h264_data("data", vcb->data + vcb->head, mmalbuf->length);
+		vcb->head = (vcb->head + mmalbuf->length) % vcb->ram_size;
+		vcb->data_serial += mmalbuf->length;
+		VIDEO_FRAME(vcb, vcb->frame_next - 1)->size += mmalbuf->length;
+		mmal_buffer_header_mem_unlock(mmalbuf);
+		video_spill_signal(vcb);
+
+		if (mmalbuf->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)
 			{
-			memcpy(vcb->data + vcb->head, mmalbuf->data, end_space);
-			memcpy(vcb->data, mmalbuf->data + end_space, mmalbuf->length - end_space);
-			if (h264_conn_status == H264_TCP_SEND_DATA) 
-      			{
-				tcp_send_h264_data("data 2",vcb->data + vcb->head, end_space);
-				tcp_send_h264_data("data 3",vcb->data, mmalbuf->length - end_space);
-				}
+			vcb->in_frame = FALSE;
+			if (vcb->state == VCB_STATE_MOTION_RECORD)
+				vcb->frame_count += 1;
+			else
+				vcb->frame_count = vcb->frame_next - video_frame_pre_capture(vcb);
 			}
-		vcb->head = (vcb->head + mmalbuf->length) % vcb->size;
-		mmal_buffer_header_mem_unlock(mmalbuf);
 
 		/* And write video data to a video file according to record state.
 		*/
@@ -0,0 +1,378 @@
+/* PiKrellCam
+|
+|  Copyright (C) 2015 Bill Wilson    billw@gkrellm.net
+|
+|  PiKrellCam is free software: you can redistribute it and/or modify it
+|  under the terms of the GNU General Public License as published by
+|  the Free Software Foundation, either version 3 of the License, or
+|  (at your option) any later version.
+|
+|  PiKrellCam is distributed in the hope that it will be useful, but WITHOUT
+|  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+|  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+|  License for more details.
+|
+|  You should have received a copy of the GNU General Public License
+|  along with this program. If not, see http://www.gnu.org/licenses/
+|
+|  This file is part of PiKrellCam.
+*/
+
+  /* Motion engine microbenchmark.  Runs motion_frame_process() over
+  |  generated vector fields for each scene, video size and region count
+  |  and prints CSV:
+  |
+  |    video,scene,regions,frames,ns_per_frame,cycles_per_mb,cycles_from
+  |
+  |  cycles_from is "perf" if the CPU cycle counter could be read, "cpufreq"
+  |  if cycles are estimated from the current CPU clock, else "none" (-1).
+  |  Build and run with "make bench".  Options:
+  |      motion-bench [-frames n] [-o option value] [-scene name]
+  */
+
+#include "pikrellcam.h"
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define	SCENE_FRAMES	32		/* distinct generated frames per scene */
+
+typedef struct
+	{
+	char	*name;
+	void	(*generate)(MotionVector *mv, int frame);
+	}
+	Scene;
+
+typedef struct
+	{
+	int		width,
+			height;
+	}
+	VideoSize;
+
+static VideoSize	video_sizes[] =
+	{
+	{ 1280, 720 },
+	{ 1920, 1080 },
+	};
+
+static int	region_counts[] = { 1, 2, 4, 8, 16 };
+
+static int		mb_width, mb_height;
+static uint32_t	rand_state;
+
+
+  /* Own generator so scenes are the same on every host.
+  */
+static int
+bench_rand(int n)
+	{
+	rand_state = rand_state * 1103515245 + 12345;
+	return (int) ((rand_state >> 8) % n);
+	}
+
+static void
+mv_set(MotionVector *mv, int x, int y, int vx, int vy)
+	{
+	if (x < 0 || y < 0 || x >= mb_width || y >= mb_height)
+		return;
+	mv += y * mb_width + x;
+	mv->vx = vx;
+	mv->vy = vy;
+	}
+
+static void
+object_draw(MotionVector *mv, int x0, int y0, int w, int h, int vx, int vy)
+	{
+	int		x, y;
+
+	for (y = y0; y < y0 + h; ++y)
+		for (x = x0; x < x0 + w; ++x)
+			mv_set(mv, x, y, vx + bench_rand(3) - 1, vy + bench_rand(3) - 1);
+	}
+
+  /* Small sensor noise, nothing reaches the default magnitude limit.
+  */
+static void
+scene_quiet(MotionVector *mv, int frame)
+	{
+	int		i;
+
+	for (i = 0; i < mb_width * mb_height; ++i)
+		{
+		mv[i].vx = bench_rand(3) - 1;
+		mv[i].vy = bench_rand(3) - 1;
+		}
+	}
+
+  /* Dusk/dawn noise: isolated larger vectors in about 3% of blocks.
+  */
+static void
+scene_sparkle(MotionVector *mv, int frame)
+	{
+	int		i;
+
+	scene_quiet(mv, frame);
+	for (i = 0; i < mb_width * mb_height * 3 / 100; ++i)
+		mv_set(mv, bench_rand(mb_width), bench_rand(mb_height),
+				bench_rand(41) - 20, bench_rand(41) - 20);
+	}
+
+  /* Rain: short vertical streaks pointing down in random columns.
+  */
+static void
+scene_rain(MotionVector *mv, int frame)
+	{
+	int		i, j, x, y, len;
+
+	scene_quiet(mv, frame);
+	for (i = 0; i < mb_width / 3; ++i)
+		{
+		x = bench_rand(mb_width);
+		y = bench_rand(mb_height);
+		len = 2 + bench_rand(6);
+		for (j = 0; j < len; ++j)
+			mv_set(mv, x, y + j, bench_rand(3) - 1, 6 + bench_rand(8));
+		}
+	}
+
+static void
+scene_object(MotionVector *mv, int frame)
+	{
+	scene_quiet(mv, frame);
+	object_draw(mv, 5 + frame * 2 % (mb_width - 20), mb_height / 3,
+				12, 9, -8, 0);
+	}
+
+static void
+scene_objects(MotionVector *mv, int frame)
+	{
+	static int	dir[][2] = { {-8, 0}, {8, 0}, {0, 7}, {6, 6}, {-6, 5}, {9, -3} };
+	int			i, x, y;
+
+	scene_sparkle(mv, frame);
+	for (i = 0; i < 6; ++i)
+		{
+		x = (i * mb_width / 6 + frame * dir[i][0] / 4 + mb_width) % mb_width;
+		y = (mb_height / 4 + i * mb_height / 9 + frame * dir[i][1] / 4
+					+ mb_height) % mb_height;
+		object_draw(mv, x, y, 6 + i, 5 + i % 3, dir[i][0], dir[i][1]);
+		}
+	}
+
+  /* Camera pan or a large close object: the whole frame moves.
+  */
+static void
+scene_burst(MotionVector *mv, int frame)
+	{
+	object_draw(mv, 0, 0, mb_width, mb_height, 10, -4);
+	}
+
+static Scene	scenes[] =
+	{
+	{ "quiet",   scene_quiet },
+	{ "sparkle", scene_sparkle },
+	{ "rain",    scene_rain },
+	{ "object",  scene_object },
+	{ "objects", scene_objects },
+	{ "burst",   scene_burst },
+	};
+
+#define N_SCENES		(sizeof(scenes) / sizeof(Scene))
+#define N_VIDEO_SIZES	(sizeof(video_sizes) / sizeof(VideoSize))
+#define N_REGION_COUNTS	(sizeof(region_counts) / sizeof(int))
+
+
+static int		perf_fd = -1;
+static double	cpu_ghz;
+
+static void
+cycles_init(void)
+	{
+	struct perf_event_attr	pe;
+	FILE	*f;
+	char	buf[128];
+	double	mhz;
+
+	memset(&pe, 0, sizeof(pe));
+	pe.type = PERF_TYPE_HARDWARE;
+	pe.size = sizeof(pe);
+	pe.config = PERF_COUNT_HW_CPU_CYCLES;
+	pe.disabled = 1;
+	pe.exclude_kernel = 1;
+	pe.exclude_hv = 1;
+	perf_fd = syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+	if (perf_fd >= 0)
+		return;
+
+	if ((f = fopen("/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq", "r")) != NULL)
+		{
+		if (fgets(buf, sizeof(buf), f))
+			cpu_ghz = atof(buf) / 1e6;		/* kHz */
+		fclose(f);
+		}
+	if (cpu_ghz == 0 && (f = fopen("/proc/cpuinfo", "r")) != NULL)
+		{
+		while (fgets(buf, sizeof(buf), f))
+			if (sscanf(buf, "cpu MHz : %lf", &mhz) == 1)
+				{
+				cpu_ghz = mhz / 1000;
+				break;
+				}
+		fclose(f);
+		}
+	}
+
+static void
+cycles_start(void)
+	{
+	if (perf_fd >= 0)
+		{
+		ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+
+static double
+cycles_stop(void)
+	{
+	uint64_t	count;
+
+	if (perf_fd >= 0)
+		{
+		ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(perf_fd, &count, sizeof(count)) == sizeof(count))
+			return (double) count;
+		}
+	return 0;
+	}
+
+static char *
+cycles_from(void)
+	{
+	return (perf_fd >= 0) ? "perf" : (cpu_ghz > 0) ? "cpufreq" : "none";
+	}
+
+static double
+ns_now(void)
+	{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+	}
+
+  /* Tile the frame with n regions, same total area for every n.
+  */
+static void
+regions_set(int n)
+	{
+	char	buf[100];
+	int		i, cols, rows;
+
+	for (cols = 1; cols * cols < n; ++cols)
+		;
+	rows = (n + cols - 1) / cols;
+	motion_command("delete_regions all");
+	for (i = 0; i < n; ++i)
+		{
+		snprintf(buf, sizeof(buf), "add_region %.3f %.3f %.3f %.3f",
+			0.05 + 0.9 * (i % cols) / cols, 0.05 + 0.9 * (i / cols) / rows,
+			0.9 / cols, 0.9 / rows);
+		motion_command(buf);
+		}
+	}
+
+int
+main(int argc, char *argv[])
+	{
+	VideoCircularBuffer	*vcb = &video_circular_buffer;
+	MotionFrame		*mf = &motion_frame;
+	VideoSize		*vs;
+	Scene			*scene;
+	MotionVector	*frames;
+	char			*scene_name = NULL;
+	int				i, r, n, n_frames = 2000, n_blocks;
+	uint64_t		usec;
+	double			ns, cycles;
+
+	for (i = 1; i < argc; ++i)
+		{
+		if (!strcmp(argv[i], "-frames") && i + 1 < argc)
+			n_frames = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-scene") && i + 1 < argc)
+			scene_name = argv[++i];
+		else if (!strcmp(argv[i], "-o") && i + 2 < argc)
+			{
+			if (!offline_config_set(argv[i + 1], argv[i + 2]))
+				{
+				fprintf(stderr, "Bad option: %s %s\n", argv[i + 1], argv[i + 2]);
+				exit(1);
+				}
+			i += 2;
+			}
+		else
+			{
+			fprintf(stderr,
+				"usage: %s [-frames n] [-o option value] [-scene name]\n", argv[0]);
+			exit(1);
+			}
+		}
+	cycles_init();
+
+	printf("video,scene,regions,frames,ns_per_frame,cycles_per_mb,cycles_from\n");
+	for (vs = video_sizes; vs < video_sizes + N_VIDEO_SIZES; ++vs)
+		{
+		offline_init(vs->width, vs->height, 24, 1);
+		mb_width = mf->width;
+		mb_height = mf->height;
+		n_blocks = mb_width * mb_height;
+		frames = malloc(SCENE_FRAMES * mf->vectors_size);
+
+		for (scene = scenes; scene < scenes + N_SCENES; ++scene)
+			{
+			if (scene_name && strcmp(scene_name, scene->name))
+				continue;
+			rand_state = 1;
+			memset(frames, 0, SCENE_FRAMES * mf->vectors_size);
+			for (i = 0; i < SCENE_FRAMES; ++i)
+				scene->generate(frames + i * n_blocks, i);
+
+			for (r = 0; r < N_REGION_COUNTS; ++r)
+				{
+				regions_set(region_counts[r]);
+				memset(vcb, 0, sizeof(*vcb));
+				usec = 1000000000ULL * 1000000;
+				offline_clock_set(usec);
+				pikrellcam.t_start = 0;
+
+				ns = 0;
+				cycles = 0;
+				for (n = 0; n < n_frames; ++n)
+					{
+					memcpy(mf->vectors, frames + (n % SCENE_FRAMES) * n_blocks,
+								mf->vectors_size);
+					usec += 1000000 / 6;
+					offline_clock_set(usec);
+
+					cycles_start();
+					ns -= ns_now();
+					motion_frame_process(vcb, mf);
+					ns += ns_now();
+					cycles += cycles_stop();
+					offline_video_frame(vcb);
+					}
+				if (perf_fd < 0)
+					cycles = (cpu_ghz > 0) ? ns * cpu_ghz : -1;
+				printf("%dx%d,%s,%d,%d,%.0f,%.2f,%s\n",
+					vs->width, vs->height, scene->name, region_counts[r],
+					n_frames, ns / n_frames,
+					cycles < 0 ? -1.0 : cycles / n_frames / n_blocks,
+					cycles_from());
+				}
+			}
+		free(frames);
+		}
+	return 0;
+	}
@@ -0,0 +1,207 @@
+/* PiKrellCam
+|
+|  Copyright (C) 2015 Bill Wilson    billw@gkrellm.net
+|
+|  PiKrellCam is free software: you can redistribute it and/or modify it
+|  under the terms of the GNU General Public License as published by
+|  the Free Software Foundation, either version 3 of the License, or
+|  (at your option) any later version.
+|
+|  PiKrellCam is distributed in the hope that it will be useful, but WITHOUT
+|  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+|  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+|  License for more details.
+|
+|  You should have received a copy of the GNU General Public License
+|  along with this program. If not, see http://www.gnu.org/licenses/
+|
+|  This file is part of PiKrellCam.
+*/
+
+  /* Replay a capture_vectors file through motion_frame_process() with the
+  |  capture timestamps as the clock.  Prints a line for each motion detect
+  |  and each motion video begin/end, then a summary with the processing
+  |  rate.  Built with PIKRELLCAM_NO_MMAL so it runs on any Linux host:
+  |
+  |      make replay
+  |      ./motion-replay [-v] [-vm] [-r regions-file] [-o option value]
+  |                      [-divider n] [-repeat n] file.mvec
+  */
+
+#include "pikrellcam.h"
+
+static void
+usage(char *name)
+	{
+	fprintf(stderr,
+		"usage: %s [-v] [-vm] [-r regions-file] [-o option value]\n"
+		"          [-divider n] [-repeat n] file.mvec\n", name);
+	exit(1);
+	}
+
+static double
+cpu_seconds(void)
+	{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+	}
+
+static char *
+motion_status_string(int status)
+	{
+	if ((status & (MOTION_VECTOR | MOTION_BURST)) == (MOTION_VECTOR | MOTION_BURST))
+		return "both";
+	else if (status & MOTION_VECTOR)
+		return "vector";
+	else if (status & MOTION_BURST)
+		return "burst";
+	else if (status & MOTION_SAD)
+		return "sad";
+	else if (status & MOTION_PIXEL)
+		return "pixel";
+	return "pending";
+	}
+
+int
+main(int argc, char *argv[])
+	{
+	VideoCircularBuffer	*vcb = &video_circular_buffer;
+	MotionFrame			*mf = &motion_frame;
+	MotionCaptureHeader	header;
+	MotionCaptureFrame	frame;
+	FILE				*f;
+	uint8_t				*data = NULL;
+	uint64_t			usec_start = 0, usec_offset = 0, usec_now = 0;
+	char				*path = NULL, *regions = NULL;
+	int					i, event, data_size = 0, divider = 0, repeat = 1,
+						fps_count = 0, n_frames = 0, n_motion = 0,
+						n_detects = 0, n_videos = 0;
+	double				t0, cpu = 0;
+
+	for (i = 1; i < argc; ++i)
+		{
+		if (!strcmp(argv[i], "-v"))
+			pikrellcam.verbose = TRUE;
+		else if (!strcmp(argv[i], "-vm"))
+			pikrellcam.verbose_motion = TRUE;
+		else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+			regions = argv[++i];
+		else if (!strcmp(argv[i], "-divider") && i + 1 < argc)
+			divider = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-repeat") && i + 1 < argc)
+			repeat = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-o") && i + 2 < argc)
+			{
+			if (!offline_config_set(argv[i + 1], argv[i + 2]))
+				{
+				fprintf(stderr, "Bad option: %s %s\n", argv[i + 1], argv[i + 2]);
+				exit(1);
+				}
+			i += 2;
+			}
+		else if (argv[i][0] != '-' && !path)
+			path = argv[i];
+		else
+			usage(argv[0]);
+		}
+	if (!path)
+		usage(argv[0]);
+
+	if ((f = fopen(path, "r")) == NULL)
+		{
+		fprintf(stderr, "Cannot open %s: %m\n", path);
+		exit(1);
+		}
+	if (   fread(&header, sizeof(header), 1, f) != 1
+	    || memcmp(header.magic, MOTION_CAPTURE_MAGIC, sizeof(header.magic))
+	    || header.version != MOTION_CAPTURE_VERSION
+	   )
+		{
+		fprintf(stderr, "%s: not a version %d motion vector capture file.\n",
+				path, MOTION_CAPTURE_VERSION);
+		exit(1);
+		}
+	fseek(f, header.header_size, SEEK_SET);
+
+	offline_init(header.video_width, header.video_height, header.video_fps,
+				divider > 0 ? divider : header.mjpeg_divider);
+	if (regions && !motion_regions_config_load(regions, FALSE))
+		exit(1);
+	if (mf->vectors_size != header.vectors_size)
+		{
+		fprintf(stderr, "Vector size mismatch: %d (file %d).\n",
+				mf->vectors_size, header.vectors_size);
+		exit(1);
+		}
+	printf("# %s: %dx%d video (%dx%d macroblocks) %d fps divider %d\n",
+			path, header.video_width, header.video_height,
+			mf->width, mf->height, header.video_fps, pikrellcam.mjpeg_divider);
+
+	while (repeat > 0)
+		{
+		if (fread(&frame, sizeof(frame), 1, f) != 1)
+			{
+			/* Next repeat continues the clock from the end of the file.
+			*/
+			if (--repeat > 0)
+				{
+				usec_offset = usec_now - usec_start + 1000000;
+				fseek(f, header.header_size, SEEK_SET);
+				}
+			continue;
+			}
+		if (frame.length > data_size)
+			{
+			data_size = frame.length;
+			data = realloc(data, data_size);
+			}
+		if (fread(data, frame.length, 1, f) != 1)
+			break;
+		if (usec_start == 0)
+			{
+			usec_start = frame.usec;
+			offline_clock_set(frame.usec);
+			pikrellcam.t_start = pikrellcam.t_now;
+			}
+		usec_now = frame.usec + usec_offset;
+		offline_clock_set(usec_now);
+		++n_frames;
+
+		if (++fps_count >= pikrellcam.mjpeg_divider)
+			{
+			fps_count = 0;
+			memcpy(mf->vectors, data, MIN(frame.length, mf->vectors_size));
+			t0 = cpu_seconds();
+			motion_frame_process(vcb, mf);
+			cpu += cpu_seconds() - t0;
+			++n_motion;
+			if (mf->motion_status != MOTION_NONE)
+				{
+				if (mf->motion_status & MOTION_DETECTED)
+					++n_detects;
+				printf("%.3f motion %s count:%d reject:%d\n",
+					(usec_now - usec_start) / 1e6,
+					motion_status_string(mf->motion_status),
+					mf->frame_vector.mag2_count, mf->reject_count);
+				}
+			}
+		event = offline_video_frame(vcb);
+		if (event == EVENT_MOTION_BEGIN)
+			{
+			++n_videos;
+			printf("%.3f video begin\n", (usec_now - usec_start) / 1e6);
+			}
+		else if (event == EVENT_MOTION_END)
+			printf("%.3f video end\n", (usec_now - usec_start) / 1e6);
+		}
+	fclose(f);
+
+	printf("# frames:%d motion_frames:%d detects:%d videos:%d\n",
+			n_frames, n_motion, n_detects, n_videos);
+	printf("# cpu:%.3f sec  %.0f motion frames/sec/core  %.1f usec/frame\n",
+			cpu, cpu > 0 ? n_motion / cpu : 0.0,
+			n_motion > 0 ? 1e6 * cpu / n_motion : 0.0);
+	return 0;
+	}
@@ -0,0 +1,105 @@
+/* PiKrellCam
+|
+|  Copyright (C) 2015 Bill Wilson    billw@gkrellm.net
+|
+|  PiKrellCam is free software: you can redistribute it and/or modify it
+|  under the terms of the GNU General Public License as published by
+|  the Free Software Foundation, either version 3 of the License, or
+|  (at your option) any later version.
+|
+|  PiKrellCam is distributed in the hope that it will be useful, but WITHOUT
+|  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+|  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+|  License for more details.
+|
+|  You should have received a copy of the GNU General Public License
+|  along with this program. If not, see http://www.gnu.org/licenses/
+|
+|  This file is part of PiKrellCam.
+*/
+
+  /* Convert a motion_stats_binary .mstats file to the motion_stats .csv
+  |  format on stdout.  With -r, per region columns are added after the
+  |  frame columns.  Build with "make stats":
+  |
+  |      ./motion-stats [-r] file.mstats > file.csv
+  */
+
+#include "pikrellcam.h"
+
+static void
+usage(char *name)
+	{
+	fprintf(stderr, "usage: %s [-r] file.mstats\n", name);
+	exit(1);
+	}
+
+int
+main(int argc, char *argv[])
+	{
+	MotionStatsHeader	header;
+	MotionStatsRecord	*rec;
+	MotionStatsRegion	*sreg;
+	FILE				*f;
+	char				*path = NULL, *buf;
+	boolean				regions = FALSE;
+	int					i, r, fps;
+
+	for (i = 1; i < argc; ++i)
+		{
+		if (!strcmp(argv[i], "-r"))
+			regions = TRUE;
+		else if (argv[i][0] != '-' && !path)
+			path = argv[i];
+		else
+			usage(argv[0]);
+		}
+	if (!path)
+		usage(argv[0]);
+
+	if ((f = fopen(path, "r")) == NULL)
+		{
+		fprintf(stderr, "Cannot open %s: %m\n", path);
+		exit(1);
+		}
+	if (   fread(&header, sizeof(header), 1, f) != 1
+	    || memcmp(header.magic, MOTION_STATS_MAGIC, sizeof(header.magic))
+	    || header.version != MOTION_STATS_VERSION
+	    || header.record_size < sizeof(MotionStatsRecord)
+	                + header.n_regions * sizeof(MotionStatsRegion)
+	   )
+		{
+		fprintf(stderr, "%s: not a version %d motion stats file.\n",
+				path, MOTION_STATS_VERSION);
+		exit(1);
+		}
+	fseek(f, header.header_size, SEEK_SET);
+	fps = header.video_fps > 0 ? header.video_fps : 1;
+
+	printf("time, x, y, dx, dy, magnitude, count, track, age, distance, speed");
+	for (r = 0; regions && r < header.n_regions; ++r)
+		printf(", r%d_x, r%d_y, r%d_dx, r%d_dy, r%d_count, r%d_reject, r%d_sparkle, r%d_motion",
+				r, r, r, r, r, r, r, r);
+	printf("\n# width %d height %d\n", header.width, header.height);
+
+	buf = malloc(header.record_size);
+	rec = (MotionStatsRecord *) buf;
+	while (fread(buf, header.record_size, 1, f) == 1)
+		{
+		printf("%6.3f, %3d, %3d, %3d, %3d, %3.0f, %4d, %3d, %3d, %5.1f, %5.1f",
+			(float) rec->frame_count / (float) fps,
+			rec->x, rec->y, rec->dx, rec->dy,
+			sqrt((float) rec->mag2), rec->count,
+			rec->track_id, rec->track_age,
+			rec->track_distance / 10.0, rec->track_speed / 10.0);
+		sreg = (MotionStatsRegion *) (rec + 1);
+		for (r = 0; regions && r < header.n_regions; ++r, ++sreg)
+			printf(", %3d, %3d, %3d, %3d, %4d, %4d, %4d, %d",
+				sreg->x, sreg->y, sreg->dx, sreg->dy, sreg->count,
+				sreg->reject_count, sreg->sparkle_count, sreg->motion);
+		printf("\n");
+		}
+	free(buf);
+	fclose(f);
+	return 0;
+	}
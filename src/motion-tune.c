@@ -0,0 +1,521 @@
+/* PiKrellCam
+|
+|  Copyright (C) 2015 Bill Wilson    billw@gkrellm.net
+|
+|  PiKrellCam is free software: you can redistribute it and/or modify it
+|  under the terms of the GNU General Public License as published by
+|  the Free Software Foundation, either version 3 of the License, or
+|  (at your option) any later version.
+|
+|  PiKrellCam is distributed in the hope that it will be useful, but WITHOUT
+|  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+|  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+|  License for more details.
+|
+|  You should have received a copy of the GNU General Public License
+|  along with this program. If not, see http://www.gnu.org/licenses/
+|
+|  This file is part of PiKrellCam.
+*/
+
+  /* Sweep motion options over a set of capture_vectors recordings and score
+  |  each parameter set against labelled events.  The recordings are read
+  |  once, then worker threads (one per core by default) each take whole
+  |  parameter sets and replay every recording with them.  The motion engine
+  |  globals are thread local in PIKRELLCAM_NO_MMAL builds so the workers
+  |  don't share any motion state.  Build with "make tune":
+  |
+  |      ./motion-tune [-j threads] [-r regions-file] [-o option value]
+  |                    [-s option values] [-divider n] [-top n] labels-file
+  |
+  |  -s sweeps an offline option over values given as a comma list and/or
+  |  first:last[:step] ranges, eg "-s motion_magnitude_limit 4:10:2".  With
+  |  no -s, motion_magnitude_limit, motion_magnitude_limit_count,
+  |  motion_burst_count, motion_burst_frames and motion_confirm_gap are swept
+  |  over a default grid.  Every combination of the swept values is a set.
+  |
+  |  The labels file has a line for each recording and a line for each event
+  |  in it.  Times are seconds from the first frame as motion-replay prints:
+  |
+  |      # recording     start  end   label
+  |      driveway.mvec
+  |      driveway.mvec   41.5   52.0  true
+  |      driveway.mvec   3.0    30.0  false
+  |
+  |  A true event is found if a motion video overlaps it, else it is missed.
+  |  A video that overlaps no true event is a false video.  Sets are printed
+  |  as CSV, fewest errors (missed + false videos) first, ties broken by the
+  |  number of false events that got a video.
+  */
+
+#include "pikrellcam.h"
+#include <stddef.h>
+
+#define	TUNE_SWEEPS_MAX		8
+
+typedef struct
+	{
+	double	start,
+			end;
+	boolean	is_true;
+	}
+	TuneEvent;
+
+typedef struct
+	{
+	uint64_t	usec;
+	uint8_t		*data;		/* NULL for frames the divider skips */
+	}
+	TuneFrame;
+
+typedef struct
+	{
+	char				*path;
+	MotionCaptureHeader	header;
+	TuneFrame			*frames;
+	int					n_frames,
+						divider;
+	TuneEvent			*events;
+	int					n_events;
+	}
+	TuneRecording;
+
+typedef struct
+	{
+	char	*option;
+	int		*values;
+	int		n_values;
+	}
+	TuneSweep;
+
+typedef struct
+	{
+	int		values[TUNE_SWEEPS_MAX];
+	int		set,			/* order the set was generated in */
+			missed,
+			false_videos,
+			false_events,
+			videos;
+	}
+	TuneResult;
+
+static TuneRecording	*recordings;
+static int				n_recordings;
+
+static TuneSweep		sweeps[TUNE_SWEEPS_MAX];
+static int				n_sweeps;
+
+static TuneResult		*results;
+static int				n_results,
+						next_result;
+
+static char				*base_options[64][2];
+static int				n_base_options;
+static char				*regions;
+static int				divider;
+
+static char *default_sweeps[][2] =
+	{
+	{ "motion_magnitude_limit",       "4:10:2" },
+	{ "motion_magnitude_limit_count", "3:9:2" },
+	{ "motion_burst_count",           "200,400,800" },
+	{ "motion_burst_frames",          "2:4" },
+	{ "motion_confirm_gap",           "0:4:2" },
+	};
+
+static void
+usage(char *name)
+	{
+	fprintf(stderr,
+		"usage: %s [-j threads] [-r regions-file] [-o option value]\n"
+		"          [-s option values] [-divider n] [-top n] labels-file\n",
+		name);
+	exit(1);
+	}
+
+static double
+wall_seconds(void)
+	{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+	}
+
+static void
+sweep_add(char *option, char *spec)
+	{
+	TuneSweep	*sw;
+	char		*s, *item, *copy;
+	int			first, last, step, n;
+
+	if (n_sweeps == TUNE_SWEEPS_MAX)
+		{
+		fprintf(stderr, "Too many sweeps (max %d).\n", TUNE_SWEEPS_MAX);
+		exit(1);
+		}
+	sw = &sweeps[n_sweeps++];
+	sw->option = option;
+	copy = strdup(spec);
+	for (item = strtok_r(copy, ",", &s); item; item = strtok_r(NULL, ",", &s))
+		{
+		step = 1;
+		n = sscanf(item, "%d:%d:%d", &first, &last, &step);
+		if (n == 1)
+			last = first;
+		if (n < 1 || step < 1 || last < first)
+			{
+			fprintf(stderr, "Bad sweep values for %s: %s\n", option, spec);
+			exit(1);
+			}
+		for ( ; first <= last; first += step)
+			{
+			sw->values = realloc(sw->values, (sw->n_values + 1) * sizeof(int));
+			sw->values[sw->n_values++] = first;
+			}
+		}
+	free(copy);
+	}
+
+static TuneRecording *
+recording_find(char *path)
+	{
+	int		i;
+
+	for (i = 0; i < n_recordings; ++i)
+		if (!strcmp(recordings[i].path, path))
+			return &recordings[i];
+	recordings = realloc(recordings, (n_recordings + 1) * sizeof(TuneRecording));
+	memset(&recordings[n_recordings], 0, sizeof(TuneRecording));
+	recordings[n_recordings].path = strdup(path);
+	return &recordings[n_recordings++];
+	}
+
+static void
+labels_load(char *labels)
+	{
+	FILE			*f;
+	TuneRecording	*rec;
+	TuneEvent		*ev;
+	char			buf[256], path[200], label[16];
+	double			start, end;
+	int				n, line = 0;
+
+	if ((f = fopen(labels, "r")) == NULL)
+		{
+		fprintf(stderr, "Cannot open %s: %m\n", labels);
+		exit(1);
+		}
+	while (fgets(buf, sizeof(buf), f))
+		{
+		++line;
+		if (buf[0] == '#')
+			continue;
+		n = sscanf(buf, "%199s %lf %lf %15s", path, &start, &end, label);
+		if (n <= 0)
+			continue;
+		rec = recording_find(path);
+		if (n == 1)
+			continue;
+		if (   n != 4 || end < start
+		    || (strcmp(label, "true") && strcmp(label, "false"))
+		   )
+			{
+			fprintf(stderr, "%s:%d: expected recording start end true|false\n",
+					labels, line);
+			exit(1);
+			}
+		rec->events = realloc(rec->events, (rec->n_events + 1) * sizeof(TuneEvent));
+		ev = &rec->events[rec->n_events++];
+		ev->start = start;
+		ev->end = end;
+		ev->is_true = !strcmp(label, "true");
+		}
+	fclose(f);
+	if (n_recordings == 0)
+		{
+		fprintf(stderr, "%s: no recordings.\n", labels);
+		exit(1);
+		}
+	}
+
+  /* Read a recording into memory keeping vector data only for the frames
+  |  motion_frame_process() will see, as motion-replay counts them.
+  */
+static void
+recording_load(TuneRecording *rec)
+	{
+	MotionCaptureFrame	frame;
+	TuneFrame			*tf;
+	FILE				*f;
+	int					n_alloc = 0, fps_count = 0;
+
+	if ((f = fopen(rec->path, "r")) == NULL)
+		{
+		fprintf(stderr, "Cannot open %s: %m\n", rec->path);
+		exit(1);
+		}
+	if (   fread(&rec->header, sizeof(rec->header), 1, f) != 1
+	    || memcmp(rec->header.magic, MOTION_CAPTURE_MAGIC, sizeof(rec->header.magic))
+	    || rec->header.version != MOTION_CAPTURE_VERSION
+	   )
+		{
+		fprintf(stderr, "%s: not a version %d motion vector capture file.\n",
+				rec->path, MOTION_CAPTURE_VERSION);
+		exit(1);
+		}
+	fseek(f, rec->header.header_size, SEEK_SET);
+	rec->divider = divider > 0 ? divider : rec->header.mjpeg_divider;
+
+	while (fread(&frame, sizeof(frame), 1, f) == 1)
+		{
+		if (rec->n_frames == n_alloc)
+			{
+			n_alloc = n_alloc ? 2 * n_alloc : 1024;
+			rec->frames = realloc(rec->frames, n_alloc * sizeof(TuneFrame));
+			}
+		tf = &rec->frames[rec->n_frames];
+		tf->usec = frame.usec;
+		tf->data = NULL;
+		if (++fps_count >= rec->divider)
+			{
+			fps_count = 0;
+			tf->data = calloc(1, MAX(frame.length, rec->header.vectors_size));
+			if (fread(tf->data, frame.length, 1, f) != 1)
+				break;
+			}
+		else if (fseek(f, frame.length, SEEK_CUR) != 0)
+			break;
+		++rec->n_frames;
+		}
+	fclose(f);
+	}
+
+static void
+options_set(TuneResult *res)
+	{
+	int		i;
+
+	for (i = 0; i < n_base_options; ++i)
+		offline_config_set(base_options[i][0], base_options[i][1]);
+	for (i = 0; i < n_sweeps; ++i)
+		{
+		char	arg[16];
+
+		snprintf(arg, sizeof(arg), "%d", res->values[i]);
+		offline_config_set(sweeps[i].option, arg);
+		}
+	}
+
+static void
+video_score(TuneRecording *rec, TuneResult *res, double start, double end,
+			boolean *found)
+	{
+	TuneEvent	*ev;
+	boolean		is_true = FALSE;
+	int			i;
+
+	res->videos += 1;
+	for (i = 0, ev = rec->events; i < rec->n_events; ++i, ++ev)
+		{
+		if (start > ev->end || end < ev->start)
+			continue;
+		if (ev->is_true)
+			is_true = TRUE;
+		else if (!found[i])
+			res->false_events += 1;
+		found[i] = TRUE;
+		}
+	if (!is_true)
+		res->false_videos += 1;
+	}
+
+  /* Replay one recording with the options already set, the same steps as
+  |  motion-replay.
+  */
+static void
+recording_run(TuneRecording *rec, TuneResult *res)
+	{
+	VideoCircularBuffer	*vcb = &video_circular_buffer;
+	MotionFrame			*mf = &motion_frame;
+	TuneFrame			*tf;
+	boolean				*found, recording = FALSE;
+	double				t = 0, t_begin = 0;
+	int					i;
+
+	offline_init(rec->header.video_width, rec->header.video_height,
+				rec->header.video_fps, rec->divider);
+	if (regions && !motion_regions_config_load(regions, FALSE))
+		return;
+	if (mf->vectors_size != rec->header.vectors_size || rec->n_frames == 0)
+		return;
+
+	found = calloc(rec->n_events + 1, sizeof(boolean));
+	offline_clock_set(rec->frames[0].usec);
+	pikrellcam.t_start = pikrellcam.t_now;
+	for (tf = rec->frames; tf < rec->frames + rec->n_frames; ++tf)
+		{
+		offline_clock_set(tf->usec);
+		t = (tf->usec - rec->frames[0].usec) / 1e6;
+		if (tf->data)
+			{
+			memcpy(mf->vectors, tf->data, mf->vectors_size);
+			motion_frame_process(vcb, mf);
+			}
+		switch (offline_video_frame(vcb))
+			{
+			case EVENT_MOTION_BEGIN:
+				recording = TRUE;
+				t_begin = t;
+				break;
+			case EVENT_MOTION_END:
+				recording = FALSE;
+				video_score(rec, res, t_begin, t, found);
+				break;
+			}
+		}
+	if (recording)
+		video_score(rec, res, t_begin, t, found);
+
+	for (i = 0; i < rec->n_events; ++i)
+		if (rec->events[i].is_true && !found[i])
+			res->missed += 1;
+	free(found);
+	}
+
+static void *
+tune_thread(void *data)
+	{
+	TuneResult	*res;
+	int			i, n;
+
+	while ((n = __atomic_fetch_add(&next_result, 1, __ATOMIC_RELAXED)) < n_results)
+		{
+		res = &results[n];
+		for (i = 0; i < n_recordings; ++i)
+			{
+			options_set(res);
+			recording_run(&recordings[i], res);
+			}
+		}
+	return NULL;
+	}
+
+static int
+result_compare(const void *a, const void *b)
+	{
+	const TuneResult	*ra = a, *rb = b;
+	int					d;
+
+	d = (ra->missed + ra->false_videos) - (rb->missed + rb->false_videos);
+	if (d == 0)
+		d = ra->false_events - rb->false_events;
+	if (d == 0)
+		d = ra->set - rb->set;
+	return d;
+	}
+
+int
+main(int argc, char *argv[])
+	{
+	TuneResult	*res;
+	pthread_t	*threads;
+	char		*labels = NULL;
+	int			i, j, n, n_threads = 0, top = 0, n_events = 0;
+	double		t0;
+
+	for (i = 1; i < argc; ++i)
+		{
+		if (!strcmp(argv[i], "-j") && i + 1 < argc)
+			n_threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+			regions = argv[++i];
+		else if (!strcmp(argv[i], "-divider") && i + 1 < argc)
+			divider = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-top") && i + 1 < argc)
+			top = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-o") && i + 2 < argc)
+			{
+			if (   n_base_options == 64
+			    || !offline_config_set(argv[i + 1], argv[i + 2])
+			   )
+				{
+				fprintf(stderr, "Bad option: %s %s\n", argv[i + 1], argv[i + 2]);
+				exit(1);
+				}
+			base_options[n_base_options][0] = argv[i + 1];
+			base_options[n_base_options++][1] = argv[i + 2];
+			i += 2;
+			}
+		else if (!strcmp(argv[i], "-s") && i + 2 < argc)
+			{
+			if (!offline_config_set(argv[i + 1], "0"))
+				{
+				fprintf(stderr, "Bad sweep option: %s\n", argv[i + 1]);
+				exit(1);
+				}
+			sweep_add(argv[i + 1], argv[i + 2]);
+			i += 2;
+			}
+		else if (argv[i][0] != '-' && !labels)
+			labels = argv[i];
+		else
+			usage(argv[0]);
+		}
+	if (!labels)
+		usage(argv[0]);
+	if (n_sweeps == 0)
+		for (i = 0; i < sizeof(default_sweeps) / sizeof(default_sweeps[0]); ++i)
+			sweep_add(default_sweeps[i][0], default_sweeps[i][1]);
+	if (n_threads <= 0)
+		n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	labels_load(labels);
+	for (i = 0; i < n_recordings; ++i)
+		{
+		recording_load(&recordings[i]);
+		n_events += recordings[i].n_events;
+		}
+
+	/* Every combination of the sweep values, the last sweep varying fastest.
+	*/
+	for (n_results = 1, i = 0; i < n_sweeps; ++i)
+		n_results *= sweeps[i].n_values;
+	results = calloc(n_results, sizeof(TuneResult));
+	for (n = 0; n < n_results; ++n)
+		{
+		results[n].set = n;
+		for (i = n_sweeps - 1, j = n; i >= 0; --i)
+			{
+			results[n].values[i] = sweeps[i].values[j % sweeps[i].n_values];
+			j /= sweeps[i].n_values;
+			}
+		}
+
+	fprintf(stderr, "# %d parameter sets x %d recordings (%d events), %d threads\n",
+			n_results, n_recordings, n_events, n_threads);
+	t0 = wall_seconds();
+	threads = calloc(n_threads, sizeof(pthread_t));
+	for (i = 0; i < n_threads; ++i)
+		pthread_create(&threads[i], NULL, tune_thread, NULL);
+	for (i = 0; i < n_threads; ++i)
+		pthread_join(threads[i], NULL);
+	fprintf(stderr, "# %.1f sec\n", wall_seconds() - t0);
+
+	qsort(results, n_results, sizeof(TuneResult), result_compare);
+	printf("errors, missed, false_videos, false_events, videos");
+	for (i = 0; i < n_sweeps; ++i)
+		printf(", %s", sweeps[i].option);
+	printf("\n");
+	for (n = 0, res = results; n < n_results; ++n, ++res)
+		{
+		if (top > 0 && n >= top)
+			break;
+		printf("%d, %d, %d, %d, %d", res->missed + res->false_videos,
+				res->missed, res->false_videos, res->false_events, res->videos);
+		for (i = 0; i < n_sweeps; ++i)
+			printf(", %d", res->values[i]);
+		printf("\n");
+		}
+	return 0;
+	}
@@ -20,13 +20,18 @@
 
 #include "pikrellcam.h"
 #include <dirent.h>
+#include <sys/mman.h>
 
 #define EXPMA_SMOOTHING	0.01
 
 #define SMALL_OBJECT_COUNT	15
 
+#define MOTION_SAD_FRAMES	3
+#define MOTION_PIXEL_FRAMES	3
+#define MOTION_PIXEL_WARMUP	32	/* frames for the background to settle */
 
-MotionFrame		motion_frame;
+
+MOTION_TLS MotionFrame	motion_frame;
 
 static CompositeVector	zero_cvec;
 
@@ -53,97 +58,466 @@ composite_vector_best(CompositeVector *cvec1, CompositeVector *cvec2)
 	}
 
 
+  /* Summed-area tables are (width + 1) x (height + 1) with a zero top row
+  |  and left column so sat[(y + 1) * (width + 1) + x + 1] is the sum over
+  |  macroblocks [0..x] x [0..y].  Built once per frame that is not quiet,
+  |  they make box counts cost the same regardless of the rectangle size.
+  */
+#define SAT_INDEX(mf, x, y)	((y) * ((mf)->width + 1) + (x))
+
 static void
-get_composite_vector(MotionFrame *mf, MotionRegion *mreg)
+motion_frame_sat_build(MotionFrame *mf)
 	{
-	CompositeVector	*cvec, tvec;
-	MotionVector	*mv;
-	Area			*area;
-	int				x, y, mag2, mb_index, mvmag2, dot, cos2,
-					x0, y0, x1, y1;
-	int16_t			*pm, *pp, *pn;
+	MotionSat	row, *sat, *above;
+	MotionVector *mv;
+	int			x, y, mb_index;
 
-	cvec = &mreg->vector;
-	*cvec = zero_cvec;
-	tvec = zero_cvec;
-	mreg->reject_count = 0;
-	mreg->sparkle_count = 0;
-
-	/* Don't look at frame perimeter blocks except when excluding sparkles.
-	|  (They have limited vector direction).
-	*/
-	if ((y0 = mreg->y) == 0)
-		y0 = 1;
-	if ((y1 = mreg->y + mreg->dy) >= mf->height)
-		y1 = mf->height - 1;
-	if ((x0 = mreg->x) == 0)
-		x0 = 1;
-	if ((x1 = mreg->x + mreg->dx) >= mf->width)
-		x1 = mf->width - 1;
-
-	/* First pass, filter out any vector < mag2_limit
-	*/
-	for (y = y0; y < y1; ++y)
+	for (y = 0; y < mf->height; ++y)
 		{
-		for (x = x0; x < x1; ++x)
+		row = (MotionSat) { 0 };
+		sat = mf->sat + SAT_INDEX(mf, 1, y + 1);
+		above = mf->sat + SAT_INDEX(mf, 1, y);
+		mb_index = mf->width * y;
+		mv = &mf->vectors[mb_index];
+		for (x = 0; x < mf->width; ++x, ++mb_index, ++mv, ++sat, ++above)
 			{
-			mb_index = mf->width * y + x;
-			mv = &mf->vectors[mb_index];
-			mag2 = mv->vx * mv->vx + mv->vy * mv->vy;
-			if (mag2 >= mf->mag2_limit)
+			if (mf->mag2[mb_index])
 				{
-				*(mf->trigger + mb_index) = mag2;
+				row.count += 1;
+				row.vx += mv->vx;
+				row.vy += mv->vy;
+				row.x  += x;
+				row.y  += y;
 				}
+			else if (MF_BIT(mf, sparkle, x, y))
+				row.sparkle += 1;
+
+			sat->count   = above->count   + row.count;
+			sat->sparkle = above->sparkle + row.sparkle;
+			sat->vx      = above->vx      + row.vx;
+			sat->vy      = above->vy      + row.vy;
+			sat->x       = above->x       + row.x;
+			sat->y       = above->y       + row.y;
+			}
+		}
+	}
+
+  /* Rejects are known only after every region has run its direction
+  |  filter, so the reject table is built separately.
+  */
+static void
+motion_frame_reject_sat_build(MotionFrame *mf)
+	{
+	int		x, y, row, *sat, *above;
+
+	for (y = 0; y < mf->height; ++y)
+		{
+		row = 0;
+		sat = mf->reject_sat + SAT_INDEX(mf, 1, y + 1);
+		above = mf->reject_sat + SAT_INDEX(mf, 1, y);
+		for (x = 0; x < mf->width; ++x)
+			{
+			row += MF_BIT(mf, reject, x, y);
+			*sat++ = *above++ + row;
+			}
+		}
+	}
+
+  /* Clip a rectangle [x0, x1) x [y0, y1) of macroblocks to the frame and
+  |  return FALSE if nothing is left.
+  */
+static boolean
+sat_clip(MotionFrame *mf, int *x0, int *y0, int *x1, int *y1)
+	{
+	*x0 = MAX(*x0, 0);
+	*y0 = MAX(*y0, 0);
+	*x1 = MIN(*x1, mf->width);
+	*y1 = MIN(*y1, mf->height);
+	return (*x0 < *x1 && *y0 < *y1);
+	}
+
+static void
+motion_sat_sum(MotionFrame *mf, int x0, int y0, int x1, int y1,
+			MotionSat *sum)
+	{
+	MotionSat	*a, *b, *c, *d;
+
+	*sum = (MotionSat) { 0 };
+	if (!sat_clip(mf, &x0, &y0, &x1, &y1))
+		return;
+	a = mf->sat + SAT_INDEX(mf, x0, y0);
+	b = mf->sat + SAT_INDEX(mf, x1, y0);
+	c = mf->sat + SAT_INDEX(mf, x0, y1);
+	d = mf->sat + SAT_INDEX(mf, x1, y1);
+	sum->count   = d->count   - b->count   - c->count   + a->count;
+	sum->sparkle = d->sparkle - b->sparkle - c->sparkle + a->sparkle;
+	sum->vx      = d->vx      - b->vx      - c->vx      + a->vx;
+	sum->vy      = d->vy      - b->vy      - c->vy      + a->vy;
+	sum->x       = d->x       - b->x       - c->x       + a->x;
+	sum->y       = d->y       - b->y       - c->y       + a->y;
+	}
+
+static int
+motion_reject_sum(MotionFrame *mf, int x0, int y0, int x1, int y1)
+	{
+	int		*sat = mf->reject_sat;
+
+	if (!sat_clip(mf, &x0, &y0, &x1, &y1))
+		return 0;
+	return   sat[SAT_INDEX(mf, x1, y1)] - sat[SAT_INDEX(mf, x1, y0)]
+	       - sat[SAT_INDEX(mf, x0, y1)] + sat[SAT_INDEX(mf, x0, y0)];
+	}
+
+static void
+motion_heatmap_close(MotionFrame *mf)
+	{
+	if (mf->heatmap)
+		munmap(mf->heatmap, mf->heatmap_size);
+	mf->heatmap = NULL;
+	mf->heatmap_failed = FALSE;
+	}
+
+  /* Map tmpfs_dir/motion-heatmap, keeping the counts if the file is from
+  |  a previous run with the same video size.  Failure is logged once and
+  |  not retried until the next motion_init().
+  */
+static boolean
+motion_heatmap_open(MotionFrame *mf)
+	{
+	MotionHeatmapHeader	*hdr;
+	struct stat			st;
+	char				*path;
+	size_t				size;
+	boolean				fresh;
+	int					fd;
+
+	if (mf->heatmap_failed || !pikrellcam.tmpfs_dir)
+		return FALSE;
+	size = sizeof(MotionHeatmapHeader) + mf->width * mf->height * sizeof(uint32_t);
+	asprintf(&path, "%s/motion-heatmap", pikrellcam.tmpfs_dir);
+	hdr = MAP_FAILED;
+	if ((fd = open(path, O_RDWR | O_CREAT, 0664)) >= 0)
+		{
+		fresh = (fstat(fd, &st) != 0 || st.st_size != size);
+		if (!fresh || ftruncate(fd, size) == 0)
+			hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		}
+	if (hdr == MAP_FAILED)
+		{
+		log_printf("Motion heatmap %s failed.  %m\n", path);
+		free(path);
+		mf->heatmap_failed = TRUE;
+		return FALSE;
+		}
+	if (   memcmp(hdr->magic, MOTION_HEATMAP_MAGIC, sizeof(hdr->magic))
+	    || hdr->version != MOTION_HEATMAP_VERSION
+	    || hdr->width != mf->width
+	    || hdr->height != mf->height
+	   )
+		{
+		memset(hdr, 0, size);
+		memcpy(hdr->magic, MOTION_HEATMAP_MAGIC, sizeof(hdr->magic));
+		hdr->version = MOTION_HEATMAP_VERSION;
+		hdr->header_size = sizeof(MotionHeatmapHeader);
+		hdr->width = mf->width;
+		hdr->height = mf->height;
+		hdr->decay_time = pikrellcam.t_now;
+		}
+	log_printf("Motion heatmap: %s\n", path);
+	free(path);
+	mf->heatmap = hdr;
+	mf->heatmap_size = size;
+	return TRUE;
+	}
+
+  /* Once a frame before the counts are added in motion_frame_preprocess().
+  |  Returns the counts or NULL if the heatmap is off.
+  */
+static uint32_t *
+motion_heatmap_frame(MotionFrame *mf)
+	{
+	MotionHeatmapHeader	*hdr;
+	uint32_t			*counts;
+	int					i, hours;
+
+	if (!pikrellcam.motion_heatmap)
+		{
+		if (mf->heatmap)
+			motion_heatmap_close(mf);
+		return NULL;
+		}
+	if (!mf->heatmap && !motion_heatmap_open(mf))
+		return NULL;
+
+	hdr = mf->heatmap;
+	counts = (uint32_t *) (hdr + 1);
+	hours = (pikrellcam.t_now - hdr->decay_time) / 3600;
+	if (hours > 0)
+		{
+		hours = MIN(hours, 31);
+		for (i = 0; i < mf->width * mf->height; ++i)
+			counts[i] >>= hours;
+		hdr->frames >>= hours;
+		hdr->decay_time = pikrellcam.t_now;
+		}
+	hdr->frames += 1;
+	return counts;
+	}
+
+  /* Frame level vector preprocessing, done once per motion frame so the
+  |  region passes (regions may overlap) only aggregate over the result planes.
+  |  mag2[] gets the magnitude^2 of interior vectors >= mag2_limit that are
+  |  not isolated sparkles and the above bit plane marks the same blocks.
+  |  Isolated sparkles are marked in the sparkle bit plane for the OSD.
+  |  Frame perimeter blocks are never set (they have limited vector
+  |  direction) so every interior block has 8 neighbors.
+  */
+static void
+motion_frame_preprocess(MotionFrame *mf)
+	{
+	uint64_t		*up, *cur, *down, *spark, bits, v, v_prev, v_next, nbr;
+	uint16_t		*pm;
+	uint32_t		*heat_counts, *hc;
+	int				x, y, i, n, mb_index, words = mf->bit_words,
+					noise_level = -1;
+
+	mf->kernels = motion_kernels_get(pikrellcam.motion_simd);
+	heat_counts = motion_heatmap_frame(mf);
+	mf->noisy_count = 0;
+	mf->sad_count = 0;
+	if (pikrellcam.motion_noise_percent > 0 && pikrellcam.motion_noise_percent < 100)
+		noise_level = pikrellcam.motion_noise_percent * 0xffff / 100;
+
+	for (y = 1; y < mf->height - 1; ++y)
+		{
+		mb_index = mf->width * y + 1;
+		mf->kernels->mag2_row(&mf->vectors[mb_index], &mf->mag2[mb_index],
+				mf->width - 2, mf->mag2_limit);
+
+		/* Heatmap activity is counted before sparkle and noise removal.
+		*/
+		if (heat_counts)
+			{
+			hc = heat_counts + mb_index;
+			pm = mf->mag2 + mb_index;
+			for (x = 0; x < mf->width - 2; ++x)
+				hc[x] += (pm[x] != 0);
+			}
+
+		/* Blocks that have been active too much of the time (a tree waving
+		|  in the wind) are dropped from the mag2 plane so they count in
+		|  neither region vectors nor burst counts.
+		*/
+		memset(mf->noisy + words * y, 0, words * sizeof(uint64_t));
+		if (noise_level >= 0)
+			{
+			mf->kernels->noise_row(&mf->mag2[mb_index], &mf->noise[mb_index],
+					mf->pass, mf->width - 2, noise_level);
+			for (x = 1; x < mf->width - 1; ++x)
+				if (mf->pass[x - 1])
+					{
+					MF_BIT_SET(mf, noisy, x, y);
+					mf->noisy_count += 1;
+					}
+			}
+
+		/* The sad channel, same row pass.  Noise excluded blocks don't hit.
+		*/
+		memset(mf->sad_hit + words * y, 0, words * sizeof(uint64_t));
+		if (pikrellcam.motion_sad_count > 0)
+			{
+			mf->kernels->sad_row(&mf->vectors[mb_index], &mf->sad_base[mb_index],
+					mf->pass, mf->width - 2);
+			for (x = 1; x < mf->width - 1; ++x)
+				if (mf->pass[x - 1] && !MF_BIT(mf, noisy, x, y))
+					{
+					MF_BIT_SET(mf, sad_hit, x, y);
+					mf->sad_count += 1;
+					}
+			}
+
+		/* Pack the row into the above plane (perimeter mag2 stays 0) and
+		|  clear last frame's rejects.  Blocks in exclusion regions are
+		|  dropped here so nothing downstream sees them.
+		*/
+		pm = mf->mag2 + mf->width * y;
+		cur = mf->above + words * y;
+		for (i = 0; i < words; ++i, pm += 64)
+			{
+			n = MIN(64, mf->width - 64 * i);
+			for (x = 0, bits = 0; x < n; ++x)
+				if (pm[x])
+					bits |= 1ULL << x;
+			for (v = bits & mf->frame_set->exclude[words * y + i]; v; v &= v - 1)
+				pm[__builtin_ctzll(v)] = 0;
+			cur[i] = bits & ~mf->frame_set->exclude[words * y + i];
+			mf->reject[words * y + i] = 0;
 			}
 		}
 
-	/* Remove isolated sparkles & build the initial composite vector which
-	|  will then consist of motion vector clustering of at least count 2.
-	|  Camera can produce large sparkle counts during dim light (dusk/dawn).
+	/* Remove isolated sparkles so regions will see motion vector clustering
+	|  of at least count 2.  Camera can produce large sparkle counts during
+	|  dim light (dusk/dawn).  The 3x3 neighbor test is done 64 blocks at a
+	|  time: OR the rows above and below with the vertical OR (up | cur | down)
+	|  shifted one block left and right, carrying bits across word edges.
+	|  Isolation is symmetric (a sparkle has no set neighbors) so clearing
+	|  a sparkle can't change a later neighbor test.
 	*/
-	for (y = y0; y < y1; ++y)
+	for (y = 1; y < mf->height - 1; ++y)
 		{
-		for (x = x0; x < x1; ++x)
+		cur = mf->above + words * y;
+		up = cur - words;
+		down = cur + words;
+		spark = mf->sparkle + words * y;
+		v_prev = 0;
+		v = up[0] | cur[0] | down[0];
+		for (i = 0; i < words; ++i)
 			{
-			pm = mf->trigger + mf->width * y + x;
-			pp = pm - mf->width;
-			pn = pm + mf->width;
-			if (   *pm
-			    && !*(pm - 1) && !*(pm + 1)
-				&& !*(pp - 1) && !*pp && !*(pp + 1)
-				&& !*(pn - 1) && !*pn && !*(pn + 1)
-			   )
+			v_next = (i + 1 < words) ? (up[i + 1] | cur[i + 1] | down[i + 1]) : 0;
+			nbr =   up[i] | down[i]
+			      | (v << 1) | (v_prev >> 63)
+			      | (v >> 1) | (v_next << 63);
+			spark[i] = cur[i] & ~nbr;
+			cur[i] &= ~spark[i];
+
+			pm = mf->mag2 + mf->width * y + 64 * i;
+			for (bits = spark[i]; bits; bits &= bits - 1)
+				pm[__builtin_ctzll(bits)] = 0;
+			v_prev = v;
+			v = v_next;
+			}
+		}
+	}
+
+  /* One sweep over the passing, sparkle and sad planes inside regions,
+  |  adding each set block into every region its region_map entry holds.
+  |  Region shape costs nothing here, it was rasterized when the regions
+  |  changed.  Returns the number of passing blocks inside any region.
+  */
+static int
+motion_regions_sum(MotionFrame *mf)
+	{
+	MotionRegionSet	*rs = mf->frame_set;
+	MotionRegion	*mreg;
+	MotionVector	*mv;
+	MotionSat		*sum;
+	uint64_t		bits, *in;
+	uint32_t		m;
+	int				r, x, y, i, mb_index, words = mf->bit_words, count = 0;
+
+	for (r = 0; r < rs->n_regions; ++r)
+		{
+		mreg = &rs->regions[r];
+		mreg->sum = (MotionSat) { 0 };
+		mreg->sad_count = 0;
+		}
+	for (y = 1; y < mf->height - 1; ++y)
+		{
+		in = rs->in_region + words * y;
+		for (i = 0; i < words; ++i)
+			{
+			count += __builtin_popcountll(mf->above[words * y + i] & in[i]);
+			for (bits = mf->above[words * y + i] & in[i]; bits; bits &= bits - 1)
+				{
+				x = 64 * i + __builtin_ctzll(bits);
+				mb_index = mf->width * y + x;
+				mv = &mf->vectors[mb_index];
+				for (m = rs->region_map[mb_index]; m; m &= m - 1)
+					{
+					sum = &rs->regions[__builtin_ctz(m)].sum;
+					sum->count += 1;
+					sum->vx += mv->vx;
+					sum->vy += mv->vy;
+					sum->x  += x;
+					sum->y  += y;
+					}
+				}
+			for (bits = mf->sparkle[words * y + i] & in[i]; bits; bits &= bits - 1)
 				{
-				*pm = 1;	/* mag2 value becomes a sparkle flag */
-				mf->sparkle_count += 1;
-				mreg->sparkle_count += 1;
+				mb_index = mf->width * y + 64 * i + __builtin_ctzll(bits);
+				for (m = rs->region_map[mb_index]; m; m &= m - 1)
+					rs->regions[__builtin_ctz(m)].sum.sparkle += 1;
 				}
-			if (*pm > 1)
+			if (pikrellcam.motion_sad_count <= 0)
+				continue;
+			for (bits = mf->sad_hit[words * y + i] & in[i]; bits; bits &= bits - 1)
 				{
-				mv = &mf->vectors[mf->width * y + x];
-				tvec.mag2_count += 1;
-				tvec.vx += mv->vx;
-				tvec.vy += mv->vy;
-				tvec.x  += x;
-				tvec.y  += y;
-				mf->any_count += 1;
+				mb_index = mf->width * y + 64 * i + __builtin_ctzll(bits);
+				for (m = rs->region_map[mb_index]; m; m &= m - 1)
+					rs->regions[__builtin_ctz(m)].sad_count += 1;
 				}
 			}
 		}
+	return count;
+	}
+
+  /* Take a region's counts from the motion_regions_sum() sweep into the
+  |  frame totals and apply its sparkle adjust to mag2_limit_count.  Done for
+  |  every region, quiet frames included, so the OSD and burst counts add up.
+  */
+static void
+motion_region_counts(MotionFrame *mf, MotionRegion *mreg)
+	{
+	int		limit;
+
+	mreg->vector = zero_cvec;
+	mreg->reject_count = 0;
+	mreg->motion = 0;
+	mf->any_count += mreg->sum.count;
+	mf->sparkle_count += mreg->sum.sparkle;
+	mreg->sparkle_count = mreg->sum.sparkle;
 
 	/* If sparkle noise, override configured limit_count (for dusk/dawn times).
 	|  In regions with no motion, this reduces chances of a spurious reject.
 	|  In regions with motion, this tries to raise limit_count above the noise
 	|  background, but sensitivity is reduced.
 	*/
-	x = (pikrellcam.motion_times.confirm_gap == 0)
+	limit = (pikrellcam.motion_times.confirm_gap == 0)
 				? 2 * SMALL_OBJECT_COUNT / 3 : SMALL_OBJECT_COUNT;
-	if (mf->mag2_limit_count < x)
+	if (mf->mag2_limit_count < limit)
 		{
 		mf->mag2_limit_count += 2 * mreg->sparkle_count / 3;
-		if (mf->mag2_limit_count > x)
-			mf->mag2_limit_count = x;
+		if (mf->mag2_limit_count > limit)
+			mf->mag2_limit_count = limit;
 		}
+	mreg->limit_count = mf->mag2_limit_count;
+	}
+
+static void
+get_composite_vector(MotionFrame *mf, MotionRegion *mreg)
+	{
+	CompositeVector	*cvec, tvec;
+	MotionVector	*mv;
+	Area			*area;
+	uint8_t			*pass;
+	uint32_t		*map, bit = 1U << mreg->map_bit;
+	int				x, y, mb_index,
+					x0, y0, x1, y1;
+
+	motion_region_counts(mf, mreg);
+	cvec = &mreg->vector;
+	tvec = zero_cvec;
+
+	/* Don't look at frame perimeter blocks (see motion_frame_preprocess()).
+	|  For a polygon this is its bounding box and region_map has the shape.
+	*/
+	if ((y0 = mreg->y) == 0)
+		y0 = 1;
+	if ((y1 = mreg->y + mreg->dy) >= mf->height)
+		y1 = mf->height - 1;
+	if ((x0 = mreg->x) == 0)
+		x0 = 1;
+	if ((x1 = mreg->x + mreg->dx) >= mf->width)
+		x1 = mf->width - 1;
+
+	/* The initial composite vector comes from the motion_regions_sum() sweep.
+	*/
+	tvec.mag2_count = mreg->sum.count;
+	tvec.vx = mreg->sum.vx;
+	tvec.vy = mreg->sum.vy;
+	tvec.x  = mreg->sum.x;
+	tvec.y  = mreg->sum.y;
 
 	/* If we are left with enough counts for a composite vector, filter out
 	|  motion vectors not pointing in the composite directon.
@@ -154,6 +528,8 @@ get_composite_vector(MotionFrame *mf, MotionRegion *mreg)
 	|
 	|  cos(a) = (v1 dot v2) / mag(v1) * mag(v2))	# cos(25) = 0.906
 	|  100 * cos(25)^2 = 82 = 100 * (v1 dot v2)^2 / mag(v1)^2 * mag(v2)^2)
+	|
+	|  The test is done a region row at a time by the direction_row() kernel.
 	*/
 	if (tvec.mag2_count >= mf->mag2_limit_count)
 		{
@@ -163,19 +539,19 @@ get_composite_vector(MotionFrame *mf, MotionRegion *mreg)
 
 		for (y = y0; y < y1; ++y)
 			{
-			for (x = x0; x < x1; ++x)
+			mb_index = mf->width * y + x0;
+			mf->kernels->direction_row(&mf->vectors[mb_index],
+					&mf->mag2[mb_index], mf->pass, x1 - x0,
+					tvec.vx, tvec.vy, tvec.mag2);
+			pass = mf->pass;
+			map = mf->frame_set->region_map + mb_index;
+			for (x = x0; x < x1; ++x, ++mb_index, ++pass, ++map)
 				{
-				mb_index = mf->width * y + x;
-				mvmag2 = *(mf->trigger + mb_index);
-				if (mvmag2 <= 1)
+				if (*pass == 0 || !(*map & bit))
 					continue;
 
 				mv = &mf->vectors[mb_index];
-				dot = tvec.vx * mv->vx + tvec.vy * mv->vy;
-				if (   dot > 0		/* angle at least < 90 deg */
-				    && tvec.mag2 > 0
-					&& (cos2 = 100 * dot * dot / (tvec.mag2 * mvmag2)) >= 82
-				   )
+				if (*pass == 1)
 					{
 					cvec->mag2_count += 1;
 					cvec->vx += mv->vx;
@@ -195,7 +571,7 @@ get_composite_vector(MotionFrame *mf, MotionRegion *mreg)
 					}
 				else
 					{
-					*(mf->trigger + mf->width * y + x) = 2;	/* reject flag */
+					MF_BIT_SET(mf, reject, x, y);
 					mf->reject_count += 1;
 					mreg->reject_count += 1;
 					}
@@ -207,9 +583,8 @@ get_composite_vector(MotionFrame *mf, MotionRegion *mreg)
 	|  with some spread in the same direction.  If there is enough of them,
 	|  we have a final composite vector.  But look at the motion vector
 	|  distribution/concentration within the region to filter for final
-	|  motion detection.
+	|  motion detection (composite_vector_motion()).
 	*/
-	mreg->motion = 0;
 	if (cvec->mag2_count >= mf->mag2_limit_count)
 		{
 		cvec->x /= cvec->mag2_count;
@@ -228,8 +603,7 @@ get_composite_vector(MotionFrame *mf, MotionRegion *mreg)
 		if (cvec->vertical)
 			mf->vertical_count += 1;
 
-		/* Get a box that will hold at least 2x mag2_limit_count vectors
-		|  and count the vectors within the box.
+		/* Get a box that will hold at least 2x mag2_limit_count vectors.
 		*/
 		for (cvec->box_w = 4, cvec->box_h = 4;
 				cvec->box_w * cvec->box_h <= 2 * cvec->mag2_count;   )
@@ -239,104 +613,936 @@ get_composite_vector(MotionFrame *mf, MotionRegion *mreg)
 			else
 				cvec->box_w += 2;
 			}
+		}
+	else
+		*cvec = zero_cvec;
+	}
+
+  /* Second region pass, after all regions have flagged their rejects and
+  |  the reject summed-area table is built.  Count the vectors within the
+  |  cvec box and decide if the vectors are concentrated enough for motion.
+  */
+static void
+composite_vector_motion(MotionFrame *mf, MotionRegion *mreg)
+	{
+	CompositeVector	*cvec = &mreg->vector;
+	MotionSat		sum;
+	int				x0, y0, x1, y1;
+
+	if (cvec->mag2_count == 0)
+		return;
+
+	x0 = cvec->x - cvec->box_w / 2;
+	x1 = cvec->x + cvec->box_w / 2 + 1;
+	y0 = cvec->y - cvec->box_h / 2;
+	y1 = cvec->y + cvec->box_h / 2 + 1;
+	motion_sat_sum(mf, x0, y0, x1, y1, &sum);
+	cvec->in_box_rejects = motion_reject_sum(mf, x0, y0, x1, y1);
+	cvec->in_box_count = sum.count - cvec->in_box_rejects;
+
+		/* Filter out smaller fast moving objects which can be fast bird fly
+		|  bys or close flying insects.
+		|  For smaller objects, always enforce reject_count rejections
+		|  (filters noisy frames: rain, camera burps).
+		|  Comparison ratios here are empirical from looking at
+		|  motion-debug output wrt drawn OSD motion vector frames.
+		*/
+	if (   !cvec->vertical
+	    || !pikrellcam.motion_vertical_filter
+	   )
+		{
+		if (cvec->mag2_count < SMALL_OBJECT_COUNT)
+			{
+			if (   cvec->in_box_count > cvec->mag2_count * 8 / 10
+			    && cvec->mag2 < 5 * mf->mag2_limit
+			    && mreg->reject_count < cvec->mag2_count / 2
+			   )
+				mreg->motion = 1;
+			}
+		else if (   cvec->in_box_count > cvec->mag2_count * 7 / 10
+		         || (   cvec->in_box_count > cvec->mag2_count * 5 / 10
+		             && mreg->reject_count < cvec->mag2_count * 4 / 10
+		            )
+		        )
+			mreg->motion = 2;
+		}
+		/* else assume it's not concentrated enough for a motion cvec */
+
+	if (   mreg->motion > 0
+	    && composite_vector_best(cvec, &mf->best_region_vector)
+	   )
+		mf->best_region_vector = *cvec;
+
+	if (pikrellcam.verbose_motion)
+		{
+		printf(
+"cvec[%d]: x,y(%d,%d) dx,dy(%d,%d) mag2,count(%d,%d) reject:%d box:%dx%d\n",
+			mreg->region_number,
+			cvec->x, cvec->y, cvec->vx, cvec->vy, cvec->mag2,
+			cvec->mag2_count, mreg->reject_count,
+			cvec->box_w, cvec->box_h);
+		printf(
+"   in_box[count:%d rej:%d] motion:%d vetical:%d sparkle:%d limit_count:%d\n",
+			cvec->in_box_count, cvec->in_box_rejects, mreg->motion,
+			cvec->vertical, mreg->sparkle_count, mreg->limit_count);
+		}
+	}
+
+static int
+blob_run_root(MotionRun *runs, int i)
+	{
+	while (runs[i].parent != i)
+		{
+		runs[i].parent = runs[runs[i].parent].parent;	/* path halving */
+		i = runs[i].parent;
+		}
+	return i;
+	}
+
+  /* The lower index root becomes the root, so a set's root is always its
+  |  first run.
+  */
+static void
+blob_run_union(MotionRun *runs, int a, int b)
+	{
+	a = blob_run_root(runs, a);
+	b = blob_run_root(runs, b);
+	if (a < b)
+		runs[b].parent = a;
+	else if (b < a)
+		runs[a].parent = b;
+	}
+
+static void
+blob_run_add(MotionFrame *mf, int *n_runs, int x0, int x1, int y)
+	{
+	MotionRun	*run;
+
+	if (*n_runs >= mf->max_runs)
+		return;
+	run = &mf->runs[*n_runs];
+	run->x0 = x0;
+	run->x1 = x1;
+	run->y = y;
+	run->parent = *n_runs;
+	run->label = -1;
+	*n_runs += 1;
+	}
+
+static void
+blob_to_cvec(MotionBlob *blob, CompositeVector *cvec)
+	{
+	*cvec = zero_cvec;
+	cvec->x = blob->x;
+	cvec->y = blob->y;
+	cvec->vx = blob->vx;
+	cvec->vy = blob->vy;
+	cvec->mag2 = blob->mag2;
+	cvec->mag2_count = blob->count;
+	cvec->box_w = blob->x1 - blob->x0 + 1;
+	cvec->box_h = blob->y1 - blob->y0 + 1;
+	cvec->in_box_count = blob->count;
+	cvec->vertical =
+		(cvec->vy * cvec->vy > 20 * cvec->vx * cvec->vx) ? TRUE : FALSE;
+	}
+
+  /* Connected-component labeling of the above plane (passing magnitude,
+  |  sparkles removed) inside motion regions.  Each row's runs of set
+  |  blocks are pulled out of the bit plane a word at a time and joined
+  |  with union-find to any touching run in the row above, then the runs
+  |  are summed per set.  Work is linear in the number of runs and set
+  |  blocks, bounded by the grid size.
+  |
+  |  Unlike a region composite vector, a blob does not average in motion
+  |  elsewhere in the region, so two objects moving apart are two blobs.
+  |  A blob is motion if it has limit_count vectors that agree in direction:
+  |  coherence is |sum of vectors|^2 / (count * sum of |vector|^2) which is
+  |  100% for parallel vectors and near 0 for random (rain, noise) ones.
+  |  Small fast blobs are filtered like small region cvecs.
+  */
+static void
+motion_blobs_find(MotionFrame *mf)
+	{
+	MotionRun		*run, *runs = mf->runs;
+	MotionBlobSum	*sum;
+	MotionBlob		blob;
+	MotionVector	*mv;
+	uint64_t		bits, *above, *region;
+	long long		resultant;
+	int				x, y, i, j, k, n, pos, open, root, mb_index,
+					n_runs = 0, n_sums = 0, row_start, prev_start = 0;
+
+	mf->n_blobs = 0;
+	mf->blob_motion_count = 0;
+
+	for (y = 1; y < mf->height - 1; ++y)
+		{
+		row_start = n_runs;
+		above = mf->above + mf->bit_words * y;
+		region = mf->frame_set->in_region + mf->bit_words * y;
+		open = -1;
+		for (i = 0; i < mf->bit_words; ++i)
+			{
+			bits = above[i] & region[i];
+			for (pos = 0; pos < 64; )
+				{
+				if (open < 0)
+					{
+					if ((bits >> pos) == 0)
+						break;
+					pos += __builtin_ctzll(bits >> pos);
+					open = 64 * i + pos;
+					}
+				if ((~bits >> pos) == 0)
+					break;			/* run continues into the next word */
+				pos += __builtin_ctzll(~bits >> pos);
+				blob_run_add(mf, &n_runs, open, 64 * i + pos, y);
+				open = -1;
+				}
+			}
+		if (open >= 0)
+			blob_run_add(mf, &n_runs, open, mf->width, y);
+
+		/* Runs of both rows are in x order, so walk them together.  Runs
+		|  touch (8-connected) if they overlap when widened by one block.
+		*/
+		j = prev_start;
+		for (k = row_start; k < n_runs; ++k)
+			{
+			while (j < row_start && runs[j].x1 < runs[k].x0)
+				++j;
+			for (i = j; i < row_start && runs[i].x0 <= runs[k].x1; ++i)
+				blob_run_union(runs, i, k);
+			}
+		prev_start = row_start;
+		}
+
+	for (i = 0; i < n_runs; ++i)
+		{
+		run = &runs[i];
+		root = blob_run_root(runs, i);
+		if (root == i)
+			{
+			run->label = n_sums++;
+			sum = &mf->blob_sums[run->label];
+			*sum = (MotionBlobSum) { 0 };
+			sum->x0 = run->x0;
+			sum->x1 = run->x1 - 1;
+			sum->y0 = run->y;
+			}
+		else
+			sum = &mf->blob_sums[runs[root].label];
+
+		n = run->x1 - run->x0;
+		sum->count += n;
+		sum->x += n * (run->x0 + run->x1 - 1) / 2;
+		sum->y += n * run->y;
+		sum->x0 = MIN(sum->x0, run->x0);
+		sum->x1 = MAX(sum->x1, run->x1 - 1);
+		sum->y1 = run->y;
+		mb_index = mf->width * run->y + run->x0;
+		mv = &mf->vectors[mb_index];
+		for (x = run->x0; x < run->x1; ++x, ++mb_index, ++mv)
+			{
+			sum->vx += mv->vx;
+			sum->vy += mv->vy;
+			sum->mag2 += mf->mag2[mb_index];
+			}
+		}
+
+	/* Keep the largest blobs, largest first.
+	*/
+	for (sum = mf->blob_sums; sum < mf->blob_sums + n_sums; ++sum)
+		{
+		if (sum->count < mf->mag2_limit_count)
+			continue;
+		blob.x0 = sum->x0;
+		blob.y0 = sum->y0;
+		blob.x1 = sum->x1;
+		blob.y1 = sum->y1;
+		blob.x = sum->x / sum->count;
+		blob.y = sum->y / sum->count;
+		blob.vx = sum->vx / sum->count;
+		blob.vy = sum->vy / sum->count;
+		blob.mag2 = blob.vx * blob.vx + blob.vy * blob.vy;
+		blob.count = sum->count;
+		resultant = (long long) sum->vx * sum->vx + (long long) sum->vy * sum->vy;
+		blob.coherence = (sum->mag2 > 0)
+				? (int) (100 * resultant / ((long long) sum->count * sum->mag2)) : 0;
+
+		blob.motion = (blob.coherence >= MOTION_BLOB_COHERENCE);
+		if (blob.count < SMALL_OBJECT_COUNT && blob.mag2 >= 5 * mf->mag2_limit)
+			blob.motion = FALSE;
+		if (   pikrellcam.motion_vertical_filter
+		    && blob.vy * blob.vy > 20 * blob.vx * blob.vx
+		   )
+			blob.motion = FALSE;
+
+		for (k = mf->n_blobs; k > 0 && mf->blobs[k - 1].count < blob.count; --k)
+			if (k < MOTION_BLOBS_MAX)
+				mf->blobs[k] = mf->blobs[k - 1];
+		if (k < MOTION_BLOBS_MAX)
+			{
+			mf->blobs[k] = blob;
+			if (mf->n_blobs < MOTION_BLOBS_MAX)
+				mf->n_blobs += 1;
+			}
+		}
+
+	for (k = 0; k < mf->n_blobs; ++k)
+		{
+		if (mf->blobs[k].motion)
+			mf->blob_motion_count += 1;
+		if (pikrellcam.verbose_motion)
+			printf(
+"blob[%d]: x,y(%d,%d) dx,dy(%d,%d) count:%d coherence:%d box:%d,%d-%d,%d motion:%d\n",
+				k, mf->blobs[k].x, mf->blobs[k].y,
+				mf->blobs[k].vx, mf->blobs[k].vy, mf->blobs[k].count,
+				mf->blobs[k].coherence, mf->blobs[k].x0, mf->blobs[k].y0,
+				mf->blobs[k].x1, mf->blobs[k].y1, mf->blobs[k].motion);
+		}
+	}
+
+  /* A region holding the centroid of a motion blob has motion even if its
+  |  composite vector failed, eg two objects moving opposite ways in one
+  |  region.
+  */
+static void
+motion_blobs_regions(MotionFrame *mf)
+	{
+	MotionRegionSet	*rs = mf->frame_set;
+	MotionRegion	*mreg;
+	MotionBlob		*blob;
+	CompositeVector	cvec;
+	uint32_t		m;
+
+	for (blob = mf->blobs; blob < mf->blobs + mf->n_blobs; ++blob)
+		{
+		if (!blob->motion)
+			continue;
+		for (m = rs->region_map[mf->width * blob->y + blob->x]; m; m &= m - 1)
+			{
+			mreg = &rs->regions[__builtin_ctz(m)];
+			if (mreg->motion == 0)
+				mreg->motion = 3;
+			}
+		blob_to_cvec(blob, &cvec);
+		if (composite_vector_best(&cvec, &mf->best_region_vector))
+			mf->best_region_vector = cvec;
+		}
+	}
+
+  /* Associate this motion frame's detections (passing region vectors or
+  |  motion blobs, largest first) with the tracks.  Each detection takes
+  |  the nearest unmatched track whose constant velocity prediction is
+  |  within a gate that grows with track speed, else starts a new track.
+  |  Unmatched tracks coast on their velocity for MOTION_TRACK_MISSES
+  |  frames.  All state is in the fixed mf->tracks[].
+  |  Returns TRUE if a confirmed track was matched this frame.
+  */
+static boolean
+motion_tracks_update(MotionFrame *mf, CompositeVector *det, int n_det)
+	{
+	MotionTrack	*trk, *best, *slot;
+	boolean		matched[MOTION_TRACKS_MAX] = { FALSE },
+				confirmed = FALSE;
+	float		px, py, d2, best_d2, gate, mx, my;
+	int			i;
+	static MOTION_TLS int	divider;
+
+	/* Track velocities are per motion frame, so rescale them if
+	|  motion_load_adapt() changed the motion frame rate.
+	*/
+	if (divider > 0 && divider != mf->divider)
+		for (trk = mf->tracks; trk < mf->tracks + MOTION_TRACKS_MAX; ++trk)
+			{
+			trk->dx = trk->dx * mf->divider / divider;
+			trk->dy = trk->dy * mf->divider / divider;
+			}
+	divider = mf->divider;
+
+	for (i = 0; i < n_det; ++i, ++det)
+		{
+		best = NULL;
+		best_d2 = 0;
+		for (trk = mf->tracks; trk < mf->tracks + MOTION_TRACKS_MAX; ++trk)
+			{
+			if (!trk->active || matched[trk - mf->tracks])
+				continue;
+			px = trk->x + trk->dx;
+			py = trk->y + trk->dy;
+			d2 = (det->x - px) * (det->x - px) + (det->y - py) * (det->y - py);
+			gate = 4 + sqrtf(trk->dx * trk->dx + trk->dy * trk->dy);
+			if (d2 <= gate * gate && (!best || d2 < best_d2))
+				{
+				best = trk;
+				best_d2 = d2;
+				}
+			}
+		if (best)
+			{
+			mx = det->x - best->x;
+			my = det->y - best->y;
+			best->dx = (best->dx + mx) / 2;
+			best->dy = (best->dy + my) / 2;
+			best->x = det->x;
+			best->y = det->y;
+			best->hits += 1;
+			best->missed = 0;
+			best->count = det->mag2_count;
+			best->distance = sqrtf(  (best->x - best->x_start) * (best->x - best->x_start)
+			                       + (best->y - best->y_start) * (best->y - best->y_start));
+			if (   best->hits >= pikrellcam.motion_track_frames
+			    && best->distance >= pikrellcam.motion_track_distance
+			   )
+				best->confirmed = TRUE;
+			if (best->confirmed)
+				confirmed = TRUE;
+			matched[best - mf->tracks] = TRUE;
+			continue;
+			}
+
+		/* New track in a free slot, else replace the weakest unconfirmed
+		|  track not matched this frame.
+		*/
+		slot = NULL;
+		for (trk = mf->tracks; trk < mf->tracks + MOTION_TRACKS_MAX; ++trk)
+			{
+			if (!trk->active)
+				{
+				slot = trk;
+				break;
+				}
+			if (   !trk->confirmed && !matched[trk - mf->tracks]
+			    && (!slot || trk->hits < slot->hits)
+			   )
+				slot = trk;
+			}
+		if (!slot)
+			continue;
+		*slot = (MotionTrack) { 0 };
+		slot->id = ++mf->track_id;
+		slot->x = slot->x_start = det->x;
+		slot->y = slot->y_start = det->y;
+
+		/* Start with the encoder vector velocity.  Vectors point back to
+		|  the reference block and are in pixels per video frame.
+		*/
+		slot->dx = -det->vx * mf->divider / 16.0;
+		slot->dy = -det->vy * mf->divider / 16.0;
+		slot->hits = 1;
+		slot->count = det->mag2_count;
+		slot->active = TRUE;
+		matched[slot - mf->tracks] = TRUE;
+		}
+
+	for (trk = mf->tracks; trk < mf->tracks + MOTION_TRACKS_MAX; ++trk)
+		{
+		if (!trk->active)
+			continue;
+		trk->age += 1;
+		if (matched[trk - mf->tracks])
+			continue;
+		if (++trk->missed > MOTION_TRACK_MISSES)
+			trk->active = FALSE;
+		else
+			{
+			trk->x += trk->dx;
+			trk->y += trk->dy;
+			}
+		}
+	return confirmed;
+	}
+
+  /* The longest matched active track, for the stats file.
+  */
+static MotionTrack *
+motion_track_best(MotionFrame *mf)
+	{
+	MotionTrack	*trk, *best = NULL;
+
+	for (trk = mf->tracks; trk < mf->tracks + MOTION_TRACKS_MAX; ++trk)
+		if (trk->active && (!best || trk->hits > best->hits))
+			best = trk;
+	return best;
+	}
+
+#define COHERENCE_SLOT(coh, i) \
+		(&(coh)->ring[((coh)->head + MOTION_COHERENCE_MAX - (i)) % MOTION_COHERENCE_MAX])
+
+  /* Add each region's composite vector to its ring and return TRUE if any
+  |  region has held a trajectory for the last motion_coherence_frames
+  |  motion frames: motion in every one, centroid steps no longer than its
+  |  vectors allow, every vector within 45 degrees of the ring's summed
+  |  vector, and any net centroid move going the way the vectors point.
+  |  Rain, insects near the lens and encoder glitches jump around or last
+  |  only a frame or two.  A region without motion empties its ring, and
+  |  the ring is at most MOTION_COHERENCE_MAX, so this is O(regions).
+  */
+static boolean
+motion_coherence_update(MotionFrame *mf)
+	{
+	MotionRegionSet	*rs = mf->frame_set;
+	MotionRegion	*mreg;
+	MotionCoherence	*coh;
+	MotionRingEntry	*e, *prev;
+	boolean			coherent = FALSE;
+	long long		dot, vx, vy, mag2;
+	float			gate;
+	int				r, i, dx, dy, n = pikrellcam.motion_coherence_frames;
+
+	if (mf->coherence_set_id != rs->id)
+		{
+		memset(mf->coherence, 0, sizeof(mf->coherence));
+		mf->coherence_set_id = rs->id;
+		}
+	for (r = 0; r < rs->n_regions; ++r)
+		{
+		mreg = &rs->regions[r];
+		coh = &mf->coherence[r];
+		if (mreg->motion == 0 || mreg->vector.mag2_count == 0)
+			{
+			coh->n = 0;
+			continue;
+			}
+		e = &coh->ring[coh->head];
+		e->x = mreg->vector.x;
+		e->y = mreg->vector.y;
+		e->vx = mreg->vector.vx;
+		e->vy = mreg->vector.vy;
+
+		/* Vectors are pixels per video frame.  Allow a centroid step of
+		|  twice that in macroblocks per motion frame plus two macroblocks
+		|  for the centroid moving around on the object.
+		*/
+		if (coh->n > 0)
+			{
+			prev = COHERENCE_SLOT(coh, 1);
+			dx = e->x - prev->x;
+			dy = e->y - prev->y;
+			gate = 2 + 2 * sqrtf(MAX(e->vx * e->vx + e->vy * e->vy,
+			                         prev->vx * prev->vx + prev->vy * prev->vy))
+						* mf->divider / 16.0;
+			if (dx * dx + dy * dy > gate * gate)
+				coh->n = 0;
+			}
+		coh->head = (coh->head + 1) % MOTION_COHERENCE_MAX;
+		if (coh->n < MOTION_COHERENCE_MAX)
+			coh->n += 1;
+		if (coh->n < n)
+			continue;
+
+		vx = vy = 0;
+		for (i = 1; i <= n; ++i)
+			{
+			e = COHERENCE_SLOT(coh, i);
+			vx += e->vx;
+			vy += e->vy;
+			}
+		if ((mag2 = vx * vx + vy * vy) == 0)
+			continue;
+		for (i = 1; i <= n; ++i)		/* cos(a)^2 >= 0.5 */
+			{
+			e = COHERENCE_SLOT(coh, i);
+			dot = e->vx * vx + e->vy * vy;
+			if (dot <= 0 || 2 * dot * dot < mag2 * (e->vx * e->vx + e->vy * e->vy))
+				break;
+			}
+		if (i <= n)
+			continue;
+
+		/* Vectors point back to the reference block, so objects move -v.
+		*/
+		dx = COHERENCE_SLOT(coh, 1)->x - COHERENCE_SLOT(coh, n)->x;
+		dy = COHERENCE_SLOT(coh, 1)->y - COHERENCE_SLOT(coh, n)->y;
+		if (dx * dx + dy * dy >= 4 && dx * vx + dy * vy > 0)
+			continue;
+		coherent = TRUE;
+		}
+	return coherent;
+	}
+
+  /* ================ Motion Writer =============== */
+
+#define MOTION_STATS_BUF_SIZE	(32 * 1024)
+
+  /* One writer thread per stats or vector capture file.  It wakes when buf
+  |  is half full or once a second, swaps buf for wbuf and writes wbuf with
+  |  the lock dropped.  After motion_writer_close() it writes what is left,
+  |  closes the file and frees the MotionWriter.
+  */
+static void *
+motion_writer_thread(void *arg)
+	{
+	MotionWriter	*mw = (MotionWriter *) arg;
+	struct timespec	ts;
+	char			*tmp;
+	int				len, write_dropped = 0;
+	boolean			closing;
+
+	pthread_mutex_lock(&mw->mutex);
+	while (1)
+		{
+		mw->dropped += write_dropped;	/* put also counts, under the lock */
+		write_dropped = 0;
+		if (mw->len < mw->size / 2 && !mw->closing)
+			{
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += 1;
+			pthread_cond_timedwait(&mw->cond, &mw->mutex, &ts);
+			}
+		tmp = mw->wbuf;
+		mw->wbuf = mw->buf;
+		mw->buf = tmp;
+		len = mw->len;
+		mw->len = 0;
+		closing = mw->closing;
+		pthread_mutex_unlock(&mw->mutex);
+
+		if (len > 0 && fwrite(mw->wbuf, len, 1, mw->file) != 1)
+			write_dropped += len;
+		if (closing)
+			break;
+		pthread_mutex_lock(&mw->mutex);
+		}
+
+	fclose(mw->file);
+	pthread_mutex_lock(&mw->mutex);
+	mw->dropped += write_dropped;
+	pthread_mutex_unlock(&mw->mutex);
+	if (mw->dropped > 0)
+		log_printf("Motion writer %s: %d bytes dropped.\n", mw->path, mw->dropped);
+	pthread_mutex_destroy(&mw->mutex);
+	pthread_cond_destroy(&mw->cond);
+	free(mw->path);
+	free(mw->buf);
+	free(mw->wbuf);
+	free(mw);
+	return NULL;
+	}
+
+  /* Never blocks on the file.  head and data go in together or not at all
+  |  so a record is never split.  If the writer has fallen a whole buffer
+  |  behind, the record is dropped and counted.
+  */
+void
+motion_writer_put(MotionWriter *mw, void *head, int head_len,
+			void *data, int len)
+	{
+	pthread_mutex_lock(&mw->mutex);
+	if (mw->len + head_len + len > mw->size)
+		mw->dropped += head_len + len;
+	else
+		{
+		memcpy(mw->buf + mw->len, head, head_len);
+		mw->len += head_len;
+		if (len > 0)
+			{
+			memcpy(mw->buf + mw->len, data, len);
+			mw->len += len;
+			}
+		if (mw->len >= mw->size / 2)
+			pthread_cond_signal(&mw->cond);
+		}
+	pthread_mutex_unlock(&mw->mutex);
+	}
+
+MotionWriter *
+motion_writer_open(char *path, int size)
+	{
+	MotionWriter	*mw;
+	pthread_attr_t	attr;
+	pthread_t		thread;
+	int				err;
+
+	mw = calloc(1, sizeof(MotionWriter));
+	if ((mw->file = fopen(path, "w")) == NULL)
+		{
+		log_printf("Could not create %s.  %m\n", path);
+		free(mw);
+		return NULL;
+		}
+	mw->path = strdup(path);
+	mw->size = size;
+	mw->buf = malloc(size);
+	mw->wbuf = malloc(size);
+	pthread_mutex_init(&mw->mutex, NULL);
+	pthread_cond_init(&mw->cond, NULL);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&thread, &attr, motion_writer_thread, mw);
+	pthread_attr_destroy(&attr);
+	if (err != 0)
+		{
+		log_printf("Motion writer thread create failed.  %s\n", strerror(err));
+		fclose(mw->file);
+		pthread_mutex_destroy(&mw->mutex);
+		pthread_cond_destroy(&mw->cond);
+		free(mw->path);
+		free(mw->buf);
+		free(mw->wbuf);
+		free(mw);
+		mw = NULL;
+		}
+	return mw;
+	}
+
+  /* The writer thread finishes the file on its own.
+  */
+void
+motion_writer_close(MotionWriter *mw)
+	{
+	if (!mw)
+		return;
+	pthread_mutex_lock(&mw->mutex);
+	mw->closing = TRUE;
+	pthread_cond_signal(&mw->cond);
+	pthread_mutex_unlock(&mw->mutex);
+	}
+
+  /* Called from video_record_start() with the vcb locked.
+  */
+boolean
+motion_stats_open(VideoCircularBuffer *vcb, char *path, boolean binary)
+	{
+	MotionFrame			*mf = &motion_frame;
+	MotionWriter		*ms;
+	MotionStatsHeader	header;
+	MotionRegionSet		*rs;
+	char				buf[100];
+	int					n;
+
+	if ((ms = motion_writer_open(path, MOTION_STATS_BUF_SIZE)) == NULL)
+		return FALSE;
+	ms->binary = binary;
+
+	if (binary)
+		{
+		rs = motion_region_set_get(mf);
+		ms->n_regions = rs ? rs->n_regions : 0;
+		motion_region_set_put(rs);
+
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, MOTION_STATS_MAGIC, sizeof(header.magic));
+		header.version = MOTION_STATS_VERSION;
+		header.header_size = sizeof(header);
+		header.record_size = sizeof(MotionStatsRecord)
+					+ ms->n_regions * sizeof(MotionStatsRegion);
+		header.width = mf->width;
+		header.height = mf->height;
+		header.video_fps = pikrellcam.camera_adjust.video_fps;
+		header.mjpeg_divider = pikrellcam.mjpeg_divider;
+		header.n_regions = ms->n_regions;
+		motion_writer_put(ms, &header, sizeof(header), NULL, 0);
+		}
+	else
+		{
+		n = snprintf(buf, sizeof(buf),
+			"time, x, y, dx, dy, magnitude, count, track, age, distance, speed\n"
+			"# width %d height %d\n",
+			mf->width, mf->height);
+		motion_writer_put(ms, buf, n, NULL, 0);
+		}
+	vcb->motion_stats = ms;
+	return TRUE;
+	}
+
+  /* Called from video_record_stop() with the vcb locked.
+  */
+void
+motion_stats_close(VideoCircularBuffer *vcb)
+	{
+	motion_writer_close(vcb->motion_stats);
+	vcb->motion_stats = NULL;
+	}
+
+static void
+motion_stats_write(VideoCircularBuffer *vcb, MotionFrame *mf)
+	{
+	CompositeVector		*frame_vec = &mf->frame_vector, *cvec;
+	MotionWriter		*ms = vcb->motion_stats;
+	MotionTrack			*trk;
+	MotionRegion		*mreg;
+	MotionStatsRecord	*rec;
+	MotionStatsRegion	*sreg;
+	char				buf[sizeof(MotionStatsRecord)
+							+ MOTION_REGIONS_MAX * sizeof(MotionStatsRegion)];
+	float				speed = 0;
+	int					r, n;
+
+	if (!ms)
+		return;
+
+	/* Track speed is in macroblocks per second.
+	*/
+	if ((trk = motion_track_best(mf)) != NULL)
+		speed = sqrtf(trk->dx * trk->dx + trk->dy * trk->dy)
+				* pikrellcam.camera_adjust.video_fps / mf->divider;
+
+	if (!ms->binary)
+		{
+		n = snprintf(buf, sizeof(buf),
+			"%6.3f, %3d, %3d, %3d, %3d, %3.0f, %4d, %3d, %3d, %5.1f, %5.1f\n",
+			(float) vcb->frame_count / (float) pikrellcam.camera_adjust.video_fps,
+			frame_vec->x, frame_vec->y, -frame_vec->vx, -frame_vec->vy,
+			sqrt((float)frame_vec->mag2), frame_vec->mag2_count,
+			trk ? trk->id : 0, trk ? trk->age : 0,
+			trk ? trk->distance : 0.0, speed);
+		motion_writer_put(ms, buf, n, NULL, 0);
+		return;
+		}
+
+	/* Region results are cut or zero filled to the header n_regions if
+	|  regions change during the video.
+	*/
+	memset(buf, 0, sizeof(buf));
+	rec = (MotionStatsRecord *) buf;
+	rec->frame_count = vcb->frame_count;
+	rec->mag2 = frame_vec->mag2;
+	rec->x = frame_vec->x;
+	rec->y = frame_vec->y;
+	rec->dx = -frame_vec->vx;
+	rec->dy = -frame_vec->vy;
+	rec->count = MIN(frame_vec->mag2_count, 0xffff);
+	if (trk)
+		{
+		rec->track_id = trk->id;
+		rec->track_age = MIN(trk->age, 0xffff);
+		rec->track_distance = MIN(trk->distance * 10 + 0.5, 0xffff);
+		rec->track_speed = MIN(speed * 10 + 0.5, 0xffff);
+		}
+	rec->status = mf->motion_status;
+
+	sreg = (MotionStatsRegion *) (rec + 1);
+	for (r = 0; r < ms->n_regions && r < mf->frame_set->n_regions; ++r, ++sreg)
+		{
+		mreg = &mf->frame_set->regions[r];
+		cvec = &mreg->vector;
+		sreg->count = MIN(cvec->mag2_count, 0xffff);
+		sreg->reject_count = MIN(mreg->reject_count, 0xffff);
+		sreg->sparkle_count = MIN(mreg->sparkle_count, 0xffff);
+		sreg->x = cvec->x;
+		sreg->y = cvec->y;
+		sreg->dx = -cvec->vx;
+		sreg->dy = -cvec->vy;
+		sreg->motion = mreg->motion;
+		}
+	motion_writer_put(ms, buf, sizeof(MotionStatsRecord)
+				+ ms->n_regions * sizeof(MotionStatsRegion), NULL, 0);
+	}
+
+  /* ================ Pixel Motion =============== */
+
+  /* Called from the I420 callback with the preview frame that follows each
+  |  motion frame, before anything is drawn on it.  The Y plane is averaged
+  |  2x2 down into a running average background and each 16x16 pixel block
+  |  with a mean difference over motion_pixel_level counts for the regions
+  |  holding its center.  A region with motion_pixel_count blocks for
+  |  MOTION_PIXEL_FRAMES frames sets pixel_motion for the next
+  |  motion_frame_process().  Encoder vectors can be mostly noise for low
+  |  bitrate or night video while the pixel differences are not.
+  |  stride and height are the Y plane's as padded by MMAL, 32 pixel
+  |  widths and 16 row heights.
+  |  The pixel_ buffers belong to the I420 callback thread.
+  */
+void
+motion_pixel_process(MotionFrame *mf, uint8_t *i420, int stride, int height)
+	{
+	MotionRegionSet	*rs;
+	MotionKernels	*kernels = motion_kernels_get(pikrellcam.motion_simd);
+	uint8_t			*row;
+	uint32_t		m;
+	int				counts[MOTION_REGIONS_MAX];
+	int				w = pikrellcam.mjpeg_width, h = pikrellcam.mjpeg_height,
+					bw = w / 16, bh = h / 16,
+					bx, by, y, r, limit, hits = 0, n_regions;
+	boolean			over = FALSE;
+	static MOTION_TLS int	pixel_frame;
+
+	rs = motion_region_set_get(mf);
+	if (   pikrellcam.motion_pixel_count <= 0 || !rs || bw == 0
+	    || stride < w || height < 16 * bh
+	   )
+		{
+		mf->pixel_width = 0;	/* background starts over when turned on */
+		motion_region_set_put(rs);
+		return;
+		}
+	if (mf->pixel_width != w || mf->pixel_height != h)
+		{
+		free(mf->pixel_bg);
+		free(mf->pixel_sad);
+		mf->pixel_bg = calloc((w / 2) * (h / 2), 1);
+		mf->pixel_sad = malloc(bw * sizeof(uint16_t));
+		mf->pixel_width = w;
+		mf->pixel_height = h;
+		mf->pixel_warmup = MOTION_PIXEL_WARMUP;
+		pixel_frame = 0;
+		}
 
-		cvec->in_box_count = 0;
-		cvec->in_box_rejects = 0;
-		for (y = cvec->y - cvec->box_h / 2; y <= cvec->y + cvec->box_h / 2; ++y)
+	memset(counts, 0, sizeof(counts));
+	limit = 64 * pikrellcam.motion_pixel_level;		/* 64 pixels per block */
+	for (by = 0; by < bh; ++by)
+		{
+		memset(mf->pixel_sad, 0, bw * sizeof(uint16_t));
+		for (y = 0; y < 8; ++y)
 			{
-			for (x = cvec->x - cvec->box_w / 2; x <= cvec->x + cvec->box_w / 2; ++x)
-				{
-				int  trig = *(mf->trigger + mf->width * y + x);
-
-				if (trig > 2)
-					cvec->in_box_count += 1;
-				else if (trig == 2)
-					cvec->in_box_rejects += 1;
-				}
+			row = i420 + (16 * by + 2 * y) * stride;
+			kernels->pixel_row(row, row + stride,
+					mf->pixel_bg + (8 * by + y) * (w / 2), mf->pixel_sad, bw);
 			}
-
-		/* Filter out smaller fast moving objects which can be fast bird fly
-		|  bys or close flying insects.
-		|  For smaller objects, always enforce reject_count rejections
-		|  (filters noisy frames: rain, camera burps).
-		|  Comparison ratios here are empirical from looking at
-		|  motion-debug output wrt drawn OSD motion vector frames.
-		*/
-		if (   !cvec->vertical
-		    || !pikrellcam.motion_vertical_filter
-		   )
+		for (bx = 0; bx < bw; ++bx)
 			{
-			if (cvec->mag2_count < SMALL_OBJECT_COUNT)
-				{
-				if (   cvec->in_box_count > cvec->mag2_count * 8 / 10
-				    && cvec->mag2 < 5 * mf->mag2_limit
-				    && mreg->reject_count < cvec->mag2_count / 2
-				   )
-					mreg->motion = 1;
-				}
-			else if (   cvec->in_box_count > cvec->mag2_count * 7 / 10
-			         || (   cvec->in_box_count > cvec->mag2_count * 5 / 10
-			             && mreg->reject_count < cvec->mag2_count * 4 / 10
-			            )
-			        )
-				mreg->motion = 2;
+			if (mf->pixel_sad[bx] <= limit)
+				continue;
+			++hits;
+			m = rs->region_map[rs->width * ((16 * by + 8) * (rs->height - 1) / h)
+			                   + (16 * bx + 8) * (rs->width - 1) / w];
+			for ( ; m; m &= m - 1)
+				counts[__builtin_ctz(m)] += 1;
 			}
-			/* else assume it's not concentrated enough for a motion cvec */
-
-		if (   mreg->motion > 0
-		    && composite_vector_best(cvec, &mf->best_region_vector)
-		   )
-			mf->best_region_vector = *cvec;
+		}
+	mf->pixel_count = hits;
+	n_regions = rs->n_regions;
+	motion_region_set_put(rs);
+	if (mf->pixel_warmup > 0)
+		{
+		mf->pixel_warmup -= 1;
+		return;
+		}
 
-		if (pikrellcam.verbose_motion)
+	/* Like the sad channel, changes over most of the frame are lights or
+	|  exposure.
+	*/
+	if (hits < bw * bh / 2)
+		for (r = 0; r < n_regions; ++r)
+			if (counts[r] >= pikrellcam.motion_pixel_count)
+				over = TRUE;
+	if (over)
+		{
+		if (++pixel_frame == MOTION_PIXEL_FRAMES)
 			{
-			printf(
-"cvec[%d]: x,y(%d,%d) dx,dy(%d,%d) mag2,count(%d,%d) reject:%d box:%dx%d\n",
-				mreg->region_number,
-				cvec->x, cvec->y, cvec->vx, cvec->vy, cvec->mag2,
-				cvec->mag2_count, mreg->reject_count,
-				cvec->box_w, cvec->box_h);
-			printf(
-"   in_box[count:%d rej:%d] motion:%d vetical:%d sparkle:%d limit_count:%d\n",
-				cvec->in_box_count, cvec->in_box_rejects, mreg->motion,
-				cvec->vertical, mreg->sparkle_count, mf->mag2_limit_count);
+			__atomic_store_n(&mf->pixel_motion, TRUE, __ATOMIC_RELEASE);
+			pixel_frame = 0;
 			}
 		}
-	else
-		*cvec = zero_cvec;
-	}
-
-static void
-motion_stats_write(VideoCircularBuffer *vcb, MotionFrame *mf)
-	{
-	CompositeVector *frame_vec = &mf->frame_vector;
-
-	if (!vcb->motion_stats_file)
-		return;
-	if (vcb->motion_stats_do_header)
-		fprintf(vcb->motion_stats_file,
-			"time, x, y, dx, dy, magnitude, count\n"
-	        "# width %d height %d\n",
-	        mf->width, mf->height);
-	vcb->motion_stats_do_header = FALSE;
-
-	fprintf(vcb->motion_stats_file,
-		"%6.3f, %3d, %3d, %3d, %3d, %3.0f, %4d\n",
-		(float) vcb->frame_count / (float) pikrellcam.camera_adjust.video_fps,
-		frame_vec->x, frame_vec->y, -frame_vec->vx, -frame_vec->vy,
-		sqrt((float)frame_vec->mag2), frame_vec->mag2_count);
+	else if (pixel_frame > 0)
+		--pixel_frame;
 	}
 
 void
 motion_frame_process(VideoCircularBuffer *vcb, MotionFrame *mf)
 	{
+	MotionRegionSet *rs;
 	MotionRegion    *mreg;
 	CompositeVector *cvec, *frame_vec;
-	SList           *mrlist;
 	int             motion_count, fail_count;
 	char            tbuf[50], *msg;
-	int             x0, y0, x1, y1, t;
-	static int      mfp_number, motion_burst_frame;
+	CompositeVector detections[MOTION_BLOBS_MAX];
+	int             x0, y0, x1, y1, t, i, r, n_det;
+	boolean         track_confirmed = FALSE, coherent = FALSE, sad_over;
+	static MOTION_TLS int mfp_number;
 
 	/* Allow some startup camera settle time before motion detecting.
 	*/
@@ -350,34 +1556,99 @@ motion_frame_process(VideoCircularBuffer *vcb, MotionFrame *mf)
 	mf->any_count      = 0;
 	mf->vertical_count = 0;
 
-	memset(mf->trigger, 0, MF_TRIGGER_SIZE);
 	mf->best_region_vector = zero_cvec;
 	mf->motion_area.x0 = mf->motion_area.y0 = mf->motion_area.x1 = mf->motion_area.y1 = 0;
 	mf->mag2_limit  = pikrellcam.motion_magnitude_limit * pikrellcam.motion_magnitude_limit;
 	mf->mag2_limit_count = pikrellcam.motion_magnitude_limit_count;
 
-	pthread_mutex_lock(&mf->region_list_mutex);
-	for (mrlist = mf->motion_region_list; mrlist; mrlist = mrlist->next)
+	/* One region set for the whole frame however the regions change.  The
+	|  reference is kept until the next frame so there's no put on every
+	|  return.
+	*/
+	rs = motion_region_set_get(mf);
+	motion_region_set_put(mf->frame_set);
+	mf->frame_set = rs;
+	motion_frame_preprocess(mf);
+
+	/* Nothing can trigger (region vectors, blobs or burst) with fewer
+	|  passing blocks in regions than mag2_limit_count (which region
+	|  sparkle adjusts only raise).  Most frames are quiet, so for them the
+	|  region composite vector passes, the summed-area table builds and the
+	|  box passes are skipped and regions only take their counts.  The
+	|  motion_frame_preprocess() sweep still runs on every frame, it keeps
+	|  up the noise and sad averages and the passing block bitmaps.
+	*/
+	mf->quiet = (motion_regions_sum(mf) < mf->mag2_limit_count);
+	for (r = 0; r < rs->n_regions; ++r)
 		{
-		mreg = (MotionRegion *) mrlist->data;
+		mreg = &rs->regions[r];
 
-		get_composite_vector(mf, mreg);
+		if (mf->quiet)
+			motion_region_counts(mf, mreg);
+		else
+			get_composite_vector(mf, mreg);
 
-		/* Revert any dynamic mag2 adjust done in get_composite_vector().
+		/* Revert any dynamic mag2 adjust done in motion_region_counts().
 		*/
 		mf->mag2_limit  = pikrellcam.motion_magnitude_limit * pikrellcam.motion_magnitude_limit;
 		mf->mag2_limit_count = pikrellcam.motion_magnitude_limit_count;
 		}
 
+	if (!mf->quiet)
+		{
+		motion_frame_sat_build(mf);
+		motion_frame_reject_sat_build(mf);
+		for (r = 0; r < rs->n_regions; ++r)
+			composite_vector_motion(mf, &rs->regions[r]);
+		}
+
+	if (pikrellcam.motion_blobs && !mf->quiet)
+		{
+		motion_blobs_find(mf);
+		motion_blobs_regions(mf);
+		}
+	else
+		mf->n_blobs = mf->blob_motion_count = 0;
+
+	if (pikrellcam.motion_track_frames > 0)
+		{
+		n_det = 0;
+		if (pikrellcam.motion_blobs)
+			{
+			for (i = 0; i < mf->n_blobs; ++i)
+				if (mf->blobs[i].motion)
+					blob_to_cvec(&mf->blobs[i], &detections[n_det++]);
+			}
+		else
+			{
+			for (r = 0; r < rs->n_regions; ++r)
+				{
+				mreg = &rs->regions[r];
+				if (   mreg->motion > 0 && mreg->vector.mag2_count > 0
+				    && n_det < MOTION_BLOBS_MAX
+				   )
+					detections[n_det++] = mreg->vector;
+				}
+			}
+		track_confirmed = motion_tracks_update(mf, detections, n_det);
+		}
+	else
+		memset(mf->tracks, 0, sizeof(mf->tracks));
+
+	if (pikrellcam.motion_coherence_frames > 0)
+		coherent = motion_coherence_update(mf);
+	else
+		mf->coherence_set_id = 0;	/* rings start over when turned on */
+
 	motion_count = 0;
 	fail_count = 0;
 	mf->frame_vector = zero_cvec;
 	frame_vec = &mf->frame_vector;
 	mf->cvec_count = 0;
 
-	for (mrlist = mf->motion_region_list; mrlist; mrlist = mrlist->next)
+	for (r = 0; r < rs->n_regions; ++r)
 		{
-		mreg = (MotionRegion *) mrlist->data;
+		mreg = &rs->regions[r];
 		cvec = &mreg->vector;
 
 		if (   cvec->mag2_count > 0
@@ -413,9 +1684,9 @@ motion_frame_process(VideoCircularBuffer *vcb, MotionFrame *mf)
 			frame_vec->vx * frame_vec->vx + frame_vec->vy * frame_vec->vy;
 
 		x0 = y0 = x1 = y1 = 0;
-		for (mrlist = mf->motion_region_list; mrlist; mrlist = mrlist->next)
+		for (r = 0; r < rs->n_regions; ++r)
 			{
-			mreg = (MotionRegion *) mrlist->data;
+			mreg = &rs->regions[r];
 			cvec = &mreg->vector;
 			if (cvec->mag2_count == 0)
 				continue;
@@ -436,7 +1707,24 @@ motion_frame_process(VideoCircularBuffer *vcb, MotionFrame *mf)
 		frame_vec->box_w = 2 * MAX(frame_vec->x - x0, x1 - frame_vec->x);
 		frame_vec->box_h = 2 * MAX(frame_vec->y - y0, y1 - frame_vec->y);
 		}
-	pthread_mutex_unlock(&mf->region_list_mutex);
+
+	/* With blobs, the frame vector and motion area (preview framing) are
+	|  the largest motion blob instead of an average of region vectors
+	|  that can cancel out.  Keep the total count for burst detection.
+	*/
+	for (i = 0; i < mf->n_blobs; ++i)
+		{
+		if (!mf->blobs[i].motion)
+			continue;
+		t = frame_vec->mag2_count;
+		blob_to_cvec(&mf->blobs[i], frame_vec);
+		frame_vec->mag2_count = MAX(t, mf->blobs[i].count);
+		mf->motion_area.x0 = mf->blobs[i].x0;
+		mf->motion_area.y0 = mf->blobs[i].y0;
+		mf->motion_area.x1 = mf->blobs[i].x1;
+		mf->motion_area.y1 = mf->blobs[i].y1;
+		break;
+		}
 
 	/* To be used (large sparkle counts after sunset / before sunrise).
 	*/
@@ -449,8 +1737,8 @@ motion_frame_process(VideoCircularBuffer *vcb, MotionFrame *mf)
 	if (frame_vec->mag2_count + mf->reject_count >
 				pikrellcam.motion_burst_count + (int) mf->any_count_expma)
 		{
-		if (motion_burst_frame < pikrellcam.motion_burst_frames)
-			++motion_burst_frame;
+		if (mf->burst_frame < pikrellcam.motion_burst_frames)
+			++mf->burst_frame;
 		}
 	else
 		{
@@ -461,35 +1749,93 @@ motion_frame_process(VideoCircularBuffer *vcb, MotionFrame *mf)
 		if (motion_count == 0 && fail_count == 0)
 			mf->any_count_expma = 0.03 * (float) mf->any_count +
 					(1.0 - 0.03) * mf->any_count_expma;
-		if (motion_burst_frame > 0)
-			--motion_burst_frame;
+		if (mf->burst_frame > 0)
+			--mf->burst_frame;
 		}
 
+	/* The sad channel triggers on a region with motion_sad_count blocks over
+	|  their sad baselines for MOTION_SAD_FRAMES frames.  Vectors can miss
+	|  slow objects, but their sad still goes up.  If most of the frame
+	|  is over baseline it is a light or exposure change and is ignored.
+	*/
+	sad_over = FALSE;
+	if (pikrellcam.motion_sad_count > 0 && mf->sad_warmup > 0)
+		mf->sad_warmup -= 1;	/* let baselines settle after motion_init() */
+	else if (   pikrellcam.motion_sad_count > 0
+	         && mf->sad_count < mf->width * mf->height / 2
+	        )
+		{
+		for (r = 0; r < rs->n_regions; ++r)
+			if (rs->regions[r].sad_count >= pikrellcam.motion_sad_count)
+				sad_over = TRUE;
+		}
+	if (sad_over)
+		{
+		if (mf->sad_frame < MOTION_SAD_FRAMES)
+			++mf->sad_frame;
+		}
+	else if (mf->sad_frame > 0)
+		--mf->sad_frame;
+
+	/* The motion thread holds the vcb lock for the status and record
+	|  decisions, so the record state that lets detects skip the track,
+	|  coherence or confirm_gap gates is the one the record decision sees.
+	*/
+	pthread_mutex_lock(&vcb->mutex);
 	mf->motion_status = MOTION_NONE;
 
 	if (   motion_count > 0
 	    && fail_count == 0
 	   )
 		{
-		if (   vcb->state != VCB_STATE_MOTION_RECORD
-		    && mf->frame_window == 0
-		    && pikrellcam.motion_times.confirm_gap > 0
-		   )
+		/* Tracking or the coherence test replaces the confirm_gap frame
+		|  window.
+		*/
+		if (pikrellcam.motion_track_frames > 0)
+			{
+			if (vcb->state == VCB_STATE_MOTION_RECORD || track_confirmed)
+				mf->motion_status = (MOTION_DETECTED | MOTION_VECTOR);
+			else
+				mf->motion_status = MOTION_PENDING;
+			}
+		else if (pikrellcam.motion_coherence_frames > 0)
+			{
+			if (vcb->state == VCB_STATE_MOTION_RECORD || coherent)
+				mf->motion_status = (MOTION_DETECTED | MOTION_VECTOR);
+			else
+				mf->motion_status = MOTION_PENDING;
+			}
+		else if (   vcb->state != VCB_STATE_MOTION_RECORD
+		         && mf->frame_window == 0
+		         && pikrellcam.motion_times.confirm_gap > 0
+		        )
 			{
 			mf->frame_window = pikrellcam.camera_adjust.video_fps *
-					pikrellcam.motion_times.confirm_gap / pikrellcam.mjpeg_divider;
+					pikrellcam.motion_times.confirm_gap / mf->divider;
 			mf->motion_status = MOTION_PENDING;
 			}
 		else
 			mf->motion_status = (MOTION_DETECTED | MOTION_VECTOR);
 		}
 
-	if (motion_burst_frame == pikrellcam.motion_burst_frames)	/* overrides pending */
+	if (mf->burst_frame == pikrellcam.motion_burst_frames)	/* overrides pending */
 		{
 		mf->motion_status &= ~MOTION_PENDING;
 		mf->motion_status |= (MOTION_DETECTED | MOTION_BURST);
 		mf->frame_window = 0;
 		}
+	if (mf->sad_frame == MOTION_SAD_FRAMES)	/* also overrides pending */
+		{
+		mf->motion_status &= ~MOTION_PENDING;
+		mf->motion_status |= (MOTION_DETECTED | MOTION_SAD);
+		mf->frame_window = 0;
+		}
+	if (__atomic_exchange_n(&mf->pixel_motion, FALSE, __ATOMIC_ACQ_REL))
+		{
+		mf->motion_status &= ~MOTION_PENDING;
+		mf->motion_status |= (MOTION_DETECTED | MOTION_PIXEL);
+		mf->frame_window = 0;
+		}
 	if (mf->frame_window > 0)
 		mf->frame_window -= 1;
 
@@ -501,13 +1847,28 @@ motion_frame_process(VideoCircularBuffer *vcb, MotionFrame *mf)
 "frame:   x,y(%d,%d) dx,dy(%d,%d) mag2,count(%d,%d) any_expma: %.1f burst:%d\n",
 			frame_vec->x, frame_vec->y, frame_vec->vx, frame_vec->vy,
 			frame_vec->mag2, frame_vec->mag2_count, mf->any_count_expma,
-			motion_burst_frame);
+			mf->burst_frame);
 		}
-	if (pikrellcam.verbose_motion && (fail_count > 0 || motion_count > 0))
+	if (   pikrellcam.verbose_motion
+	    && (fail_count > 0 || motion_count > 0 || (mf->motion_status & MOTION_PIXEL))
+	   )
 		{
-		printf("any:%d reject:%d sparkle:%d sparkle_expma:%.1f\n",
+		printf("any:%d reject:%d sparkle:%d sparkle_expma:%.1f noisy:%d sad:%d[%d]\n",
 			mf->any_count, mf->reject_count,
-			mf->sparkle_count, mf->sparkle_expma);
+			mf->sparkle_count, mf->sparkle_expma, mf->noisy_count,
+			mf->sad_count, mf->sad_frame);
+		for (i = 0; i < MOTION_TRACKS_MAX; ++i)
+			if (mf->tracks[i].active)
+				printf(
+"track[%d]: x,y(%.1f,%.1f) dx,dy(%.1f,%.1f) age:%d hits:%d missed:%d dist:%.1f%s\n",
+					mf->tracks[i].id, mf->tracks[i].x, mf->tracks[i].y,
+					mf->tracks[i].dx, mf->tracks[i].dy, mf->tracks[i].age,
+					mf->tracks[i].hits, mf->tracks[i].missed,
+					mf->tracks[i].distance,
+					mf->tracks[i].confirmed ? " confirmed" : "");
+		for (r = 0; pikrellcam.motion_coherence_frames > 0 && r < rs->n_regions; ++r)
+			if (mf->coherence[r].n > 0)
+				printf("coherence[%d]: frames:%d\n", r, mf->coherence[r].n);
 
 		strftime(tbuf, sizeof(tbuf), "%T", &pikrellcam.tm_local);
 		if ((mf->motion_status & (MOTION_VECTOR | MOTION_BURST))
@@ -517,6 +1878,10 @@ motion_frame_process(VideoCircularBuffer *vcb, MotionFrame *mf)
 			msg = "***MOTION VECTOR***";
 		else if (mf->motion_status & MOTION_BURST)
 			msg = "***MOTION BURST***";
+		else if (mf->motion_status & MOTION_SAD)
+			msg = "***MOTION SAD***";
+		else if (mf->motion_status & MOTION_PIXEL)
+			msg = "***MOTION PIXEL***";
 		else if (mf->motion_status == MOTION_PENDING)
 			msg = "***motion pending***";
 		else
@@ -526,8 +1891,10 @@ motion_frame_process(VideoCircularBuffer *vcb, MotionFrame *mf)
 			tbuf, mfp_number,  motion_count, fail_count, mf->frame_window, msg);
 		}
 	++mfp_number;
-	if (motion_burst_frame == pikrellcam.motion_burst_frames)
-		motion_burst_frame = 0;
+	if (mf->burst_frame == pikrellcam.motion_burst_frames)
+		mf->burst_frame = 0;
+	if (mf->sad_frame == MOTION_SAD_FRAMES)
+		mf->sad_frame = 0;
 
 	if ((mf->motion_status & MOTION_DETECTED)  && mf->motion_enable)
 		{
@@ -604,8 +1971,8 @@ motion_frame_process(VideoCircularBuffer *vcb, MotionFrame *mf)
 			}
 		if (pikrellcam.motion_stats)
 			motion_stats_write(vcb, mf);
-
 		}
+	pthread_mutex_unlock(&vcb->mutex);
 	}
 
 
@@ -729,6 +2096,8 @@ atof_range(float *result, char *value, double low, double high)
 #define	SELECT_REGION	12
 #define	SHOW_REGIONS	13
 #define	SHOW_VECTORS	14
+#define	ADD_POLYGON		15
+#define	ADD_EXCLUSION	16
 
 
 typedef struct
@@ -744,6 +2113,8 @@ static MotionCommand motion_commands[] =
 	{ "show_regions", SHOW_REGIONS,    1 },
 	{ "show_vectors", SHOW_VECTORS,    1 },
 	{ "add_region",    ADD_REGION,    4 },
+	{ "add_polygon",   ADD_POLYGON,  -1 },
+	{ "add_exclusion", ADD_EXCLUSION, -1 },
 	{ "move_region",   MOVE_REGION,   5 },
 	{ "move_coarse",   MOVE_COARSE, 2 },
 	{ "move_fine",     MOVE_FINE,   2 },
@@ -760,6 +2131,197 @@ static MotionCommand motion_commands[] =
 
 #define N_MOTION_COMMANDS	(sizeof(motion_commands) / sizeof(MotionCommand))
 
+  /* Even-odd test of a point (0 - 1.0 fractions) against a region polygon.
+  */
+static boolean
+motion_region_polygon_inside(MotionRegion *mreg, float xf, float yf)
+	{
+	float	*xp = mreg->xfp, *yp = mreg->yfp;
+	int		i, j;
+	boolean	inside = FALSE;
+
+	for (i = 0, j = mreg->n_points - 1; i < mreg->n_points; j = i++)
+		if (   (yp[i] > yf) != (yp[j] > yf)
+		    && xf < xp[j] + (yf - yp[j]) * (xp[i] - xp[j]) / (yp[i] - yp[j])
+		   )
+			inside = !inside;
+	return inside;
+	}
+
+static boolean
+motion_region_inside(MotionFrame *mf, MotionRegion *mreg, int x, int y)
+	{
+	if (mreg->n_points == 0)
+		return (   x >= mreg->x && x < mreg->x + mreg->dx
+		        && y >= mreg->y && y < mreg->y + mreg->dy);
+	return motion_region_polygon_inside(mreg,
+				(x + 0.5) / mf->width, (y + 0.5) / mf->height);
+	}
+
+static MOTION_TLS SList	*region_configs;	/* MotionRegionsConfig cache */
+
+static unsigned int	region_set_ids;
+
+  /* Rasterize a region list into a new set: the per macroblock region_map
+  |  (bit n set if the block is in regions[n]), the in_region union plane
+  |  and the exclude plane so motion_frame_process() never looks at region
+  |  shapes.  Exclusions win over regions.  The list regions get their
+  |  map_bit so the OSD can find their results in the set.
+  |  The caller gets the one reference.
+  */
+static MotionRegionSet *
+motion_region_set_compile(MotionFrame *mf, SList *region_list)
+	{
+	MotionRegionSet	*rs;
+	MotionRegion	*mreg;
+	SList			*list;
+	int				x, y, n = 0;
+
+	rs = calloc(1, sizeof(MotionRegionSet));
+	rs->refs = 1;
+	rs->id = __atomic_add_fetch(&region_set_ids, 1, __ATOMIC_RELAXED);
+	rs->width = mf->width;
+	rs->height = mf->height;
+	rs->bit_words = mf->bit_words;
+	rs->region_map = calloc(mf->width * mf->height, sizeof(uint32_t));
+	rs->in_region = calloc(1, MF_BIT_PLANE_SIZE);
+	rs->exclude = calloc(1, MF_BIT_PLANE_SIZE);
+
+	for (list = region_list; list; list = list->next)
+		{
+		mreg = (MotionRegion *) list->data;
+		if (!mreg->exclude)
+			continue;
+		for (y = 1; y < mf->height - 1; ++y)
+			for (x = 1; x < mf->width - 1; ++x)
+				if (motion_region_inside(mf, mreg, x, y))
+					MF_BIT_SET(rs, exclude, x, y);
+		}
+
+	for (list = region_list; list; list = list->next)
+		{
+		mreg = (MotionRegion *) list->data;
+		mreg->map_bit = -1;
+		if (mreg->exclude)
+			continue;
+		if (n == MOTION_REGIONS_MAX)
+			{
+			log_printf("Motion region %d ignored, only %d regions are used.\n",
+					mreg->region_number, MOTION_REGIONS_MAX);
+			continue;
+			}
+		mreg->map_bit = n;
+		rs->regions[n] = *mreg;
+		rs->regions[n].vector = zero_cvec;
+		rs->regions[n].motion = 0;
+		++n;
+		for (y = 1; y < mf->height - 1; ++y)
+			for (x = 1; x < mf->width - 1; ++x)
+				if (   !MF_BIT(rs, exclude, x, y)
+				    && motion_region_inside(mf, mreg, x, y)
+				   )
+					{
+					rs->region_map[mf->width * y + x] |= 1U << mreg->map_bit;
+					MF_BIT_SET(rs, in_region, x, y);
+					}
+		}
+	rs->n_regions = n;
+	return rs;
+	}
+
+static void
+motion_region_set_free(MotionRegionSet *rs)
+	{
+	free(rs->region_map);
+	free(rs->in_region);
+	free(rs->exclude);
+	free(rs);
+	}
+
+  /* Get a reference to the published set, NULL if there is none yet.  The
+  |  mutex keeps a set from being swapped out and freed between the load
+  |  and the reference.
+  */
+MotionRegionSet *
+motion_region_set_get(MotionFrame *mf)
+	{
+	MotionRegionSet	*rs;
+
+	pthread_mutex_lock(&mf->region_set_mutex);
+	if ((rs = mf->region_set) != NULL)
+		__atomic_add_fetch(&rs->refs, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&mf->region_set_mutex);
+	return rs;
+	}
+
+void
+motion_region_set_put(MotionRegionSet *rs)
+	{
+	if (rs && __atomic_sub_fetch(&rs->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		motion_region_set_free(rs);
+	}
+
+  /* Publish a set for the next motion frame.  mf->region_set takes its own
+  |  reference, so the caller keeps its.  Called with the region list
+  |  locked.
+  */
+static void
+motion_region_set_use(MotionFrame *mf, MotionRegionSet *rs)
+	{
+	MotionRegionSet	*old;
+
+	__atomic_add_fetch(&rs->refs, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&mf->region_set_mutex);
+	old = mf->region_set;
+	mf->region_set = rs;
+	pthread_mutex_unlock(&mf->region_set_mutex);
+	motion_region_set_put(old);
+	}
+
+  /* Compile the region list after a region command changes it.  Not done
+  |  before motion_init() knows the frame size.  Called with the region
+  |  list locked.
+  */
+static void
+motion_regions_compile(MotionFrame *mf)
+	{
+	MotionRegionSet	*rs;
+
+	if (mf->width > 0)
+		{
+		rs = motion_region_set_compile(mf, mf->motion_region_list);
+		motion_region_set_use(mf, rs);
+		motion_region_set_put(rs);
+		}
+	}
+
+  /* Keep a polygon inside its bounding box when the box is moved or
+  |  resized by the region commands.
+  */
+static void
+motion_region_polygon_fit(MotionRegion *mreg)
+	{
+	float	x0, y0, x1, y1;
+	int		i;
+
+	x0 = x1 = mreg->xfp[0];
+	y0 = y1 = mreg->yfp[0];
+	for (i = 1; i < mreg->n_points; ++i)
+		{
+		x0 = MIN(x0, mreg->xfp[i]);
+		x1 = MAX(x1, mreg->xfp[i]);
+		y0 = MIN(y0, mreg->yfp[i]);
+		y1 = MAX(y1, mreg->yfp[i]);
+		}
+	for (i = 0; i < mreg->n_points; ++i)
+		{
+		if (x1 > x0)
+			mreg->xfp[i] = mreg->xf0 + (mreg->xfp[i] - x0) * mreg->dxf / (x1 - x0);
+		if (y1 > y0)
+			mreg->yfp[i] = mreg->yf0 + (mreg->yfp[i] - y0) * mreg->dyf / (y1 - y0);
+		}
+	}
+
 static void
 motion_region_fixup(MotionRegion *mreg)
 	{
@@ -793,6 +2355,58 @@ motion_region_fixup(MotionRegion *mreg)
 	mreg->y  = motion_frame.height * mreg->yf0;
 	mreg->dx = motion_frame.width  * mreg->dxf;
 	mreg->dy = motion_frame.height * mreg->dyf;
+
+	/* A polygon's box must hold every block center inside the polygon.
+	*/
+	if (mreg->n_points > 0)
+		{
+		motion_region_polygon_fit(mreg);
+		mreg->dx = ceilf(motion_frame.width  * (mreg->xf0 + mreg->dxf)) - mreg->x;
+		mreg->dy = ceilf(motion_frame.height * (mreg->yf0 + mreg->dyf)) - mreg->y;
+		}
+	}
+
+  /* add_polygon x0 y0 x1 y1 x2 y2 ...  (3 to MOTION_REGION_POINTS points)
+  |  The bounding box is set from the points.
+  */
+static boolean
+get_polygon_args(MotionRegion *mreg, char *cmd_line)
+	{
+	char	*s, *end;
+	float	x1, y1;
+	double	f;
+	int		i, n;
+
+	s = cmd_line + strcspn(cmd_line, " \t");
+	for (n = 0; ; ++n)
+		{
+		f = strtod(s, &end);
+		if (end == s)
+			break;
+		if (n >= 2 * MOTION_REGION_POINTS || f < 0.0 || f > 1.0)
+			return FALSE;
+		if (n & 1)
+			mreg->yfp[n / 2] = f;
+		else
+			mreg->xfp[n / 2] = f;
+		s = end;
+		}
+	if (n & 1 || n < 6)
+		return FALSE;
+	mreg->n_points = n / 2;
+
+	mreg->xf0 = x1 = mreg->xfp[0];
+	mreg->yf0 = y1 = mreg->yfp[0];
+	for (i = 1; i < mreg->n_points; ++i)
+		{
+		mreg->xf0 = MIN(mreg->xf0, mreg->xfp[i]);
+		mreg->yf0 = MIN(mreg->yf0, mreg->yfp[i]);
+		x1 = MAX(x1, mreg->xfp[i]);
+		y1 = MAX(y1, mreg->yfp[i]);
+		}
+	mreg->dxf = x1 - mreg->xf0;
+	mreg->dyf = y1 - mreg->yf0;
+	return (mreg->dxf > 0.0 && mreg->dyf > 0.0);
 	}
 
 static boolean
@@ -812,7 +2426,7 @@ static char *
 motion_regions_name(char *name)
 	{
 	char        *s, *base = fname_base(name);
-	static char reg_name[50];
+	static MOTION_TLS char reg_name[50];
 
 	if (strncmp(base, "motion-regions-", 15) == 0)
 		stpncpy(reg_name, base + 15, 49);
@@ -825,6 +2439,169 @@ motion_regions_name(char *name)
 	return reg_name;
 	}
 
+  /* A region from an add_region, add_polygon or add_exclusion line.
+  */
+static MotionRegion *
+motion_region_parse(char *line)
+	{
+	MotionRegion	*mreg;
+	char			cmd[32], xs[32], ys[32], dxs[32], dys[32];
+	boolean			ok = FALSE;
+	int				n;
+
+	mreg = calloc(1, sizeof(MotionRegion));
+	n = sscanf(line, "%31s %31s %31s %31s %31s", cmd, xs, ys, dxs, dys);
+	if (n == 5 && !strcmp(cmd, "add_region"))
+		ok = get_motion_args(mreg, xs, ys, dxs, dys, 0.0, 1.0);
+	else if (n > 0 && !strcmp(cmd, "add_polygon"))
+		ok = get_polygon_args(mreg, line);
+	else if (n > 0 && !strcmp(cmd, "add_exclusion"))
+		{
+		ok = get_polygon_args(mreg, line);
+		mreg->exclude = TRUE;
+		}
+	if (!ok)
+		{
+		free(mreg);
+		mreg = NULL;
+		}
+	return mreg;
+	}
+
+static SList *
+motion_region_list_dup(SList *region_list)
+	{
+	SList			*list, *dup = NULL;
+	MotionRegion	*mreg;
+
+	for (list = region_list; list; list = list->next)
+		{
+		mreg = malloc(sizeof(MotionRegion));
+		*mreg = *(MotionRegion *) list->data;
+		dup = slist_append(dup, mreg);
+		}
+	return dup;
+	}
+
+  /* Compile a cached regions file for the current video size, or drop its
+  |  set if the size is not known yet.  The cache entry holds a reference,
+  |  so a replaced set that is still in use lives until it is swapped out.
+  */
+static void
+motion_regions_config_compile(MotionFrame *mf, MotionRegionsConfig *rc)
+	{
+	MotionRegionSet	*old = rc->set;
+	SList			*list;
+
+	rc->set = NULL;
+	if (mf->width > 0)
+		{
+		for (list = rc->region_list; list; list = list->next)
+			motion_region_fixup((MotionRegion *) list->data);
+		rc->set = motion_region_set_compile(mf, rc->region_list);
+		}
+	motion_region_set_put(old);
+	}
+
+  /* Get a regions file from the cache, reading it only if it is new or has
+  |  changed on disk and compiling it only if the video size changed.
+  |  Returns NULL if the file can't be read.  Called with the region list
+  |  locked.
+  */
+static MotionRegionsConfig *
+motion_regions_config_get(MotionFrame *mf, char *config_file)
+	{
+	MotionRegionsConfig	*rc = NULL;
+	MotionRegion		*mreg;
+	SList				*list, *region_list = NULL;
+	struct stat			st;
+	FILE				*f;
+	char				buf[256];
+	int					n = 0;
+
+	if (!config_file || stat(config_file, &st) < 0)
+		return NULL;
+	for (list = region_configs; list; list = list->next)
+		{
+		rc = (MotionRegionsConfig *) list->data;
+		if (!strcmp(rc->path, config_file))
+			break;
+		rc = NULL;
+		}
+
+	if (   rc
+	    && rc->size == st.st_size
+	    && rc->mtime.tv_sec == st.st_mtim.tv_sec
+	    && rc->mtime.tv_nsec == st.st_mtim.tv_nsec
+	   )
+		{
+		if (   mf->width > 0
+		    && (   !rc->set
+		        || rc->set->width != mf->width || rc->set->height != mf->height
+		       )
+		   )
+			motion_regions_config_compile(mf, rc);
+		return rc;
+		}
+
+	if ((f = fopen(config_file, "r")) == NULL)
+		return NULL;
+	while (fgets(buf, sizeof(buf), f) != NULL)
+		{
+		if ((mreg = motion_region_parse(buf)) != NULL)
+			{
+			mreg->region_number = n++;
+			region_list = slist_append(region_list, mreg);
+			}
+		else if (buf[strspn(buf, " \t\r\n")] != '\0')
+			log_printf("Bad line in %s: %s", config_file, buf);
+		}
+	fclose(f);
+
+	if (!rc)
+		{
+		rc = calloc(1, sizeof(MotionRegionsConfig));
+		rc->path = strdup(config_file);
+		region_configs = slist_append(region_configs, rc);
+		}
+	slist_and_data_free(rc->region_list);
+	rc->region_list = region_list;
+	rc->size = st.st_size;
+	rc->mtime = st.st_mtim;
+	motion_regions_config_compile(mf, rc);
+	return rc;
+	}
+
+  /* Read every regions file in the config dir at startup so a load_regions,
+  |  eg from an at-command at sunset, is a list copy and a set pointer swap.
+  |  motion_init() compiles them once the video size is known.
+  */
+void
+motion_regions_cache_load(void)
+	{
+	MotionFrame		*mf = &motion_frame;
+	struct dirent	*dp;
+	DIR				*dfd;
+	char			*path, *s;
+
+	if ((dfd = opendir(pikrellcam.config_dir)) == NULL)
+		return;
+	while ((dp = readdir(dfd)) != NULL)
+		{
+		if (   strncmp(dp->d_name, "motion-regions", 14) != 0
+		    || (s = strrchr(dp->d_name, '.')) == NULL
+		    || strcmp(s, ".conf") != 0
+		   )
+			continue;
+		asprintf(&path, "%s/%s", pikrellcam.config_dir, dp->d_name);
+		pthread_mutex_lock(&mf->region_list_mutex);
+		motion_regions_config_get(mf, path);
+		pthread_mutex_unlock(&mf->region_list_mutex);
+		free(path);
+		}
+	closedir(dfd);
+	}
+
 void
 motion_command(char *cmd_line)
 	{
@@ -849,7 +2626,7 @@ motion_command(char *cmd_line)
 		mcmd = &motion_commands[i];
 		if (!strcmp(mcmd->name, buf))
 			{
-			if (mcmd->n_args == n - 1)
+			if (mcmd->n_args == n - 1 || mcmd->n_args < 0)
 				id = mcmd->id;
 			break;
 			}
@@ -869,12 +2646,11 @@ motion_command(char *cmd_line)
 			config_set_boolean(&mf->show_vectors, arg1);
 			break;
 		case ADD_REGION:		/* add_region x y dx dy */
-			memset((char *) &mrtmp, 0, sizeof(MotionRegion));
-			if (get_motion_args(&mrtmp, arg1, arg2, arg3, arg4, 0.00, 1.0))
+		case ADD_POLYGON:		/* add_polygon x0 y0 x1 y1 x2 y2 ... */
+		case ADD_EXCLUSION:		/* add_exclusion x0 y0 x1 y1 x2 y2 ... */
+			if ((mreg = motion_region_parse(cmd_line)) != NULL)
 				{
 				pthread_mutex_lock(&mf->region_list_mutex);
-				mreg = calloc(1, sizeof(MotionRegion));
-				*mreg = mrtmp;
 				motion_region_fixup(mreg);
 				mf->motion_region_list =
 							slist_append(mf->motion_region_list, mreg);
@@ -882,10 +2658,11 @@ motion_command(char *cmd_line)
 				mreg->region_number = mf->n_regions - 1;
 				mf->selected_region = mreg->region_number;
 				mf->show_regions = TRUE;
+				motion_regions_compile(mf);
 				pthread_mutex_unlock(&mf->region_list_mutex);
 				}
 			else
-				;
+				log_printf("Bad motion command: %s", cmd_line);
 			break;
 
 		case SELECT_REGION:		/* select_region last / select_region < / select_region > (def) */
@@ -934,6 +2711,7 @@ motion_command(char *cmd_line)
 					if (!strcmp(arg1, "dy"))
 						mreg->dyf += delta;
 					motion_region_fixup(mreg);
+					motion_regions_compile(mf);
 					}
 				pthread_mutex_unlock(&mf->region_list_mutex);
 				}
@@ -956,6 +2734,7 @@ motion_command(char *cmd_line)
 				mreg->dxf += mrtmp.dxf;
 				mreg->dyf += mrtmp.dyf;
 				motion_region_fixup(mreg);
+				motion_regions_compile(mf);
 				}
 			pthread_mutex_unlock(&mf->region_list_mutex);
 			break;
@@ -972,6 +2751,7 @@ motion_command(char *cmd_line)
 				mreg->dxf = mrtmp.dxf;
 				mreg->dyf = mrtmp.dyf;
 				motion_region_fixup(mreg);
+				motion_regions_compile(mf);
 				}
 			pthread_mutex_unlock(&mf->region_list_mutex);
 			break;
@@ -1054,6 +2834,7 @@ motion_command(char *cmd_line)
 				mf->selected_region = mf->n_regions - 1;
 				mf->prev_selected_region = 0;
 				}
+			motion_regions_compile(mf);
 			pthread_mutex_unlock(&mf->region_list_mutex);
 			break;
 
@@ -1097,7 +2878,7 @@ motion_init(void)
 	{
 	MotionRegion	*mreg;
 	SList			*list;
-	static boolean	done_once = FALSE;
+	static MOTION_TLS boolean	done_once = FALSE;
 
 	if (!done_once)
 		{
@@ -1105,30 +2886,116 @@ motion_init(void)
 		motion_frame.motion_enable = pikrellcam.motion_enable;
 		}
 
+	/* A vector capture can't continue across a video size change.
+	*/
+	pthread_mutex_lock(&video_circular_buffer.mutex);
+	if (motion_frame.capture)
+		{
+		motion_writer_close(motion_frame.capture);
+		motion_frame.capture = NULL;
+		log_printf("Motion vector capture stopped for camera restart.\n");
+		}
+	pthread_mutex_unlock(&video_circular_buffer.mutex);
+
+	/* Don't free the frame arrays out from under the motion thread.
+	*/
+	pthread_mutex_lock(&motion_frame.process_mutex);
+	motion_heatmap_close(&motion_frame);
+
 	/* motion frames are from 16x16 macroblocks of the video frame
 	*/
 	motion_frame.width = (pikrellcam.camera_config.video_width / 16) + 1;
 	motion_frame.height = (pikrellcam.camera_config.video_height / 16) + 1;
 	motion_frame.vectors_size =
 			motion_frame.width * motion_frame.height * sizeof(MotionVector);
+	motion_frame.divider = pikrellcam.mjpeg_divider;
 
 	for (list = motion_frame.motion_region_list; list; list = list->next)
 		{
 		mreg = (MotionRegion *) list->data;
-		mreg->x  = motion_frame.width * mreg->xf0;
-		mreg->y  = motion_frame.height * mreg->yf0;
-		mreg->dx = motion_frame.width * mreg->dxf;
-		mreg->dy = motion_frame.height * mreg->dyf;
+		motion_region_fixup(mreg);
 		}
 
+	motion_queue_reset();
 	if (motion_frame.vectors)
 		free(motion_frame.vectors);
 	motion_frame.vectors = malloc(motion_frame.vectors_size);
 
-	if (motion_frame.trigger)
-		free(motion_frame.trigger);
-	motion_frame.trigger = malloc(MF_TRIGGER_SIZE);
+	/* Perimeter blocks of the planes are never written, so calloc().
+	*/
+	motion_frame.bit_words = (motion_frame.width + 63) / 64;
+	if (motion_frame.above)
+		free(motion_frame.above);
+	motion_frame.above = calloc(1, MF_BIT_PLANE_SIZE);
+	if (motion_frame.sparkle)
+		free(motion_frame.sparkle);
+	motion_frame.sparkle = calloc(1, MF_BIT_PLANE_SIZE);
+	if (motion_frame.reject)
+		free(motion_frame.reject);
+	motion_frame.reject = calloc(1, MF_BIT_PLANE_SIZE);
+
+	if (motion_frame.mag2)
+		free(motion_frame.mag2);
+	motion_frame.mag2 = calloc(motion_frame.width * motion_frame.height,
+					sizeof(*motion_frame.mag2));
+
+	/* The noise averages start over for a new video size.
+	*/
+	if (motion_frame.noise)
+		free(motion_frame.noise);
+	motion_frame.noise = calloc(motion_frame.width * motion_frame.height,
+					sizeof(*motion_frame.noise));
+	if (motion_frame.noisy)
+		free(motion_frame.noisy);
+	motion_frame.noisy = calloc(1, MF_BIT_PLANE_SIZE);
+	if (motion_frame.sad_base)
+		free(motion_frame.sad_base);
+	motion_frame.sad_base = calloc(motion_frame.width * motion_frame.height,
+					sizeof(*motion_frame.sad_base));
+	if (motion_frame.sad_hit)
+		free(motion_frame.sad_hit);
+	motion_frame.sad_hit = calloc(1, MF_BIT_PLANE_SIZE);
+	motion_frame.sad_warmup = 2 << MOTION_SAD_SHIFT;
+
+	if (motion_frame.pass)
+		free(motion_frame.pass);
+	motion_frame.pass = malloc(motion_frame.width);
+
+	/* Summed-area tables need their zero top row and left column.
+	*/
+	if (motion_frame.sat)
+		free(motion_frame.sat);
+	motion_frame.sat = calloc((motion_frame.width + 1) * (motion_frame.height + 1),
+					sizeof(*motion_frame.sat));
+	if (motion_frame.reject_sat)
+		free(motion_frame.reject_sat);
+	motion_frame.reject_sat = calloc((motion_frame.width + 1) * (motion_frame.height + 1),
+					sizeof(*motion_frame.reject_sat));
+
+	/* Region sets for the old size are replaced, including the cached
+	|  regions files so load_regions doesn't have to compile.
+	*/
+	pthread_mutex_lock(&motion_frame.region_list_mutex);
+	motion_regions_compile(&motion_frame);
+	for (list = region_configs; list; list = list->next)
+		motion_regions_config_compile(&motion_frame,
+					(MotionRegionsConfig *) list->data);
+	pthread_mutex_unlock(&motion_frame.region_list_mutex);
+
+	/* A row can't have more runs than every other block.
+	*/
+	motion_frame.max_runs = (motion_frame.width / 2 + 1) * motion_frame.height;
+	if (motion_frame.runs)
+		free(motion_frame.runs);
+	motion_frame.runs = malloc(motion_frame.max_runs * sizeof(MotionRun));
+	if (motion_frame.blob_sums)
+		free(motion_frame.blob_sums);
+	motion_frame.blob_sums =
+			malloc(motion_frame.max_runs * sizeof(MotionBlobSum));
+	motion_frame.n_blobs = 0;
+
 	motion_frame.motion_status = MOTION_NONE;
+	pthread_mutex_unlock(&motion_frame.process_mutex);
 	}
 
 
@@ -1139,6 +3006,7 @@ motion_regions_config_save(char *config_file, boolean inform)
 	SList        *list;
 	MotionRegion *mreg;
 	char         buf[128];
+	int          i;
 
 	if (   !config_file
 	    || (f = fopen(config_file, "w")) == NULL
@@ -1151,8 +3019,16 @@ motion_regions_config_save(char *config_file, boolean inform)
 	for (list = motion_frame.motion_region_list; list; list = list->next)
 		{
 		mreg = (MotionRegion *) list->data;
-		fprintf(f, "add_region %.3f %.3f %.3f %.3f\n",
-				mreg->xf0, mreg->yf0, mreg->dxf, mreg->dyf);
+		if (mreg->n_points == 0)
+			{
+			fprintf(f, "add_region %.3f %.3f %.3f %.3f\n",
+					mreg->xf0, mreg->yf0, mreg->dxf, mreg->dyf);
+			continue;
+			}
+		fprintf(f, "%s", mreg->exclude ? "add_exclusion" : "add_polygon");
+		for (i = 0; i < mreg->n_points; ++i)
+			fprintf(f, " %.3f %.3f", mreg->xfp[i], mreg->yfp[i]);
+		fprintf(f, "\n");
 		}
 	fclose(f);
 
@@ -1165,18 +3041,34 @@ motion_regions_config_save(char *config_file, boolean inform)
 		}
 	}
 
+  /* Switch to a regions file.  With the file cached and compiled this only
+  |  copies its region list for the region commands and OSD and swaps the
+  |  motion frame region set.
+  */
 boolean
 motion_regions_config_load(char *config_file, boolean inform)
 	{
-	boolean	save_show;
-	FILE	*f;
-	char	*reg_name, buf[128], dbuf[128];
+	MotionFrame			*mf = &motion_frame;
+	MotionRegionsConfig	*rc;
+	char				*reg_name, dbuf[128];
 
 	reg_name = motion_regions_name(config_file);
 	snprintf(dbuf, sizeof(dbuf), "\"%s\" 4 3 1", reg_name);
-	if (   !config_file
-	    || (f = fopen(config_file, "r")) == NULL
-	   )
+
+	pthread_mutex_lock(&mf->region_list_mutex);
+	if ((rc = motion_regions_config_get(mf, config_file)) != NULL)
+		{
+		slist_and_data_free(mf->motion_region_list);
+		mf->motion_region_list = motion_region_list_dup(rc->region_list);
+		mf->n_regions = slist_length(mf->motion_region_list);
+		mf->selected_region = mf->n_regions - 1;
+		mf->prev_selected_region = 0;
+		if (rc->set)
+			motion_region_set_use(mf, rc->set);
+		}
+	pthread_mutex_unlock(&mf->region_list_mutex);
+
+	if (!rc)
 		{
 		if (inform)
 			{
@@ -1188,13 +3080,6 @@ motion_regions_config_load(char *config_file, boolean inform)
 		return FALSE;
 		}
 
-	save_show = motion_frame.show_regions;
-
-	motion_command("delete_regions all");
-	while (fgets(buf, sizeof(buf), f) != NULL)
-		motion_command(buf);
-	fclose(f);
-
 	dup_string(&pikrellcam.motion_regions_name, reg_name);
 	if (inform)
 		{
@@ -1202,6 +3087,5 @@ motion_regions_config_load(char *config_file, boolean inform)
 		display_inform(dbuf);
 		display_inform("timeout 1");
 		}
-	motion_frame.show_regions = save_show;		/* can't double send_cmd()??*/
 	return TRUE;
 	}
@@ -0,0 +1,569 @@
+/* PiKrellCam
+|
+|  Copyright (C) 2015 Bill Wilson    billw@gkrellm.net
+|
+|  PiKrellCam is free software: you can redistribute it and/or modify it
+|  under the terms of the GNU General Public License as published by
+|  the Free Software Foundation, either version 3 of the License, or
+|  (at your option) any later version.
+|
+|  PiKrellCam is distributed in the hope that it will be useful, but WITHOUT
+|  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+|  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+|  License for more details.
+|
+|  You should have received a copy of the GNU General Public License
+|  along with this program. If not, see http://www.gnu.org/licenses/
+|
+|  This file is part of PiKrellCam.
+*/
+
+  /* A fragmented mp4 muxer for the video writer thread.  The file is an
+  |  init segment (ftyp and a moov with no samples) followed by moof/mdat
+  |  fragments, so it is playable as soon as the last fragment is written
+  |  and nothing has to go back to patch sizes or sample tables.
+  |  Fragments are cut at keyframes or MP4_MUX_FRAGMENT_FRAMES frames.
+  |  Sample durations come from the frame timestamps, so a sample's
+  |  duration is known when the next frame comes in.
+  */
+
+#include "pikrellcam.h"
+
+
+static void
+mp4_put(Mp4Buffer *b, void *data, int length)
+	{
+	if (b->length + length > b->alloc)
+		{
+		b->alloc = MAX(2 * b->alloc, b->length + length + 4096);
+		b->data = realloc(b->data, b->alloc);
+		}
+	memcpy(b->data + b->length, data, length);
+	b->length += length;
+	}
+
+static void
+mp4_put8(Mp4Buffer *b, uint32_t value)
+	{
+	uint8_t	byte = value;
+
+	mp4_put(b, &byte, 1);
+	}
+
+static void
+mp4_put16(Mp4Buffer *b, uint32_t value)
+	{
+	uint8_t	bytes[2] = { value >> 8, value };
+
+	mp4_put(b, bytes, 2);
+	}
+
+static void
+mp4_put32(Mp4Buffer *b, uint32_t value)
+	{
+	uint8_t	bytes[4] = { value >> 24, value >> 16, value >> 8, value };
+
+	mp4_put(b, bytes, 4);
+	}
+
+static void
+mp4_put64(Mp4Buffer *b, uint64_t value)
+	{
+	mp4_put32(b, value >> 32);
+	mp4_put32(b, value);
+	}
+
+static void
+mp4_patch32(Mp4Buffer *b, int offset, uint32_t value)
+	{
+	b->data[offset] = value >> 24;
+	b->data[offset + 1] = value >> 16;
+	b->data[offset + 2] = value >> 8;
+	b->data[offset + 3] = value;
+	}
+
+  /* Start a box and return its offset for mp4_box_end() to patch the size.
+  |  version >= 0 makes it a full box.
+  */
+static int
+mp4_box_start(Mp4Buffer *b, char *type, int version, uint32_t flags)
+	{
+	int	offset = b->length;
+
+	mp4_put32(b, 0);
+	mp4_put(b, type, 4);
+	if (version >= 0)
+		mp4_put32(b, (version << 24) | flags);
+	return offset;
+	}
+
+static void
+mp4_box_end(Mp4Buffer *b, int offset)
+	{
+	mp4_patch32(b, offset, b->length - offset);
+	}
+
+static void
+mp4_put_matrix(Mp4Buffer *b)
+	{
+	mp4_put32(b, 0x10000);  mp4_put32(b, 0);  mp4_put32(b, 0);
+	mp4_put32(b, 0);  mp4_put32(b, 0x10000);  mp4_put32(b, 0);
+	mp4_put32(b, 0);  mp4_put32(b, 0);  mp4_put32(b, 0x40000000);
+	}
+
+  /* Find the next Annex B start code at or after *pos.  Returns the offset
+  |  of the NAL unit after it and sets *end to where the NAL before the
+  |  start code ends, or returns -1 with *end = length at the end of data.
+  |  A start code at the very end returns length, callers stop on that too.
+  */
+static int
+mp4_nal_next(uint8_t *data, int length, int pos, int *end)
+	{
+	int	i;
+
+	for (i = pos; i + 2 < length; ++i)
+		{
+		if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1)
+			{
+			*end = (i > pos && data[i - 1] == 0) ? i - 1 : i;
+			return i + 3;
+			}
+		}
+	*end = length;
+	return -1;
+	}
+
+  /* Exp-Golomb reads from an SPS with the emulation prevention bytes
+  |  already removed.  Reads past the end return zero bits.
+  */
+static uint32_t
+mp4_sps_bits(uint8_t *rbsp, int size, int *bit, int n)
+	{
+	uint32_t	value = 0;
+
+	while (n-- > 0)
+		{
+		value <<= 1;
+		if (*bit < size * 8)
+			value |= (rbsp[*bit / 8] >> (7 - *bit % 8)) & 1;
+		*bit += 1;
+		}
+	return value;
+	}
+
+static uint32_t
+mp4_sps_ue(uint8_t *rbsp, int size, int *bit)
+	{
+	int	zeros = 0;
+
+	while (zeros < 31 && *bit < size * 8 && !mp4_sps_bits(rbsp, size, bit, 1))
+		++zeros;
+	return (1U << zeros) - 1 + mp4_sps_bits(rbsp, size, bit, zeros);
+	}
+
+  /* High profile avcC records end with the chroma format and bit depths
+  |  from the SPS.  They are the first fields after seq_parameter_set_id.
+  */
+static void
+mp4_put_avcc_high(Mp4Mux *mux, Mp4Buffer *b)
+	{
+	uint8_t	rbsp[H264_MAX_HEADER_SIZE];
+	int		i, size, zeros, bit, chroma_format, luma_depth, chroma_depth;
+
+	for (i = 1, size = 0, zeros = 0; i < mux->sps_size; ++i)
+		{
+		if (zeros >= 2 && mux->sps[i] == 3)
+			{
+			zeros = 0;
+			continue;
+			}
+		zeros = (mux->sps[i] == 0) ? zeros + 1 : 0;
+		rbsp[size++] = mux->sps[i];
+		}
+	bit = 24;			/* profile, constraint flags, level */
+	mp4_sps_ue(rbsp, size, &bit);		/* seq_parameter_set_id */
+	chroma_format = mp4_sps_ue(rbsp, size, &bit);
+	if (chroma_format == 3)
+		mp4_sps_bits(rbsp, size, &bit, 1);	/* separate_colour_plane_flag */
+	luma_depth = mp4_sps_ue(rbsp, size, &bit);
+	chroma_depth = mp4_sps_ue(rbsp, size, &bit);
+
+	mp4_put8(b, 0xfc | (chroma_format & 3));
+	mp4_put8(b, 0xf8 | (luma_depth & 7));
+	mp4_put8(b, 0xf8 | (chroma_depth & 7));
+	mp4_put8(b, 0);			/* no SPS extensions */
+	}
+
+static void
+mp4_init_segment(Mp4Mux *mux, Mp4Buffer *b)
+	{
+	static char	*brands[] = { "isom", "iso5", "iso6", "avc1", "mp41" };
+	uint8_t		compressor[32];
+	int			i, moov, trak, mdia, minf, dinf, dref, stbl, stsd, avc1, avcc,
+				mvex, box;
+
+	box = mp4_box_start(b, "ftyp", -1, 0);
+	mp4_put(b, "isom", 4);
+	mp4_put32(b, 0x200);
+	for (i = 0; i < (int) (sizeof(brands) / sizeof(char *)); ++i)
+		mp4_put(b, brands[i], 4);
+	mp4_box_end(b, box);
+
+	moov = mp4_box_start(b, "moov", -1, 0);
+
+	box = mp4_box_start(b, "mvhd", 0, 0);
+	mp4_put32(b, 0);			/* creation time */
+	mp4_put32(b, 0);			/* modification time */
+	mp4_put32(b, 1000);		/* timescale */
+	mp4_put32(b, 0);			/* duration is in the fragments */
+	mp4_put32(b, 0x10000);		/* rate 1.0 */
+	mp4_put16(b, 0x100);		/* volume 1.0 */
+	mp4_put16(b, 0);
+	mp4_put64(b, 0);
+	mp4_put_matrix(b);
+	for (i = 0; i < 6; ++i)
+		mp4_put32(b, 0);
+	mp4_put32(b, 2);			/* next track id */
+	mp4_box_end(b, box);
+
+	trak = mp4_box_start(b, "trak", -1, 0);
+	box = mp4_box_start(b, "tkhd", 0, 3);	/* enabled, in movie */
+	mp4_put32(b, 0);
+	mp4_put32(b, 0);
+	mp4_put32(b, 1);			/* track id */
+	mp4_put32(b, 0);
+	mp4_put32(b, 0);			/* duration */
+	mp4_put64(b, 0);
+	mp4_put16(b, 0);			/* layer */
+	mp4_put16(b, 0);			/* alternate group */
+	mp4_put16(b, 0);			/* volume */
+	mp4_put16(b, 0);
+	mp4_put_matrix(b);
+	mp4_put32(b, mux->width << 16);
+	mp4_put32(b, mux->height << 16);
+	mp4_box_end(b, box);
+
+	mdia = mp4_box_start(b, "mdia", -1, 0);
+	box = mp4_box_start(b, "mdhd", 0, 0);
+	mp4_put32(b, 0);
+	mp4_put32(b, 0);
+	mp4_put32(b, MP4_MUX_TIMESCALE);
+	mp4_put32(b, 0);
+	mp4_put16(b, 0x55c4);		/* language "und" */
+	mp4_put16(b, 0);
+	mp4_box_end(b, box);
+
+	box = mp4_box_start(b, "hdlr", 0, 0);
+	mp4_put32(b, 0);
+	mp4_put(b, "vide", 4);
+	mp4_put32(b, 0);
+	mp4_put32(b, 0);
+	mp4_put32(b, 0);
+	mp4_put(b, "VideoHandler", 13);
+	mp4_box_end(b, box);
+
+	minf = mp4_box_start(b, "minf", -1, 0);
+	box = mp4_box_start(b, "vmhd", 0, 1);
+	mp4_put16(b, 0);			/* graphics mode */
+	mp4_put16(b, 0);			/* opcolor */
+	mp4_put16(b, 0);
+	mp4_put16(b, 0);
+	mp4_box_end(b, box);
+
+	dinf = mp4_box_start(b, "dinf", -1, 0);
+	dref = mp4_box_start(b, "dref", 0, 0);
+	mp4_put32(b, 1);
+	box = mp4_box_start(b, "url ", 0, 1);	/* data is in this file */
+	mp4_box_end(b, box);
+	mp4_box_end(b, dref);
+	mp4_box_end(b, dinf);
+
+	stbl = mp4_box_start(b, "stbl", -1, 0);
+	stsd = mp4_box_start(b, "stsd", 0, 0);
+	mp4_put32(b, 1);
+	avc1 = mp4_box_start(b, "avc1", -1, 0);
+	for (i = 0; i < 6; ++i)
+		mp4_put8(b, 0);
+	mp4_put16(b, 1);			/* data reference index */
+	mp4_put16(b, 0);
+	mp4_put16(b, 0);
+	mp4_put32(b, 0);
+	mp4_put32(b, 0);
+	mp4_put32(b, 0);
+	mp4_put16(b, mux->width);
+	mp4_put16(b, mux->height);
+	mp4_put32(b, 0x480000);	/* 72 dpi */
+	mp4_put32(b, 0x480000);
+	mp4_put32(b, 0);
+	mp4_put16(b, 1);			/* frame count */
+	memset(compressor, 0, sizeof(compressor));
+	mp4_put(b, compressor, sizeof(compressor));
+	mp4_put16(b, 0x18);		/* depth */
+	mp4_put16(b, 0xffff);
+
+	avcc = mp4_box_start(b, "avcC", -1, 0);
+	mp4_put8(b, 1);			/* configuration version */
+	mp4_put8(b, mux->sps[1]);	/* profile */
+	mp4_put8(b, mux->sps[2]);	/* profile compatibility */
+	mp4_put8(b, mux->sps[3]);	/* level */
+	mp4_put8(b, 0xff);			/* 4 byte NAL lengths */
+	mp4_put8(b, 0xe1);			/* 1 SPS */
+	mp4_put16(b, mux->sps_size);
+	mp4_put(b, mux->sps, mux->sps_size);
+	mp4_put8(b, 1);			/* 1 PPS */
+	mp4_put16(b, mux->pps_size);
+	mp4_put(b, mux->pps, mux->pps_size);
+	if (   mux->sps[1] == 100 || mux->sps[1] == 110
+	    || mux->sps[1] == 122 || mux->sps[1] == 144
+	   )
+		mp4_put_avcc_high(mux, b);
+	mp4_box_end(b, avcc);
+	mp4_box_end(b, avc1);
+	mp4_box_end(b, stsd);
+
+	/* Empty sample tables, the samples are all in fragments.
+	*/
+	box = mp4_box_start(b, "stts", 0, 0);
+	mp4_put32(b, 0);
+	mp4_box_end(b, box);
+	box = mp4_box_start(b, "stsc", 0, 0);
+	mp4_put32(b, 0);
+	mp4_box_end(b, box);
+	box = mp4_box_start(b, "stsz", 0, 0);
+	mp4_put32(b, 0);
+	mp4_put32(b, 0);
+	mp4_box_end(b, box);
+	box = mp4_box_start(b, "stco", 0, 0);
+	mp4_put32(b, 0);
+	mp4_box_end(b, box);
+	mp4_box_end(b, stbl);
+	mp4_box_end(b, minf);
+	mp4_box_end(b, mdia);
+	mp4_box_end(b, trak);
+
+	mvex = mp4_box_start(b, "mvex", -1, 0);
+	box = mp4_box_start(b, "trex", 0, 0);
+	mp4_put32(b, 1);			/* track id */
+	mp4_put32(b, 1);			/* sample description index */
+	mp4_put32(b, 0);
+	mp4_put32(b, 0);
+	mp4_put32(b, 0);
+	mp4_box_end(b, box);
+	mp4_box_end(b, mvex);
+	mp4_box_end(b, moov);
+	}
+
+static boolean
+mp4_write(Mp4Mux *mux, Mp4Buffer *b)
+	{
+	if (mux->error)
+		return FALSE;
+	if (fwrite(b->data, b->length, 1, mux->file) != 1)
+		{
+		log_printf("mp4 write failed: %m\n");
+		mux->error = TRUE;
+		return FALSE;
+		}
+	mux->written += b->length;
+	return TRUE;
+	}
+
+  /* Write the pending samples as a moof and mdat.  trun data_offset is
+  |  from the start of the moof (default-base-is-moof) to the mdat data.
+  */
+static void
+mp4_fragment_write(Mp4Mux *mux)
+	{
+	Mp4Buffer	*b = &mux->moof;
+	Mp4Sample	*sample;
+	int			moof, traf, trun, box, data_offset, i;
+	uint8_t		mdat_header[8];
+
+	if (mux->n_samples == 0)
+		return;
+	b->length = 0;
+	moof = mp4_box_start(b, "moof", -1, 0);
+	box = mp4_box_start(b, "mfhd", 0, 0);
+	mp4_put32(b, ++mux->sequence);
+	mp4_box_end(b, box);
+
+	traf = mp4_box_start(b, "traf", -1, 0);
+	box = mp4_box_start(b, "tfhd", 0, 0x20000);
+	mp4_put32(b, 1);
+	mp4_box_end(b, box);
+	box = mp4_box_start(b, "tfdt", 1, 0);
+	mp4_put64(b, mux->decode_time);
+	mp4_box_end(b, box);
+
+	/* Sample duration, size and flags present, and a data offset.
+	*/
+	trun = mp4_box_start(b, "trun", 0, 0x701);
+	mp4_put32(b, mux->n_samples);
+	data_offset = b->length;
+	mp4_put32(b, 0);
+	for (i = 0; i < mux->n_samples; ++i)
+		{
+		sample = &mux->samples[i];
+		mp4_put32(b, sample->duration);
+		mp4_put32(b, sample->size);
+		mp4_put32(b, sample->keyframe ? 0x2000000 : 0x1010000);
+		mux->decode_time += sample->duration;
+		}
+	mp4_box_end(b, trun);
+	mp4_box_end(b, traf);
+	mp4_box_end(b, moof);
+	mp4_patch32(b, data_offset, b->length - moof + 8);
+
+	mdat_header[0] = (mux->mdat.length + 8) >> 24;
+	mdat_header[1] = (mux->mdat.length + 8) >> 16;
+	mdat_header[2] = (mux->mdat.length + 8) >> 8;
+	mdat_header[3] = (mux->mdat.length + 8);
+	memcpy(mdat_header + 4, "mdat", 4);
+	mp4_put(b, mdat_header, 8);
+
+	if (mp4_write(mux, b))
+		mp4_write(mux, &mux->mdat);
+	mux->mdat.length = 0;
+	mux->n_samples = 0;
+	}
+
+  /* Frame timestamp difference to a sample duration in MP4_MUX_TIMESCALE
+  |  units, scaled for an output fps other than the camera fps.  Gaps from
+  |  a pause or a writer resync get the previous duration.
+  */
+static uint32_t
+mp4_duration(Mp4Mux *mux, uint64_t usec)
+	{
+	int64_t		delta = usec - mux->usec_last;
+	uint32_t	duration;
+
+	if (delta <= 0 || delta > 1000000)
+		return mux->duration_last;
+	duration = delta * MP4_MUX_TIMESCALE * mux->fps / (1000000LL * mux->out_fps);
+	mux->duration_last = duration;
+	return duration;
+	}
+
+  /* Add a frame of Annex B video data.  SPS and PPS are in the init
+  |  segment and access unit delimiters are not needed, so those NAL units
+  |  are dropped and the rest are written with 4 byte lengths.
+  */
+void
+mp4_mux_frame(Mp4Mux *mux, uint8_t *data, int length, uint64_t usec,
+			boolean keyframe)
+	{
+	Mp4Sample	*sample;
+	int			pos, next, end, start, type;
+
+	if (!mux->init_written)
+		{
+		mp4_init_segment(mux, &mux->moof);
+		mp4_write(mux, &mux->moof);
+		mux->init_written = TRUE;
+		}
+	if (mux->n_samples > 0)
+		{
+		mux->samples[mux->n_samples - 1].duration = mp4_duration(mux, usec);
+		if (   keyframe
+		    || mux->n_samples == MP4_MUX_FRAGMENT_FRAMES
+		    || mux->mdat.length > MP4_MUX_FRAGMENT_BYTES
+		   )
+			mp4_fragment_write(mux);
+		}
+
+	sample = &mux->samples[mux->n_samples];
+	start = mux->mdat.length;
+	pos = mp4_nal_next(data, length, 0, &end);
+	while (pos >= 0 && pos < length)
+		{
+		next = mp4_nal_next(data, length, pos, &end);
+		type = data[pos] & 0x1f;
+		if (end > pos && type != 7 && type != 8 && type != 9)
+			{
+			mp4_put32(&mux->mdat, end - pos);
+			mp4_put(&mux->mdat, data + pos, end - pos);
+			}
+		pos = next;
+		}
+	if (mux->mdat.length == start)
+		return;
+	sample->size = mux->mdat.length - start;
+	sample->keyframe = keyframe;
+	sample->duration = mux->duration_last;
+	mux->usec_last = usec;
+	mux->n_samples += 1;
+	}
+
+  /* The h264 header from the encoder has the SPS and PPS NAL units the
+  |  avcC box needs.  Nothing is written until the first frame, so this
+  |  can be called with the vcb locked.
+  */
+Mp4Mux *
+mp4_mux_open(FILE *file, int8_t *header, int header_size,
+			int width, int height, int fps, int out_fps)
+	{
+	Mp4Mux		*mux;
+	uint8_t		*data = (uint8_t *) header;
+	int			pos, next, end, type;
+
+	if (header_size > H264_MAX_HEADER_SIZE)
+		return NULL;
+	mux = calloc(1, sizeof(Mp4Mux));
+	pos = mp4_nal_next(data, header_size, 0, &end);
+	while (pos >= 0 && pos < header_size)
+		{
+		next = mp4_nal_next(data, header_size, pos, &end);
+		type = data[pos] & 0x1f;
+		if (type == 7 && !mux->sps && end - pos >= 4)
+			{
+			mux->sps = data + pos;
+			mux->sps_size = end - pos;
+			}
+		else if (type == 8 && !mux->pps && end > pos)
+			{
+			mux->pps = data + pos;
+			mux->pps_size = end - pos;
+			}
+		pos = next;
+		}
+	if (!mux->sps || !mux->pps)
+		{
+		log_printf("mp4 mux: no SPS/PPS in the h264 header.\n");
+		free(mux);
+		return NULL;
+		}
+	/* Keep a copy, the header in the vcb changes on a camera restart.
+	*/
+	memcpy(mux->header, header, header_size);
+	mux->sps = mux->header + (mux->sps - data);
+	mux->pps = mux->header + (mux->pps - data);
+
+	mux->file = file;
+	mux->width = width;
+	mux->height = height;
+	mux->fps = fps > 0 ? fps : 24;
+	mux->out_fps = out_fps > 0 ? out_fps : mux->fps;
+	mux->duration_last = MP4_MUX_TIMESCALE / mux->out_fps;
+	return mux;
+	}
+
+  /* Write the last fragment and return the mp4 size.  The file is left
+  |  open for the caller.
+  */
+int
+mp4_mux_close(Mp4Mux *mux)
+	{
+	int		written;
+
+	if (!mux->init_written)
+		{
+		mp4_init_segment(mux, &mux->moof);
+		mp4_write(mux, &mux->moof);
+		}
+	mp4_fragment_write(mux);
+	written = mux->error ? -1 : mux->written;
+	free(mux->moof.data);
+	free(mux->mdat.data);
+	free(mux);
+	return written;
+	}
@@ -0,0 +1,267 @@
+/* PiKrellCam
+|
+|  Copyright (C) 2015 Bill Wilson    billw@gkrellm.net
+|
+|  PiKrellCam is free software: you can redistribute it and/or modify it
+|  under the terms of the GNU General Public License as published by
+|  the Free Software Foundation, either version 3 of the License, or
+|  (at your option) any later version.
+|
+|  PiKrellCam is distributed in the hope that it will be useful, but WITHOUT
+|  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+|  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+|  License for more details.
+|
+|  You should have received a copy of the GNU General Public License
+|  along with this program. If not, see http://www.gnu.org/licenses/
+|
+|  This file is part of PiKrellCam.
+*/
+
+  /* Stand in for the camera, config and main loop parts of PiKrellCam so
+  |  motion.c can be run on recorded or generated vectors.  Built only with
+  |  PIKRELLCAM_NO_MMAL (see the replay target in the Makefile).
+  */
+
+#include "pikrellcam.h"
+#include <stddef.h>
+
+MOTION_TLS PiKrellCam			pikrellcam;
+MOTION_TLS VideoCircularBuffer	video_circular_buffer;
+
+
+  /* Motion options that can be set for a run.  Defaults are the
+  |  config.c defaults.  Values are offsets into pikrellcam since it is
+  |  a different struct in each motion-tune thread.
+  */
+typedef struct
+	{
+	char	*option,
+			*arg;
+	size_t	offset;
+	boolean	is_bool;
+	}
+	OfflineOption;
+
+#define PKC(field)	offsetof(PiKrellCam, field)
+
+static OfflineOption	offline_options[] =
+	{
+	{ "motion_magnitude_limit",       "5",   PKC(motion_magnitude_limit), FALSE },
+	{ "motion_magnitude_limit_count", "4",   PKC(motion_magnitude_limit_count), FALSE },
+	{ "motion_burst_count",           "400", PKC(motion_burst_count), FALSE },
+	{ "motion_burst_frames",          "3",   PKC(motion_burst_frames), FALSE },
+	{ "motion_confirm_gap",           "4",   PKC(motion_times.confirm_gap), FALSE },
+	{ "motion_track_frames",          "0",   PKC(motion_track_frames), FALSE },
+	{ "motion_track_distance",        "3",   PKC(motion_track_distance), FALSE },
+	{ "motion_coherence_frames",      "0",   PKC(motion_coherence_frames), FALSE },
+	{ "motion_event_gap",             "30",  PKC(motion_times.event_gap), FALSE },
+	{ "motion_pre_capture",           "5",   PKC(motion_times.pre_capture), FALSE },
+	{ "motion_post_capture",          "5",   PKC(motion_times.post_capture), FALSE },
+	{ "motion_area_min_side",         "60",  PKC(motion_area_min_side), FALSE },
+	{ "motion_vertical_filter",       "off", PKC(motion_vertical_filter), TRUE },
+	{ "motion_simd",                  "on",  PKC(motion_simd), TRUE },
+	{ "motion_blobs",                 "off", PKC(motion_blobs), TRUE },
+	{ "motion_noise_percent",         "0",   PKC(motion_noise_percent), FALSE },
+	{ "motion_sad_count",             "0",   PKC(motion_sad_count), FALSE },
+	{ "mjpeg_width",                  "640", PKC(mjpeg_width), FALSE },
+	};
+
+#define N_OFFLINE_OPTIONS	(sizeof(offline_options) / sizeof(OfflineOption))
+
+
+boolean
+config_boolean_value(char *value)
+	{
+	if (   (*value == '1' && *(value + 1) == '\0')
+	    || !strcasecmp(value, "on")
+	    || !strcasecmp(value, "true")
+	   )
+		return TRUE;
+	return FALSE;
+	}
+
+void
+config_set_boolean(boolean *result, char *arg)
+	{
+	if (!strcasecmp(arg, "toggle"))
+		*result = *result ? 0 : 1;
+	else
+		*result = config_boolean_value(arg);
+	}
+
+static void
+offline_defaults(void)
+	{
+	OfflineOption	*opt;
+	static MOTION_TLS boolean	done_once;
+
+	if (done_once)
+		return;
+	done_once = TRUE;
+	for (opt = offline_options; opt < offline_options + N_OFFLINE_OPTIONS; ++opt)
+		offline_config_set(opt->option, opt->arg);
+	}
+
+boolean
+offline_config_set(char *option, char *arg)
+	{
+	OfflineOption	*opt;
+	int				*value;
+
+	offline_defaults();
+	for (opt = offline_options; opt < offline_options + N_OFFLINE_OPTIONS; ++opt)
+		{
+		if (strcmp(opt->option, option))
+			continue;
+		value = (int *) ((char *) &pikrellcam + opt->offset);
+		if (opt->is_bool)
+			*value = config_boolean_value(arg);
+		else if (isdigit(*arg))
+			*value = atoi(arg);
+		else
+			return FALSE;
+		return TRUE;
+		}
+	return FALSE;
+	}
+
+char *
+fname_base(char *path)
+	{
+	char *s, *slash;
+
+	for (s = path, slash = NULL; *s; ++s)
+		if (*s == '/')
+			slash = s;
+	return slash ? slash + 1 : path;
+	}
+
+void
+log_printf_no_timestamp(char *fmt, ...)
+	{
+	va_list	args;
+
+	va_start(args, fmt);
+	if (pikrellcam.verbose)
+		vfprintf(stderr, fmt, args);
+	va_end(args);
+	}
+
+void
+log_printf(char *fmt, ...)
+	{
+	va_list	args;
+	char	tbuf[32];
+
+	va_start(args, fmt);
+	if (pikrellcam.verbose)
+		{
+		strftime(tbuf, sizeof(tbuf), "%T", &pikrellcam.tm_local);
+		fprintf(stderr, "%s : ", tbuf);
+		vfprintf(stderr, fmt, args);
+		}
+	va_end(args);
+	}
+
+void
+display_inform(char *args)
+	{
+	}
+
+  /* There is no motion thread, motion_frame_process() is called directly.
+  */
+void
+motion_queue_reset(void)
+	{
+	}
+
+  /* No video file is written.  The state goes to MOTION_RECORD_START and
+  |  offline_video_frame() does what the h264 callback does with it.
+  */
+void
+video_record_start(VideoCircularBuffer *vcb, int start_state)
+	{
+	if (vcb->state == VCB_STATE_MANUAL_RECORD)
+		return;
+	pikrellcam.video_motion_sequence += 1;
+	vcb->state = start_state;
+	}
+
+  /* Virtual clock, the replacement for the main loop setting t_now.
+  */
+void
+offline_clock_set(uint64_t usec)
+	{
+	pikrellcam.t_now = (time_t) (usec / 1000000);
+	localtime_r(&pikrellcam.t_now, &pikrellcam.tm_local);
+	}
+
+  /* Call once per video frame after any motion_frame_process().  Returns
+  |  EVENT_MOTION_BEGIN or EVENT_MOTION_END when the h264 encoder callback
+  |  would start or stop a motion video.
+  */
+int
+offline_video_frame(VideoCircularBuffer *vcb)
+	{
+	time_t	t_cur = pikrellcam.t_now;
+
+	if (vcb->state == VCB_STATE_MOTION_RECORD_START)
+		{
+		vcb->record_start = t_cur - pikrellcam.motion_times.pre_capture;
+		vcb->motion_sync_time = t_cur + pikrellcam.motion_times.post_capture;
+		vcb->state = VCB_STATE_MOTION_RECORD;
+		return EVENT_MOTION_BEGIN;
+		}
+	if (   vcb->state == VCB_STATE_MOTION_RECORD
+	    && t_cur > vcb->motion_sync_time
+	    && t_cur >= vcb->motion_last_detect_time + pikrellcam.motion_times.event_gap
+	   )
+		{
+		vcb->state = VCB_STATE_NONE;
+		return EVENT_MOTION_END;
+		}
+	return 0;
+	}
+
+  /* Set up the motion frame for a video size with the config.c default
+  |  motion regions.  Options set with offline_config_set() before this
+  |  are kept.  Each call is a camera start, so a thread can run several
+  |  recordings without state from one carrying into the next.
+  */
+void
+offline_init(int video_width, int video_height, int fps, int divider)
+	{
+	MotionFrame	*mf = &motion_frame;
+
+	offline_defaults();
+	memset(&video_circular_buffer, 0, sizeof(video_circular_buffer));
+	mf->burst_frame = mf->sad_frame = 0;
+	mf->any_count_expma = mf->sparkle_expma = 0;
+	mf->frame_window = 0;
+	memset(mf->tracks, 0, sizeof(mf->tracks));
+	mf->track_id = 0;
+	mf->coherence_set_id = 0;
+
+	pikrellcam.camera_config.video_width = video_width;
+	pikrellcam.camera_config.video_height = video_height;
+	pikrellcam.camera_adjust.video_fps = fps;
+	pikrellcam.mjpeg_divider = divider;
+	pikrellcam.mjpeg_height = pikrellcam.mjpeg_width * video_height / video_width;
+	pikrellcam.mjpeg_height &= ~0xf;
+	if (!pikrellcam.motion_preview_save_mode)
+		pikrellcam.motion_preview_save_mode = "best";
+	if (!pikrellcam.video_pathname)
+		pikrellcam.video_pathname = "offline";
+	if (!pikrellcam.config_dir)
+		pikrellcam.config_dir = ".";
+
+	motion_init();
+	motion_command("delete_regions all");
+	motion_command("add_region 0.042 0.159 0.224 0.756");
+	motion_command("add_region 0.266 0.159 0.233 0.756");
+	motion_command("add_region 0.500 0.150 0.233 0.750");
+	motion_command("add_region 0.734 0.156 0.224 0.753");
+	motion_frame.motion_enable = TRUE;
+	motion_frame.show_regions = FALSE;
+	}
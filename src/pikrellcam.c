@@ -137,6 +137,7 @@ camera_start(void)
 
 	motion_init();
 	circular_buffer_init();
+	motion_thread_start();
 
 	if (!camera_create())
 		{
@@ -387,9 +388,10 @@ timelapse_inform_convert(void)
 void
 video_record_start(VideoCircularBuffer *vcb, int start_state)
 	{
+	FILE    *file;
 	char    *s, *tag, *path, *stats_path = NULL, seq_buf[12];
 	int     *seq;
-	boolean do_stats = FALSE;
+	boolean do_stats = FALSE, mp4mux;
 
 	if (vcb->state == VCB_STATE_MANUAL_RECORD)
 		return;
@@ -416,62 +418,66 @@ video_record_start(VideoCircularBuffer *vcb, int start_state)
 	free(path);
 	path = pikrellcam.video_pathname;
 
+	mp4mux = FALSE;
+	pikrellcam.video_mp4box = FALSE;
 	if ((s = strstr(path, ".mp4")) != NULL && *(s + 4) == '\0')
 		{
 		if (do_stats)
 			{
 			*s = '\0';
-			asprintf(&stats_path, "%s.csv", path);
+			asprintf(&stats_path, "%s.%s", path,
+					pikrellcam.motion_stats_binary ? "mstats" : "csv");
 			*s = '.';
 			}
-		asprintf(&path, "%s.h264", pikrellcam.video_pathname);
-		dup_string(&pikrellcam.video_h264, path);
-		free(path);
-		path = pikrellcam.video_h264;
-		pikrellcam.video_mp4box = TRUE;
+		/* The built in muxer writes the .mp4 directly.  Otherwise write
+		|  a .h264 for MP4Box to box when the record stops.
+		*/
+		if (pikrellcam.video_mp4_muxer)
+			mp4mux = TRUE;
+		else
+			{
+			asprintf(&path, "%s.h264", pikrellcam.video_pathname);
+			dup_string(&pikrellcam.video_h264, path);
+			free(path);
+			path = pikrellcam.video_h264;
+			pikrellcam.video_mp4box = TRUE;
+			}
 		}
-	else
-		pikrellcam.video_mp4box = FALSE;
 
-	if ((vcb->file = fopen(path, "w")) == NULL)
+	if ((file = fopen(path, "w")) == NULL)
 		log_printf("Could not create video file %s.  %m\n", path);
+	else if (!video_writer_open(vcb, file, path,
+				start_state == VCB_STATE_MOTION_RECORD_START,
+				pikrellcam.video_mp4box, mp4mux))
+		fclose(file);
 	else
 		{
 		log_printf("Video record: %s ...\n", path);
 		vcb->state = start_state;
 		pikrellcam.state_modified = TRUE;
-		if (   do_stats
-		    && (vcb->motion_stats_file = fopen(stats_path, "w")) != NULL
-		   )
-			vcb->motion_stats_do_header = TRUE;
+		if (do_stats)
+			motion_stats_open(vcb, stats_path, pikrellcam.motion_stats_binary);
 		}
+	if (stats_path)
+		free(stats_path);
 	}
 
-  /* vcb should be locked before calling video_record_stop()
+  /* vcb should be locked before calling video_record_stop().  It can be
+  |  called from the h264 callback, so the file is left to the writer and
+  |  the rest of the stop is in video_record_finish().
   */
 void
 video_record_stop(VideoCircularBuffer *vcb)
 	{
-	struct statvfs st;
-	struct stat    st_h264;
+	VideoWriter    *vw = vcb->writer;
 	MotionFrame    *mf = &motion_frame;
-	unsigned long  tmp_space;
-	Event          *event = NULL;
-	char           *cmd, *tmp_dir, *detect;
+	char           *detect;
 
-	if (!vcb->file)
+	if (!vw)
 		return;
 
-	fclose(vcb->file);
-	vcb->file = NULL;
-	if (vcb->motion_stats_file)
-		{
-		fclose(vcb->motion_stats_file);
-		vcb->motion_stats_file = NULL;
-		}
-	log_printf("Video %s record stopped. Header size: %d  h264 file size: %d\n",
-			(vcb->state & VCB_STATE_MOTION_RECORD) ? "motion" : "manual",
-			pikrellcam.video_header_size, pikrellcam.video_size);
+	video_writer_close(vcb);
+	motion_stats_close(vcb);
 	if (vcb->state & VCB_STATE_MOTION_RECORD)
 		{
 		if ((mf->first_detect & (MOTION_BURST | MOTION_VECTOR))
@@ -479,6 +485,10 @@ video_record_stop(VideoCircularBuffer *vcb)
 			detect = "both";
 		else if (mf->first_detect & MOTION_BURST)
 			detect = "burst";
+		else if ((mf->first_detect & (MOTION_SAD | MOTION_VECTOR)) == MOTION_SAD)
+			detect = "sad";
+		else if ((mf->first_detect & (MOTION_PIXEL | MOTION_VECTOR)) == MOTION_PIXEL)
+			detect = "pixel";
 		else
 			detect = "direction";
 		log_printf(
@@ -490,13 +500,58 @@ video_record_stop(VideoCircularBuffer *vcb)
 	if (pikrellcam.verbose_motion && !pikrellcam.verbose)
 		printf("***Motion record stop: %s\n", pikrellcam.video_pathname);
 
-	if (pikrellcam.video_mp4box)
+	if (vcb->state & VCB_STATE_MOTION_RECORD)
+		{
+		if (!strcmp(pikrellcam.motion_preview_save_mode, "best"))
+			{
+			motion_preview_area_fixup();
+			event_add("motion area thumb", pikrellcam.t_now, 0,
+					event_motion_area_thumb, NULL);
+			event_add("preview save command", pikrellcam.t_now, 0,
+					event_preview_save_cmd,
+					pikrellcam.on_motion_preview_save_cmd);
+			}
+		}
+	event_add("preview dispose", pikrellcam.t_now, 0,
+					event_preview_dispose, NULL);
+	vcb->state = VCB_STATE_NONE;
+	pikrellcam.state_modified = TRUE;
+	vcb->pause = FALSE;
+	}
+
+  /* Event loop part of a record stop, after the video writer has closed
+  |  the file.  A new record may already be running, so everything about
+  |  the stopped one comes from the writer.
+  */
+void
+video_record_finish(VideoWriter *vw)
+	{
+	struct statvfs st;
+	struct stat    st_h264;
+	unsigned long  tmp_space;
+	Event          *event = NULL;
+	char           *cmd, *tmp_dir, *pathname, *s;
+
+	log_printf("Video %s record stopped. Header size: %d  %s file size: %d\n",
+			vw->motion ? "motion" : "manual",
+			vw->header_size, vw->mp4mux ? "mp4" : "h264", vw->written);
+	if (vw->overruns > 0)
+		log_printf("    video writer overruns: %d (data dropped to next keyframe)\n",
+			vw->overruns);
+
+	/* An mp4 video is written as path.h264 first.
+	*/
+	pathname = strdup(vw->path);
+	if (vw->mp4box && (s = strstr(pathname, ".h264")) != NULL && *(s + 5) == '\0')
+		*s = '\0';
+
+	if (vw->mp4box)
 		{
 		statvfs("/tmp", &st);
 		tmp_space = st.f_bfree * st.f_frsize;
 
 		st_h264.st_size = 0;
-		stat(pikrellcam.video_h264, &st_h264);
+		stat(vw->path, &st_h264);
 
 		if (tmp_space > 4 * (unsigned long) st_h264.st_size / 3)
 			tmp_dir = "/tmp";
@@ -507,35 +562,24 @@ video_record_stop(VideoCircularBuffer *vcb)
 				pikrellcam.verbose ? "" : "-quiet",
 				tmp_dir,
 				pikrellcam.camera_adjust.video_mp4box_fps,
-				pikrellcam.video_h264, pikrellcam.video_pathname,
+				vw->path, pathname,
 				pikrellcam.verbose ? "" : "2> /dev/null",
-				pikrellcam.video_h264);
-		if (   (vcb->state & VCB_STATE_MOTION_RECORD)
-		    && *pikrellcam.on_motion_end_cmd
-		   )
+				vw->path);
+		if (vw->motion && *pikrellcam.on_motion_end_cmd)
 			event = exec_child_event("motion end command", cmd, NULL);
 		else
 			exec_no_wait(cmd, NULL);
 		free(cmd);
 		}
-	dup_string(&pikrellcam.video_last, pikrellcam.video_pathname);
+	dup_string(&pikrellcam.video_last, pathname);
 	pikrellcam.state_modified = TRUE;
 
 	pikrellcam.video_notify = TRUE;
 	event_count_down_add("video saved notify",
 				pikrellcam.notify_duration * EVENT_LOOP_FREQUENCY,
 				event_notify_expire, &pikrellcam.video_notify);
-	if (vcb->state & VCB_STATE_MOTION_RECORD)
+	if (vw->motion)
 		{
-		if (!strcmp(pikrellcam.motion_preview_save_mode, "best"))
-			{
-			motion_preview_area_fixup();
-			event_add("motion area thumb", pikrellcam.t_now, 0,
-					event_motion_area_thumb, NULL);
-			event_add("preview save command", pikrellcam.t_now, 0,
-					event_preview_save_cmd,
-					pikrellcam.on_motion_preview_save_cmd);
-			}
 		if (event)	/* a mp4 video save event needs a MP4Box child exit */
 			{
 			event->data = pikrellcam.on_motion_end_cmd;
@@ -545,11 +589,9 @@ video_record_stop(VideoCircularBuffer *vcb)
 			event_add("motion end command", pikrellcam.t_now, 0,
 					event_motion_end_cmd, pikrellcam.on_motion_end_cmd);
 		}
-	event_add("preview dispose", pikrellcam.t_now, 0,
-					event_preview_dispose, NULL);
-	vcb->state = VCB_STATE_NONE;
-	pikrellcam.state_modified = TRUE;
-	vcb->pause = FALSE;
+	free(pathname);
+	free(vw->path);
+	free(vw);
 	}
 
 static boolean
@@ -612,6 +654,7 @@ typedef enum
 	                    /* to cancel the menu or adjustment. */
 	video_fps,
 	video_mp4box_fps,
+	capture_vectors,
 	inform,
 	save_config,
 	archive_video,
@@ -654,6 +697,7 @@ static Command commands[] =
 
 	{ "video_fps", video_fps,  1 },
 	{ "video_mp4box_fps", video_mp4box_fps,  1 },
+	{ "capture_vectors", capture_vectors,  1 },
 	{ "inform", inform,    1 },
 	{ "save_config", save_config,    0 },
 	{ "archive_video", archive_video,    1 },
@@ -912,6 +956,15 @@ command_process(char *command_line)
 			pikrellcam.config_modified = TRUE;
 			break;
 
+		case capture_vectors:		/* on / off / toggle */
+			pthread_mutex_lock(&vcb->mutex);
+			if (!strcasecmp(args, "toggle"))
+				motion_vectors_capture(motion_frame.capture ? FALSE : TRUE);
+			else
+				motion_vectors_capture(config_boolean_value(args));
+			pthread_mutex_unlock(&vcb->mutex);
+			break;
+
 		case inform:
 			display_inform(args);
 			break;
@@ -1066,6 +1119,7 @@ main(int argc, char *argv[])
 
 	if (!config_load(pikrellcam.config_file))
 		config_save(pikrellcam.config_file);
+	motion_regions_cache_load();
 	if (!motion_regions_config_load(pikrellcam.motion_regions_config_file, FALSE))
 		motion_regions_config_save(pikrellcam.motion_regions_config_file, FALSE);
 
@@ -1208,6 +1262,8 @@ main(int argc, char *argv[])
 		{
 		usleep(1000000 / EVENT_LOOP_FREQUENCY);
 		event_process();
+		if (pikrellcam.second_tick)
+			motion_load_adapt();
 		tcp_poll_connect();
 
 		/* Process lines in the FIFO.  Single lines via an echo "xxx" > FIFO
@@ -29,6 +29,7 @@
 #include <math.h>
 #include <memory.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <signal.h>
 #include <fcntl.h>
 #include <time.h>
@@ -40,6 +41,10 @@
 #include <sys/time.h>
 #include <sys/types.h>
 
+  /* PIKRELLCAM_NO_MMAL builds (motion-replay) leave out everything camera
+  |  so motion.c can be built on any Linux host.
+  */
+#ifndef PIKRELLCAM_NO_MMAL
 #include "bcm_host.h"
 #include "interface/vcos/vcos.h"
 #include "interface/mmal/mmal.h"
@@ -47,6 +52,19 @@
 #include "interface/mmal/util/mmal_util_params.h"
 #include "interface/mmal/util/mmal_default_components.h"
 #include "interface/mmal/util/mmal_connection.h"
+#else
+#include <limits.h>
+#include <stdarg.h>
+#endif
+
+  /* motion-tune runs a motion engine per thread, so in the offline builds
+  |  the engine globals and the motion.c state statics are thread local.
+  */
+#ifdef PIKRELLCAM_NO_MMAL
+#define MOTION_TLS	__thread
+#else
+#define MOTION_TLS
+#endif
 
 #include "utils.h"
 
@@ -102,6 +120,7 @@ extern int h264_conn_status;
 #define BUFFER_NUMBER_MIN		3
 
 
+#ifndef PIKRELLCAM_NO_MMAL
 /* A camera object is a RPi camera, encoder, resizer or splitter component
 |  and its associated data we need to manage.
 */ 
@@ -133,6 +152,7 @@ typedef struct
 	MMAL_POOL_T			*callback_pool_in;
 	}
 	CameraObject;
+#endif
 
 
 
@@ -215,11 +235,30 @@ typedef struct
 	}
 	CompositeVector;
 
-  /* A composite vector for a region is composed of a > limit count motion
-  |  vectors that have a > than mag2_limit magnitude.  The component vectors
-  |  may have other contstraints, eg individual vectors must all more or less
-  |  point in the same direction.  See motion.c
+  /* Summed-area table entry.  Entry (x, y) of a table (width + 1 by
+  |  height + 1) holds the sums over all macroblocks above and to the left
+  |  so any rectangle sum is four lookups.  See motion.c
+  */
+typedef struct
+	{
+	int		count,			/* mag2 plane nonzero (passing mag2_limit) */
+			sparkle,
+			vx, vy,
+			x, y;
+	}
+	MotionSat;
+
+  /* A region is a rectangle or, if n_points > 0, a polygon with xf0 ... dyf
+  |  its bounding box.  Exclusion regions are polygons whose blocks are
+  |  dropped from the whole frame.  Regions are rasterized into a
+  |  MotionRegionSet when they change, see motion_region_set_compile().
+  |  A region's composite vector is composed of a > limit count of motion
+  |  vectors that have a > than mag2_limit magnitude and more or less point
+  |  in the same direction.  See motion.c
   */
+#define MOTION_REGION_POINTS	16
+#define MOTION_REGIONS_MAX		32		/* bits in a region_map entry */
+
 typedef struct
 	{
 	int		region_number;
@@ -228,26 +267,231 @@ typedef struct
 	int		x, y,			/* Computed from the fractions. */
 			dx, dy;
 
+	int		n_points;		/* polygon vertices, 0 for a rectangle */
+	float	xfp[MOTION_REGION_POINTS],
+			yfp[MOTION_REGION_POINTS];
+	boolean	exclude;
+	int		map_bit;		/* region_map bit and regions[] index, or -1 */
+	MotionSat	sum;		/* this frame's region_map sweep */
+
 	CompositeVector  vector;
 
 	int		reject_count,	/* vectors not pointing in composite direction.  */
-			sparkle_count;	/* number of isolated vectors */
+			sparkle_count,	/* number of isolated vectors */
+			limit_count,	/* mag2_limit_count after any sparkle adjust */
+			sad_count;		/* blocks with sad over baseline */
 	boolean	motion;
 	}
 	MotionRegion;
 
+  /* The region list compiled for one motion frame size.  motion_frame_process()
+  |  gets the region_set once per frame and uses only the set, so region
+  |  commands and load_regions never hold off the motion thread.
+  |  A set is not changed after it is published.  Its regions[] are copies
+  |  of the list regions (no exclusions) whose results the motion thread
+  |  writes each frame.  A set is reference counted: mf->region_set, a
+  |  MotionRegionsConfig cache entry and every reader (the motion frame,
+  |  OSD, pixel motion and stats open) hold a reference, taken with
+  |  motion_region_set_get() under the region_set_mutex, and the last
+  |  motion_region_set_put() frees it.  id tells sets apart where only
+  |  identity matters, since a freed set's address can be reused.
+  */
+typedef struct
+	{
+	int				width, height,	/* motion frame size compiled for */
+					bit_words;
+	uint32_t		*region_map;	/* per block bits of regions[] holding it */
+	uint64_t		*in_region,		/* bit plane of blocks inside motion regions */
+					*exclude;		/*  and inside exclusion regions */
+	MotionRegion	regions[MOTION_REGIONS_MAX];
+	int				n_regions;
+	int				refs;			/* atomic */
+	unsigned int	id;
+	}
+	MotionRegionSet;
+
+  /* A motion-regions-<name>.conf parsed once, at startup or when it changes.
+  */
+typedef struct
+	{
+	char			*path;
+	struct timespec	mtime;
+	off_t			size;
+	SList			*region_list;	/* MotionRegion list as read */
+	MotionRegionSet	*set;			/* compiled for the current video size */
+	}
+	MotionRegionsConfig;
+
+  /* Connected-component labeling of the above plane is done on runs of
+  |  set macroblocks.  Runs in adjacent rows that touch (8-connected) are
+  |  joined with union-find, then each set of runs is summed into a blob.
+  |  See motion.c
+  */
+typedef struct
+	{
+	int16_t	x0, x1,			/* macroblocks [x0, x1) of row y */
+			y;
+	int		parent,			/* union-find, index of a run in the same blob */
+			label;			/* blob sum index, valid for a root run */
+	}
+	MotionRun;
+
+typedef struct
+	{
+	int		count,
+			vx, vy,
+			x, y,
+			mag2,
+			x0, y0, x1, y1;
+	}
+	MotionBlobSum;
+
+#define MOTION_BLOBS_MAX		16
+#define MOTION_BLOB_COHERENCE	70	/* percent, see motion_blobs_find() */
+
+typedef struct
+	{
+	int		x0, y0,			/* bounding box in macroblocks, inclusive */
+			x1, y1;
+	int		x, y,			/* centroid */
+			vx, vy,			/* mean vector */
+			mag2,			/* magnitude^2 of the mean vector */
+			count,
+			coherence;		/* percent, 100 when all vectors are parallel */
+	boolean	motion;
+	}
+	MotionBlob;
+
+  /* Tracks follow region or blob detections from one motion frame to the
+  |  next (nearest predicted centroid, constant velocity).  See motion.c
+  */
+#define MOTION_TRACKS_MAX		8
+#define MOTION_TRACK_MISSES		3	/* motion frames a track can coast unmatched */
+
+typedef struct
+	{
+	int		id,
+			age,			/* motion frames since the track started */
+			hits,			/* motion frames with a matching detection */
+			missed,			/* consecutive motion frames without one */
+			count;			/* vector count of the last detection */
+	float	x, y,			/* centroid in macroblocks */
+			dx, dy,			/* velocity in macroblocks per motion frame */
+			x_start, y_start,
+			distance;		/* macroblocks from the start position */
+	boolean	active,
+			confirmed;		/* hits and distance reached the config limits */
+	}
+	MotionTrack;
+
+  /* The composite vectors of a region's last motion frames with motion,
+  |  for the motion_coherence_frames trajectory test.  See motion.c
+  */
+#define MOTION_COHERENCE_MAX	8
+
+typedef struct
+	{
+	int16_t	x, y,			/* centroid in macroblocks */
+			vx, vy;
+	}
+	MotionRingEntry;
+
+typedef struct
+	{
+	MotionRingEntry	ring[MOTION_COHERENCE_MAX];
+	int				head,	/* next ring slot */
+					n;		/* consecutive motion frames in the ring */
+	}
+	MotionCoherence;
+
+
+  /* Row kernels for motion vector filtering, see simd.c.
+  |  mag2_row: mag2[] from vectors, 0 if < mag2_limit.
+  |  direction_row: pass[] gets 0 if no vector, 1 if it points within 25
+  |    degrees of (vx, vy) whose magnitude^2 is tmag2, else 2.
+  |  noise_row: update the noise[] activity averages from mag2[], then
+  |    noisy[] is 1 and mag2[] is zeroed where noise[] > level.
+  |  sad_row: hit[] is 1 where the vector sad is over twice its baseline
+  |    plus MOTION_SAD_OFFSET, then base[] is moved toward the sad.
+  |  pixel_row: average two Y plane rows 2x2 down for n 16 pixel blocks,
+  |    add each block's 8 absolute differences from bg[] to sad[] and move
+  |    bg[] 1/8 of the way to the averaged pixels.
+  */
+#define MOTION_NOISE_SHIFT	6	/* noise average weight 1/64 per motion frame */
+#define MOTION_SAD_SHIFT	5	/* sad baseline weight 1/32 per motion frame */
+#define MOTION_SAD_OFFSET	256
+
+typedef struct
+	{
+	char	*name;
+	void	(*mag2_row)(MotionVector *mv, uint16_t *mag2, int n, int mag2_limit);
+	void	(*direction_row)(MotionVector *mv, uint16_t *mag2, uint8_t *pass,
+					int n, int vx, int vy, int tmag2);
+	void	(*noise_row)(uint16_t *mag2, uint16_t *noise, uint8_t *noisy,
+					int n, int level);
+	void	(*sad_row)(MotionVector *mv, uint16_t *base, uint8_t *hit, int n);
+	void	(*pixel_row)(uint8_t *y0, uint8_t *y1, uint8_t *bg, uint16_t *sad,
+					int n);
+	}
+	MotionKernels;
+
 
 #define	MOTION_NONE      0
 #define	MOTION_PENDING   1
 #define	MOTION_DETECTED  2
 #define	MOTION_VECTOR    4
 #define	MOTION_BURST     8
+#define	MOTION_SAD       16
+#define	MOTION_PIXEL     32
 
 #define EVENT_MOTION_BEGIN            1
 #define EVENT_MOTION_END              2
 #define EVENT_PREVIEW_SAVE            4
 #define EVENT_MOTION_PREVIEW_SAVE_CMD 8
 
+  /* Motion activity heatmap, memory mapped at tmpfs_dir/motion-heatmap
+  |  when motion_heatmap is on, so the web page or scripts can read it any
+  |  time.  A MotionHeatmapHeader followed by width * height uint32_t counts
+  |  of motion frames each macroblock had a vector over the magnitude limit.
+  |  Once an hour the counts and frames are halved, so count / frames is
+  |  the recent fraction of time a block is active.  Host byte order.
+  */
+#define MOTION_HEATMAP_MAGIC	"PKCHEAT"
+#define MOTION_HEATMAP_VERSION	1
+
+typedef struct
+	{
+	char		magic[8];
+	uint32_t	version,
+				header_size;
+	uint16_t	width,			/* in macroblocks */
+				height;
+	uint32_t	frames;			/* motion frames counted, decayed with the counts */
+	int64_t		decay_time;		/* time_t of the last decay */
+	}
+	MotionHeatmapHeader;
+
+  /* Stats records and vector captures are copied into buf with the vcb
+  |  locked and written out by a writer thread so no file I/O is done with
+  |  the vcb locked.
+  */
+typedef struct
+	{
+	pthread_mutex_t	mutex;
+	pthread_cond_t	cond;
+	FILE		*file;
+	char		*path,
+				*buf,			/* filled by motion_writer_put() */
+				*wbuf;			/* being written by the writer thread */
+	int			size,			/* of buf and wbuf */
+				len,
+				dropped;
+	boolean		binary,
+				closing;
+	int			n_regions;		/* stats per record, from the header */
+	}
+	MotionWriter;
+
 typedef struct
 	{
 	int				motion_status;
@@ -262,13 +506,54 @@ typedef struct
 					height;			/* height in macroblocks */
 	int				vectors_size;
 	MotionVector	*vectors;
+	int				divider;		/* mjpeg_divider raised by motion_load_adapt() */
+	boolean			quiet;			/* too few passing blocks for any motion */
 	CompositeVector	frame_vector,
 					preview_frame_vector,
 					final_preview_vector;
 	CompositeVector	best_region_vector,
 					best_motion_vector;
 	int				cvec_count;
-	int16_t			*trigger;
+	uint16_t		*mag2;			/* >= mag2_limit non sparkle, else 0 */
+	uint16_t		*noise;			/* per block activity average, 0xffff max */
+	uint16_t		*sad_base;		/* per block sad baseline */
+	uint64_t		*above,			/* Bit planes, one bit per macroblock: */
+					*sparkle,		/*  mag2 nonzero, isolated vectors, */
+					*reject,		/*  direction rejects, blocks excluded */
+					*noisy,			/*  by the noise average and sad over */
+					*sad_hit;		/*  its baseline. */
+	int				noisy_count,
+					sad_count,
+					sad_warmup,		/* motion frames before sad can trigger */
+					burst_frame,	/* consecutive frames over the burst count */
+					sad_frame;		/* consecutive frames over motion_sad_count */
+	uint8_t			*pixel_bg;		/* 2x2 averaged preview Y background */
+	uint16_t		*pixel_sad;		/* a block row of background differences */
+	int				pixel_width,	/* preview size of pixel_bg, 0 to reset */
+					pixel_height,
+					pixel_warmup,
+					pixel_count;	/* blocks over motion_pixel_level */
+	boolean			pixel_motion;	/* from the I420 callback, atomic */
+	int				bit_words;		/* uint64_t words per bit plane row */
+	uint8_t			*pass;			/* direction_row() results for a row */
+	MotionSat		*sat;			/* built from mag2 plane each frame */
+	int				*reject_sat;	/* built after region direction filters */
+	MotionKernels	*kernels;
+	MotionRegionSet	*region_set,	/* published by motion_region_set_use() */
+					*frame_set;		/* region_set for the frame being processed */
+	pthread_mutex_t	region_set_mutex;	/* region_set load + reference */
+	MotionRun		*runs;
+	MotionBlobSum	*blob_sums;
+	int				max_runs;
+	MotionBlob		blobs[MOTION_BLOBS_MAX];	/* largest first */
+	int				n_blobs,
+					blob_motion_count;
+	MotionTrack		tracks[MOTION_TRACKS_MAX];
+	int				track_id;		/* last id given to a track */
+	MotionHeatmapHeader
+					*heatmap;		/* mmap of tmpfs_dir/motion-heatmap */
+	size_t			heatmap_size;
+	boolean			heatmap_failed;
 	int				n_regions,
 					selected_region,
 					prev_selected_region;
@@ -295,11 +580,123 @@ typedef struct
 			any_count_expma;	/* of the total frame vector */
 
 	int		frame_window;
+
+	MotionCoherence	coherence[MOTION_REGIONS_MAX];	/* by region_set index */
+	unsigned int	coherence_set_id;	/* id of the set the rings are for */
+
+	MotionWriter	*capture;	/* vcb mutex protects */
+
+	pthread_mutex_t	process_mutex;	/* motion thread vs motion_init() */
 	}
 	MotionFrame;
 
-#define MF_TRIGGER_SIZE	(motion_frame.width * motion_frame.height \
-							* sizeof(*motion_frame.trigger))
+
+  /* Vector buffers handed from the h264 encoder callback to the motion
+  |  thread.  Single producer, single consumer: only the callback advances
+  |  head and only the motion thread advances tail, so no lock is needed.
+  |  MOTION_QUEUE_SIZE must be a power of 2.
+  */
+#define MOTION_QUEUE_SIZE	4
+
+typedef struct
+	{
+	MotionVector	*vectors[MOTION_QUEUE_SIZE];
+	unsigned int	head,
+					tail;
+	unsigned int	overflows;		/* frames dropped with the queue full */
+	sem_t			sem;
+	pthread_t		thread;
+	boolean			running;
+	}
+	MotionQueue;
+
+  /* Motion vector capture file (capture_vectors command) for motion-replay.
+  |  A MotionCaptureHeader, then for every h264 encoder CODECSIDEINFO buffer
+  |  a MotionCaptureFrame followed by length bytes of vector data.
+  |  Host byte order (Pi and x86 are both little endian).
+  */
+#define MOTION_CAPTURE_MAGIC	"PKCVECS"
+#define MOTION_CAPTURE_VERSION	1
+
+typedef struct
+	{
+	char		magic[8];
+	uint32_t	version,
+				header_size;
+	uint16_t	width,			/* in macroblocks */
+				height,
+				video_width,
+				video_height,
+				video_fps,
+				mjpeg_divider;
+	uint32_t	vectors_size;
+	}
+	MotionCaptureHeader;
+
+typedef struct
+	{
+	uint64_t	usec;			/* gettimeofday() time of the buffer */
+	uint32_t	length,
+				reserved;
+	}
+	MotionCaptureFrame;
+
+  /* Motion stats file (motion_stats_binary) for each motion video.  A
+  |  MotionStatsHeader, then for every motion frame a MotionStatsRecord
+  |  followed by n_regions MotionStatsRegion, record_size bytes in all.
+  |  Convert to the .csv format with the motion-stats tool.  Host byte order.
+  */
+#define MOTION_STATS_MAGIC		"PKCSTAT"
+#define MOTION_STATS_VERSION	1
+
+typedef struct
+	{
+	char		magic[8];
+	uint32_t	version,
+				header_size,
+				record_size;
+	uint16_t	width,			/* in macroblocks */
+				height,
+				video_fps,
+				mjpeg_divider,
+				n_regions,
+				reserved;
+	}
+	MotionStatsHeader;
+
+typedef struct
+	{
+	uint32_t	frame_count,	/* video frames since the record start */
+				mag2;
+	int16_t		x, y,			/* frame vector, dx,dy in the object's */
+				dx, dy;			/*  direction of motion */
+	uint16_t	count,
+				track_id,
+				track_age,
+				track_distance,	/* tenths of a macroblock */
+				track_speed,	/* tenths of a macroblock per second */
+				status;			/* motion_status */
+	}
+	MotionStatsRecord;
+
+typedef struct
+	{
+	uint16_t	count,
+				reject_count,
+				sparkle_count;
+	uint8_t		x, y;
+	int8_t		dx, dy;
+	uint8_t		motion,
+				reserved;
+	}
+	MotionStatsRegion;
+
+#define MF_BIT_PLANE_SIZE	(motion_frame.bit_words * motion_frame.height \
+							* sizeof(uint64_t))
+#define MF_BIT(mf, plane, x, y) \
+		(((mf)->plane[(y) * (mf)->bit_words + ((x) >> 6)] >> ((x) & 63)) & 1)
+#define MF_BIT_SET(mf, plane, x, y) \
+		((mf)->plane[(y) * (mf)->bit_words + ((x) >> 6)] |= 1ULL << ((x) & 63))
 
 #define	VCB_STATE_NONE					0
 #define	VCB_STATE_MOTION_RECORD_START	1
@@ -311,47 +708,191 @@ typedef struct
 #define	VCB_STATE_MOTION  (VCB_STATE_MOTION_RECORD_START | VCB_STATE_MOTION_RECORD)
 #define	VCB_STATE_MANUAL  (VCB_STATE_MANUAL_RECORD_START | VCB_STATE_MANUAL_RECORD)
 
+  /* Every video frame in the circular buffer has an entry in the frame
+  |  index, a ring of VideoFrame in encoder order.  Entries are numbered by
+  |  a frame serial, frames[serial & frames_mask], and their data by a byte
+  |  serial, data[byte % size], so an entry is still in the buffer while
+  |  data_serial - byte <= size.  The index is sized from the buffer at
+  |  the nominal bitrate and doubles if smaller frames fill it.
+  |  While waiting for a video record to start, the h264 callback requests
+  |  keyframes once per second, so pre_capture starts within a second of
+  |  the time wanted.
+  */
+#define VIDEO_FRAME_KEYFRAME	0x1
+
+#define VIDEO_FRAME(vcb, serial)	(&(vcb)->frames[(serial) & (vcb)->frames_mask])
+
 typedef struct
 	{
-	int		position;
-	time_t	t_frame;
-	int		frame_count;
+	uint64_t	byte,		/* byte serial of the frame start */
+				usec;		/* encoder pts, else CLOCK_MONOTONIC */
+	int			size;		/* complete at the frame end */
+	uint32_t	flags;
 	}
-	KeyFrame;
+	VideoFrame;
 
 
 #define	H264_MAX_HEADER_SIZE	29	/* Can be less */
 
-  /* While waiting for a video record to start, the h264 callback requests
-  |  keyframes once per second so we can have second resolution on pre_capture
-  |  time.  So the KEYFRAME_SIZE needs to be at least pre_capture time in
-  |  seconds.  For now, make it bigger than anybody would ever want to
-  |  pre_capture...  But FIXME, make the size dynamic based on pre_capture.
+  /* A .mp4 video is written by the mp4mux.c fragmented mp4 muxer from the
+  |  video writer thread, using the frame index timestamps.  MP4Box is
+  |  only run if video_mp4_muxer is off.
+  */
+#define MP4_MUX_TIMESCALE			90000
+#define MP4_MUX_FRAGMENT_FRAMES		64
+#define MP4_MUX_FRAGMENT_BYTES		(4 * 1024 * 1024)
+
+typedef struct
+	{
+	uint8_t	*data;
+	int		length,
+			alloc;
+	}
+	Mp4Buffer;
+
+typedef struct
+	{
+	uint32_t	duration,
+				size;
+	boolean		keyframe;
+	}
+	Mp4Sample;
+
+typedef struct
+	{
+	FILE		*file;
+	uint8_t		header[H264_MAX_HEADER_SIZE];
+	uint8_t		*sps,
+				*pps;
+	int			sps_size,
+				pps_size,
+				width,
+				height,
+				fps,
+				out_fps;		/* video_mp4box_fps */
+
+	Mp4Buffer	moof,
+				mdat;			/* samples of the fragment being built */
+	Mp4Sample	samples[MP4_MUX_FRAGMENT_FRAMES];
+	int			n_samples;
+	uint32_t	sequence,
+				duration_last;
+	uint64_t	decode_time,
+				usec_last;
+	int			written;
+	boolean		init_written,
+				error;
+	}
+	Mp4Mux;
+
+  /* With a video_buffer_dir the circular buffer has two tiers.  The
+  |  callback writes a RAM ring of about VIDEO_BUFFER_RAM_SECONDS of video
+  |  and a spill thread copies it out in order to a file ring of the full
+  |  buffer size.  Readers get bytes before serial from the file and newer
+  |  ones from the RAM ring.  If the spill thread falls a whole RAM ring
+  |  behind, the unspilled data is lost, serial jumps ahead and generation
+  |  is bumped so a copy in progress is not counted.
+  */
+#define VIDEO_BUFFER_RAM_SECONDS	4
+
+typedef struct
+	{
+	pthread_mutex_t	mutex;
+	pthread_cond_t	cond;
+	int8_t		*data;			/* RAM ring mirror mapping */
+	int			fd,				/* dup of the buffer file */
+				ram_size,
+				file_size,
+				losses;
+	uint64_t	serial,			/* next byte to copy out */
+				data_serial,	/* the callback's data_serial */
+				generation;
+	boolean		stop;
+	}
+	VideoSpill;
+
+  /* Video files are written by a writer thread so the h264 callback does no
+  |  file I/O.  The callback publishes circular buffer data with
+  |  vcb_video_write() and the writer copies length bytes from the position
+  |  serial, through its own mapping of the RAM ring or from the buffer
+  |  file, a chunk at a time into buf and writes them with the mutex
+  |  unlocked.  An mp4 writer is published whole frames instead, copies of
+  |  frame index entries queued in frames, and position is the first queued
+  |  frame.  If the writer falls so far behind that the head would come
+  |  within (100 - VIDEO_WRITER_LAG_PERCENT)% of the buffer of its unwritten
+  |  data, that data is dropped, writing starts again at the next keyframe
+  |  and the overrun is counted.
   */
-#define KEYFRAME_SIZE	(15 * 60)
+#define VIDEO_WRITER_LAG_PERCENT	90
+#define VIDEO_WRITER_CHUNK			(256 * 1024)
 
 typedef struct
 	{
 	pthread_mutex_t	mutex;
+	pthread_cond_t	cond;
+	FILE		*file;
+	char		*path;
+	int8_t		*data,			/* RAM ring mirror mapping */
+				*buf;			/* VIDEO_WRITER_CHUNK being written */
+	int			size,			/* of the whole buffer */
+				ram_size,
+				file_fd,		/* dup of the buffer file, -1 if none */
+				buf_size,
+				length;			/* published bytes from position */
+	uint64_t	position,		/* serial of the next byte to write */
+				spill_serial,	/* bytes before this are read from the file */
+				ram_read;		/* start of a RAM ring copy in progress */
+	int			ram_overwrites;	/* the callback wrote over a ram_read */
+
+	Mp4Mux		*mux;			/* NULL for a .h264 video */
+	VideoFrame	*frames;
+	uint64_t	frames_mask,
+				frame_in,
+				frame_out,
+				frame_serial,	/* callback side: next index entry to queue */
+				tail_serial;	/* callback side: data_serial at last publish */
+	int8_t		header[H264_MAX_HEADER_SIZE];
+	int			header_size,
+				written,
+				overruns;
+	boolean		resync,			/* overran, waiting for a keyframe */
+				closing,
+				motion,
+				mp4box,
+				mp4mux;
+	}
+	VideoWriter;
 
-	FILE		*file,
-				*motion_stats_file;
-	boolean		motion_stats_do_header;
+typedef struct
+	{
+	pthread_mutex_t	mutex;
+
+	VideoWriter	*writer;		/* NULL when not recording */
+	MotionWriter	*motion_stats;
 	int			state,
 				frame_count;
 
 	int8_t	   h264_header[H264_MAX_HEADER_SIZE];
 	int		   h264_header_position;
 
-	int8_t	   *data; 		/* h.264 video data array      */
-	int			size;		/* size in bytes of data array */
-	int			head,
-				tail;
-				
-	KeyFrame	key_frame[KEYFRAME_SIZE];
-	int			pre_frame_index,
-				cur_frame_index;
-	boolean		in_keyframe,
+	int8_t	   *data; 		/* h.264 video data RAM ring   */
+	int			size;		/* size in bytes of the buffer */
+	int			ram_size;	/* of data, less than size with a buffer file */
+	int			fd;			/* memfd mapped for data */
+	int			file_fd;	/* video_buffer_dir file ring or -1 */
+	VideoSpill	*spill;		/* copies data out to file_fd */
+	int			head;		/* data offset the next byte goes to */
+	uint64_t	tail,		/* serial of the first unpublished byte */
+				data_serial,	/* bytes ever put in data */
+				spill_serial,	/* bytes before this are in the file */
+				file_first;		/* oldest serial the file has */
+
+	VideoFrame	*frames;		/* frame index */
+	uint64_t	frames_mask,
+				frame_first,	/* oldest entry still in the buffer */
+				frame_next,		/* entry the next frame gets */
+				keyframe_last;	/* latest keyframe entry */
+	boolean		in_frame,
 				pause;
 
 	time_t		record_start,
@@ -410,6 +951,7 @@ typedef struct
 	char	*install_dir,
 			*version,
 			*tmpfs_dir,		/* for mjpeg and info files */
+			*video_buffer_dir,	/* circular buffer file, "" for memory */
 			*archive_dir,
 			*media_dir,
 			*video_dir,
@@ -451,7 +993,16 @@ typedef struct
 			motion_magnitude_limit,
 			motion_magnitude_limit_count,
 			motion_burst_count,
-			motion_burst_frames;
+			motion_burst_frames,
+			motion_track_frames,
+			motion_track_distance,
+			motion_coherence_frames,
+			motion_noise_percent,
+			motion_sad_count,
+			motion_pixel_count,
+			motion_pixel_level,
+			motion_load_percent,
+			motion_load_min_fps;
 	char	*on_motion_begin_cmd,
 			*on_motion_end_cmd,
 			*motion_regions_name;
@@ -460,7 +1011,11 @@ typedef struct
 			*on_motion_preview_save_cmd;
 	boolean	motion_preview_clean,
 			motion_vertical_filter,
-			motion_stats;
+			motion_stats,
+			motion_stats_binary,
+			motion_simd,
+			motion_blobs,
+			motion_heatmap;
 	int		motion_area_min_side;
 
 	CameraConfig
@@ -476,10 +1031,10 @@ typedef struct
 			*video_motion_tag;
 	int		video_manual_sequence,
 			video_motion_sequence,
-			video_header_size,
-			video_size;
+			video_write_overruns;	/* total, see VideoWriter */
 	
-	boolean	video_mp4box;
+	boolean	video_mp4box,
+			video_mp4_muxer;
 
 
 	char	*mjpeg_filename;
@@ -566,6 +1121,7 @@ typedef struct
 	}
 	ParameterTable;
 
+#ifndef PIKRELLCAM_NO_MMAL
 typedef struct
 	{
 	char			*name,
@@ -574,6 +1130,7 @@ typedef struct
 	char			**camera_option;
 	}
 	CameraParameter;
+#endif
 
 
 typedef union
@@ -598,17 +1155,19 @@ typedef struct
 /* ========================== */
 
 
-extern PiKrellCam	pikrellcam;
+extern MOTION_TLS PiKrellCam	pikrellcam;
 
+#ifndef PIKRELLCAM_NO_MMAL
 extern CameraObject	camera;
 extern CameraObject	still_jpeg_encoder;
 extern CameraObject	mjpeg_encoder;
 extern CameraObject	video_h264_encoder;
 extern CameraObject	stream_splitter;
 extern CameraObject	stream_resizer;
+#endif
 
-extern VideoCircularBuffer video_circular_buffer;
-extern MotionFrame  motion_frame;
+extern MOTION_TLS VideoCircularBuffer video_circular_buffer;
+extern MOTION_TLS MotionFrame  motion_frame;
 extern TimeLapse	time_lapse;
 
 extern char  *mmal_status[];
@@ -616,6 +1175,7 @@ extern char  *mmal_status[];
 
 /* ========================== */
 
+#ifndef PIKRELLCAM_NO_MMAL
 boolean		out_port_callback(CameraObject *obj, int port_num,
 					void callback());
 boolean		ports_callback_connect(CameraObject *out, int port_num,
@@ -642,11 +1202,19 @@ void		video_h264_encoder_callback(MMAL_PORT_T *port,
 boolean		camera_create(void);
 void		camera_object_destroy(CameraObject *obj);
 void		circular_buffer_init(void);
+void		vcb_video_write(VideoCircularBuffer *vcb);
+VideoWriter	*video_writer_open(VideoCircularBuffer *vcb, FILE *file, char *path,
+				boolean motion, boolean mp4box, boolean mp4mux);
+void		video_writer_close(VideoCircularBuffer *vcb);
+void		motion_vectors_capture(boolean enable);
+void		motion_thread_start(void);
+void		motion_load_adapt(void);
 
 void		mmalcam_config_parameters_set_camera(void);
 boolean 	mmalcam_config_parameter_set(char *name, char *value, boolean set_camera);
 CameraParameter
 			*mmalcam_config_parameter_get(char *name);
+#endif
 
 extern boolean	config_load(char *config_file);
 extern void		config_save(char *config_file);
@@ -662,6 +1230,7 @@ void		log_printf_no_timestamp(char *fmt, ...);
 void		log_printf(char *fmt, ...);
 void		video_record_start(VideoCircularBuffer *vcb, int);
 void		video_record_stop(VideoCircularBuffer *vcb);
+void		video_record_finish(VideoWriter *vw);
 void		camera_start(void);
 void		camera_stop(void);
 void		camera_restart(void);
@@ -672,13 +1241,41 @@ char		*media_pathname(char *dir, char *fname,
 void	command_process(char *command_line);
 
 void	motion_init(void);
+void	motion_queue_reset(void);
+MotionRegionSet	*motion_region_set_get(MotionFrame *mf);
+void	motion_region_set_put(MotionRegionSet *rs);
 void	motion_command(char *cmd_line);
 void	motion_frame_process(VideoCircularBuffer *vcb, MotionFrame *mf);
+void	motion_pixel_process(MotionFrame *mf, uint8_t *i420, int stride,
+			int height);
+Mp4Mux	*mp4_mux_open(FILE *file, int8_t *header, int header_size,
+			int width, int height, int fps, int out_fps);
+void	mp4_mux_frame(Mp4Mux *mux, uint8_t *data, int length, uint64_t usec,
+			boolean keyframe);
+int		mp4_mux_close(Mp4Mux *mux);
+
+MotionWriter	*motion_writer_open(char *path, int size);
+void	motion_writer_put(MotionWriter *mw, void *head, int head_len,
+				void *data, int len);
+void	motion_writer_close(MotionWriter *mw);
+boolean	motion_stats_open(VideoCircularBuffer *vcb, char *path, boolean binary);
+void	motion_stats_close(VideoCircularBuffer *vcb);
 void	motion_regions_config_save(char *config_file, boolean inform);
 boolean	motion_regions_config_load(char *config_file, boolean inform);
+void	motion_regions_cache_load(void);
 void	motion_preview_file_event(void);
 void	motion_preview_area_fixup(void);
 void	print_cvec(char *str, CompositeVector *cvec);
+MotionKernels *motion_kernels_get(boolean simd);
+
+#ifdef PIKRELLCAM_NO_MMAL
+/* offline.c - camera, config and main loop stand in for motion-replay
+*/
+void	offline_init(int video_width, int video_height, int fps, int divider);
+boolean	offline_config_set(char *option, char *arg);
+void	offline_clock_set(uint64_t usec);
+int		offline_video_frame(VideoCircularBuffer *vcb);
+#endif
 
 /* On Screen Display
 */
@@ -0,0 +1,533 @@
+/* PiKrellCam
+|
+|  Copyright (C) 2015 Bill Wilson    billw@gkrellm.net
+|
+|  PiKrellCam is free software: you can redistribute it and/or modify it
+|  under the terms of the GNU General Public License as published by
+|  the Free Software Foundation, either version 3 of the License, or
+|  (at your option) any later version.
+|
+|  PiKrellCam is distributed in the hope that it will be useful, but WITHOUT
+|  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+|  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public
+|  License for more details.
+|
+|  You should have received a copy of the GNU General Public License
+|  along with this program. If not, see http://www.gnu.org/licenses/
+|
+|  This file is part of PiKrellCam.
+*/
+
+  /* Motion vector row kernels.  The plain C kernels are the reference and
+  |  the NEON or SSE2 kernels (if the compiler has them enabled) must give
+  |  identical results.  motion_kernels_get() picks one at runtime.
+  |
+  |  The direction test was:
+  |      100 * dot * dot / (tmag2 * mvmag2) >= 82
+  |  and for positive integers floor(a / b) >= k is the same as a >= k * b,
+  |  so the test is done without a divide (a library call on a Pi Zero/1)
+  |  and with 64 bit products since 100 * dot * dot can exceed 32 bits.
+  */
+
+#include "pikrellcam.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define	HAVE_NEON
+#if defined(__arm__)
+#include <sys/auxv.h>
+#ifndef HWCAP_ARM_NEON
+#define	HWCAP_ARM_NEON	4096
+#endif
+#endif
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define	HAVE_SSE2
+#endif
+
+#define	COS2_SCALE		100
+#define	COS2_LIMIT		82		/* 100 * cos(25)^2 */
+
+
+static void
+mag2_row_c(MotionVector *mv, uint16_t *mag2, int n, int mag2_limit)
+	{
+	int		i, m;
+
+	for (i = 0; i < n; ++i, ++mv)
+		{
+		m = mv->vx * mv->vx + mv->vy * mv->vy;
+		if (m < mag2_limit)
+			m = 0;
+		mag2[i] = m;
+		}
+	}
+
+static void
+direction_row_c(MotionVector *mv, uint16_t *mag2, uint8_t *pass,
+			int n, int vx, int vy, int tmag2)
+	{
+	int			i, dot;
+	int64_t		lhs, rhs;
+
+	for (i = 0; i < n; ++i, ++mv)
+		{
+		if (mag2[i] == 0)
+			{
+			pass[i] = 0;
+			continue;
+			}
+		dot = vx * mv->vx + vy * mv->vy;
+		lhs = (int64_t) COS2_SCALE * dot * dot;
+		rhs = (int64_t) COS2_LIMIT * tmag2 * mag2[i];
+		pass[i] = (dot > 0 && lhs >= rhs) ? 1 : 2;
+		}
+	}
+
+  /* Fixed point activity average, 0xffff is a block active every frame.
+  |  Shifts rather than a multiply so every kernel rounds the same way.
+  */
+static void
+noise_row_c(uint16_t *mag2, uint16_t *noise, uint8_t *noisy, int n, int level)
+	{
+	int		i;
+
+	for (i = 0; i < n; ++i)
+		{
+		if (mag2[i])
+			noise[i] += (0xffff - noise[i]) >> MOTION_NOISE_SHIFT;
+		else
+			noise[i] -= noise[i] >> MOTION_NOISE_SHIFT;
+		noisy[i] = (noise[i] > level) ? 1 : 0;
+		if (noisy[i])
+			mag2[i] = 0;
+		}
+	}
+
+  /* The baseline moves 1/32 of the way toward each new sad, in integer
+  |  steps the SIMD kernels can do with saturating subtracts.
+  */
+static void
+sad_row_c(MotionVector *mv, uint16_t *base, uint8_t *hit, int n)
+	{
+	int		i, b, sad, limit;
+
+	for (i = 0; i < n; ++i, ++mv)
+		{
+		sad = (uint16_t) mv->sad;
+		b = base[i];
+		limit = MIN(2 * b + MOTION_SAD_OFFSET, 0xffff);
+		hit[i] = (sad > limit) ? 1 : 0;
+		if (sad > b)
+			b += (sad - b) >> MOTION_SAD_SHIFT;
+		else
+			b -= (b - sad) >> MOTION_SAD_SHIFT;
+		base[i] = b;
+		}
+	}
+
+#define	AVG_U8(a, b)	(((a) + (b) + 1) >> 1)
+
+  /* Rounding averages like pavgb and vrhadd so every kernel gives the same
+  |  bytes.  The background step (7 * bg + c) / 8 is three averages with bg.
+  */
+static void
+pixel_row_c(uint8_t *y0, uint8_t *y1, uint8_t *bg, uint16_t *sad, int n)
+	{
+	int		i, k, c, b;
+
+	for (i = 0; i < n; ++i, y0 += 16, y1 += 16, bg += 8)
+		for (k = 0; k < 8; ++k)
+			{
+			c = AVG_U8(AVG_U8(y0[2 * k], y1[2 * k]),
+			           AVG_U8(y0[2 * k + 1], y1[2 * k + 1]));
+			b = bg[k];
+			sad[i] += (c > b) ? c - b : b - c;
+			bg[k] = AVG_U8(b, AVG_U8(b, AVG_U8(b, c)));
+			}
+	}
+
+static MotionKernels	kernels_c =
+	{
+	"c", mag2_row_c, direction_row_c, noise_row_c, sad_row_c, pixel_row_c
+	};
+
+
+#ifdef HAVE_NEON
+  /* vld4 deinterleaves 8 MotionVectors into vx, vy, sad_lo, sad_hi lanes.
+  */
+static void
+mag2_row_neon(MotionVector *mv, uint16_t *mag2, int n, int mag2_limit)
+	{
+	int8x8x4_t	v;
+	uint16x8_t	m, limit = vdupq_n_u16(MIN(mag2_limit, 0x8001));
+	int			i;
+
+	for (i = 0; i + 8 <= n; i += 8, mv += 8)
+		{
+		v = vld4_s8((int8_t *) mv);
+		m = vaddq_u16(vreinterpretq_u16_s16(vmull_s8(v.val[0], v.val[0])),
+		              vreinterpretq_u16_s16(vmull_s8(v.val[1], v.val[1])));
+		m = vandq_u16(m, vcgeq_u16(m, limit));
+		vst1q_u16(mag2 + i, m);
+		}
+	mag2_row_c(mv, mag2 + i, n - i, mag2_limit);
+	}
+
+  /* lhs >= rhs from the sign of the 64 bit difference (both are < 2^38).
+  |  ARMv7 NEON has no 64 bit compare.
+  */
+static inline uint32x2_t
+ge_u64_neon(uint64x2_t lhs, uint64x2_t rhs)
+	{
+	int64x2_t	d;
+
+	d = vreinterpretq_s64_u64(vsubq_u64(lhs, rhs));
+	return vmvn_u32(vmovn_u64(vreinterpretq_u64_s64(vshrq_n_s64(d, 63))));
+	}
+
+static void
+direction_row_neon(MotionVector *mv, uint16_t *mag2, uint8_t *pass,
+			int n, int vx, int vy, int tmag2)
+	{
+	int8x8x4_t	v;
+	int16x8_t	mvx, mvy;
+	uint16x8_t	m;
+	int32x4_t	dot;
+	uint32x4_t	dot10, mm, ok;
+	uint32x2_t	ge_lo, ge_hi;
+	uint16x4_t	res[2];
+	uint16x8_t	code;
+	uint32_t	k = COS2_LIMIT * tmag2;
+	int			i, h;
+
+	for (i = 0; i + 8 <= n; i += 8, mv += 8)
+		{
+		v = vld4_s8((int8_t *) mv);
+		mvx = vmovl_s8(v.val[0]);
+		mvy = vmovl_s8(v.val[1]);
+		m = vld1q_u16(mag2 + i);
+
+		for (h = 0; h < 2; ++h)
+			{
+			if (h == 0)
+				{
+				dot = vmull_n_s16(vget_low_s16(mvx), vx);
+				dot = vmlal_n_s16(dot, vget_low_s16(mvy), vy);
+				mm = vmovl_u16(vget_low_u16(m));
+				}
+			else
+				{
+				dot = vmull_n_s16(vget_high_s16(mvx), vx);
+				dot = vmlal_n_s16(dot, vget_high_s16(mvy), vy);
+				mm = vmovl_u16(vget_high_u16(m));
+				}
+			dot10 = vreinterpretq_u32_s32(vmulq_n_s32(dot, 10));
+			ge_lo = ge_u64_neon(vmull_u32(vget_low_u32(dot10), vget_low_u32(dot10)),
+			                    vmull_n_u32(vget_low_u32(mm), k));
+			ge_hi = ge_u64_neon(vmull_u32(vget_high_u32(dot10), vget_high_u32(dot10)),
+			                    vmull_n_u32(vget_high_u32(mm), k));
+			ok = vandq_u32(vcombine_u32(ge_lo, ge_hi),
+			               vcgtq_s32(dot, vdupq_n_s32(0)));
+			res[h] = vmovn_u32(ok);
+			}
+		/* code: 0 if no vector, else 2 - pass.
+		*/
+		code = vsubq_u16(vdupq_n_u16(2),
+		                 vandq_u16(vcombine_u16(res[0], res[1]), vdupq_n_u16(1)));
+		code = vandq_u16(code, vmvnq_u16(vceqq_u16(m, vdupq_n_u16(0))));
+		vst1_u8(pass + i, vmovn_u16(code));
+		}
+	direction_row_c(mv, mag2 + i, pass + i, n - i, vx, vy, tmag2);
+	}
+
+static void
+noise_row_neon(uint16_t *mag2, uint16_t *noise, uint8_t *noisy, int n, int level)
+	{
+	uint16x8_t	m, nz, up, down, idle, hot,
+				lvl = vdupq_n_u16(level),
+				ones = vdupq_n_u16(0xffff);
+	int			i;
+
+	for (i = 0; i + 8 <= n; i += 8)
+		{
+		m = vld1q_u16(mag2 + i);
+		nz = vld1q_u16(noise + i);
+		up = vaddq_u16(nz, vshrq_n_u16(vsubq_u16(ones, nz), MOTION_NOISE_SHIFT));
+		down = vsubq_u16(nz, vshrq_n_u16(nz, MOTION_NOISE_SHIFT));
+		idle = vceqq_u16(m, vdupq_n_u16(0));
+		nz = vbslq_u16(idle, down, up);
+		vst1q_u16(noise + i, nz);
+		hot = vcgtq_u16(nz, lvl);
+		vst1q_u16(mag2 + i, vbicq_u16(m, hot));
+		vst1_u8(noisy + i, vmovn_u16(vandq_u16(hot, vdupq_n_u16(1))));
+		}
+	noise_row_c(mag2 + i, noise + i, noisy + i, n - i, level);
+	}
+
+  /* vld2 on uint16 splits 8 MotionVectors into (vx, vy) and sad lanes.
+  */
+static void
+sad_row_neon(MotionVector *mv, uint16_t *base, uint8_t *hit, int n)
+	{
+	uint16x8x2_t	v;
+	uint16x8_t		b, limit, up, down;
+	int				i;
+
+	for (i = 0; i + 8 <= n; i += 8, mv += 8)
+		{
+		v = vld2q_u16((uint16_t *) mv);
+		b = vld1q_u16(base + i);
+		limit = vqaddq_u16(vqaddq_u16(b, b), vdupq_n_u16(MOTION_SAD_OFFSET));
+		vst1_u8(hit + i, vmovn_u16(vandq_u16(vcgtq_u16(v.val[1], limit),
+		                                     vdupq_n_u16(1))));
+		up = vshrq_n_u16(vqsubq_u16(v.val[1], b), MOTION_SAD_SHIFT);
+		down = vshrq_n_u16(vqsubq_u16(b, v.val[1]), MOTION_SAD_SHIFT);
+		vst1q_u16(base + i, vsubq_u16(vaddq_u16(b, up), down));
+		}
+	sad_row_c(mv, base + i, hit + i, n - i);
+	}
+
+  /* vld2 splits 16 pixels into even and odd columns.
+  */
+static void
+pixel_row_neon(uint8_t *y0, uint8_t *y1, uint8_t *bg, uint16_t *sad, int n)
+	{
+	uint8x8x2_t	a0, a1;
+	uint8x8_t	c, b;
+	int			i;
+
+	for (i = 0; i < n; ++i, y0 += 16, y1 += 16, bg += 8)
+		{
+		a0 = vld2_u8(y0);
+		a1 = vld2_u8(y1);
+		c = vrhadd_u8(vrhadd_u8(a0.val[0], a1.val[0]),
+		              vrhadd_u8(a0.val[1], a1.val[1]));
+		b = vld1_u8(bg);
+		sad[i] += vget_lane_u64(vpaddl_u32(vpaddl_u16(vpaddl_u8(vabd_u8(c, b)))), 0);
+		vst1_u8(bg, vrhadd_u8(b, vrhadd_u8(b, vrhadd_u8(b, c))));
+		}
+	}
+
+static MotionKernels	kernels_simd =
+	{
+	"neon", mag2_row_neon, direction_row_neon, noise_row_neon, sad_row_neon,
+	pixel_row_neon
+	};
+#endif	/* HAVE_NEON */
+
+
+#ifdef HAVE_SSE2
+  /* Four MotionVectors per register.  Make (vx, vy) int16 pairs in each
+  |  32 bit lane and madd them with themselves to get vx*vx + vy*vy.
+  */
+static inline __m128i
+mag2_4_sse2(MotionVector *mv)
+	{
+	__m128i	v, lo, hi;
+
+	v = _mm_loadu_si128((__m128i *) mv);
+	lo = _mm_and_si128(_mm_srai_epi16(_mm_slli_epi16(v, 8), 8),
+	                   _mm_set1_epi32(0xffff));
+	hi = _mm_srai_epi16(_mm_slli_epi32(v, 16), 8);
+	lo = _mm_or_si128(lo, hi);
+	return _mm_madd_epi16(lo, lo);
+	}
+
+static void
+mag2_row_sse2(MotionVector *mv, uint16_t *mag2, int n, int mag2_limit)
+	{
+	__m128i	bias32 = _mm_set1_epi32(0x8000),
+			bias16 = _mm_set1_epi16((int16_t) 0x8000),
+			limit, m;
+	int		i;
+
+	/* mag2 can be 32768 which needs a biased signed pack and compare.
+	*/
+	limit = _mm_set1_epi16(MIN(mag2_limit, 0x8001) - 0x8000);
+	for (i = 0; i + 8 <= n; i += 8, mv += 8)
+		{
+		m = _mm_packs_epi32(_mm_sub_epi32(mag2_4_sse2(mv), bias32),
+		                    _mm_sub_epi32(mag2_4_sse2(mv + 4), bias32));
+		m = _mm_andnot_si128(_mm_cmplt_epi16(m, limit),
+		                     _mm_xor_si128(m, bias16));
+		_mm_storeu_si128((__m128i *) (mag2 + i), m);
+		}
+	mag2_row_c(mv, mag2 + i, n - i, mag2_limit);
+	}
+
+  /* lhs >= rhs mask for 4 lanes of unsigned 32 bit products a*a and b*k.
+  |  _mm_mul_epu32() only does the even lanes, so do odd lanes shifted down
+  |  and merge the sign masks of the 64 bit differences.
+  */
+static inline __m128i
+ge_products_sse2(__m128i a, __m128i b, __m128i k)
+	{
+	__m128i	de, dodd, a_odd, b_odd;
+
+	de = _mm_sub_epi64(_mm_mul_epu32(a, a), _mm_mul_epu32(b, k));
+	a_odd = _mm_srli_epi64(a, 32);
+	b_odd = _mm_srli_epi64(b, 32);
+	dodd = _mm_sub_epi64(_mm_mul_epu32(a_odd, a_odd), _mm_mul_epu32(b_odd, k));
+
+	de = _mm_shuffle_epi32(_mm_srai_epi32(de, 31), _MM_SHUFFLE(3, 3, 1, 1));
+	dodd = _mm_shuffle_epi32(_mm_srai_epi32(dodd, 31), _MM_SHUFFLE(3, 3, 1, 1));
+	de = _mm_or_si128(_mm_and_si128(de, _mm_set_epi32(0, -1, 0, -1)),
+	                  _mm_andnot_si128(_mm_set_epi32(0, -1, 0, -1), dodd));
+	return _mm_xor_si128(de, _mm_set1_epi32(-1));
+	}
+
+static void
+direction_row_sse2(MotionVector *mv, uint16_t *mag2, uint8_t *pass,
+			int n, int vx, int vy, int tmag2)
+	{
+	__m128i	tv = _mm_set1_epi32(((uint32_t) vy << 16) | (vx & 0xffff)),
+			k  = _mm_set1_epi32(COS2_LIMIT * tmag2),
+			zero = _mm_setzero_si128(),
+			v, lo, hi, dot, mm, ok[2], m, code;
+	int		i, h;
+
+	for (i = 0; i + 8 <= n; i += 8, mv += 8)
+		{
+		m = _mm_loadu_si128((__m128i *) (mag2 + i));
+		for (h = 0; h < 2; ++h)
+			{
+			v = _mm_loadu_si128((__m128i *) (mv + 4 * h));
+			lo = _mm_and_si128(_mm_srai_epi16(_mm_slli_epi16(v, 8), 8),
+			                   _mm_set1_epi32(0xffff));
+			hi = _mm_srai_epi16(_mm_slli_epi32(v, 16), 8);
+			dot = _mm_madd_epi16(_mm_or_si128(lo, hi), tv);
+			mm = (h == 0) ? _mm_unpacklo_epi16(m, zero)
+			              : _mm_unpackhi_epi16(m, zero);
+			ok[h] = _mm_and_si128(_mm_cmpgt_epi32(dot, zero),
+			            ge_products_sse2(_mm_add_epi32(_mm_slli_epi32(dot, 3),
+			                                           _mm_slli_epi32(dot, 1)),
+			                             mm, k));
+			}
+		/* ok lanes are 0 or -1, so code = 2 + ok, then 0 where no vector.
+		*/
+		code = _mm_add_epi16(_mm_set1_epi16(2), _mm_packs_epi32(ok[0], ok[1]));
+		code = _mm_andnot_si128(_mm_cmpeq_epi16(m, zero), code);
+		_mm_storel_epi64((__m128i *) (pass + i), _mm_packus_epi16(code, zero));
+		}
+	direction_row_c(mv, mag2 + i, pass + i, n - i, vx, vy, tmag2);
+	}
+
+  /* No unsigned 16 bit compare, so noise > level is a nonzero saturated
+  |  noise - level.
+  */
+static void
+noise_row_sse2(uint16_t *mag2, uint16_t *noise, uint8_t *noisy, int n, int level)
+	{
+	__m128i	m, nz, up, down, idle, cool,
+			lvl = _mm_set1_epi16((int16_t) level),
+			ones = _mm_set1_epi16(-1),
+			zero = _mm_setzero_si128();
+	int		i;
+
+	for (i = 0; i + 8 <= n; i += 8)
+		{
+		m = _mm_loadu_si128((__m128i *) (mag2 + i));
+		nz = _mm_loadu_si128((__m128i *) (noise + i));
+		up = _mm_add_epi16(nz,
+		        _mm_srli_epi16(_mm_xor_si128(nz, ones), MOTION_NOISE_SHIFT));
+		down = _mm_sub_epi16(nz, _mm_srli_epi16(nz, MOTION_NOISE_SHIFT));
+		idle = _mm_cmpeq_epi16(m, zero);
+		nz = _mm_or_si128(_mm_and_si128(idle, down), _mm_andnot_si128(idle, up));
+		_mm_storeu_si128((__m128i *) (noise + i), nz);
+		cool = _mm_cmpeq_epi16(_mm_subs_epu16(nz, lvl), zero);
+		_mm_storeu_si128((__m128i *) (mag2 + i), _mm_and_si128(m, cool));
+		_mm_storel_epi64((__m128i *) (noisy + i),
+		        _mm_packus_epi16(_mm_andnot_si128(cool, _mm_set1_epi16(1)), zero));
+		}
+	noise_row_c(mag2 + i, noise + i, noisy + i, n - i, level);
+	}
+
+  /* sad is the high half of each 32 bit MotionVector.  An arithmetic
+  |  shift and signed pack gives back the same 16 bits.
+  */
+static void
+sad_row_sse2(MotionVector *mv, uint16_t *base, uint8_t *hit, int n)
+	{
+	__m128i	sad, b, limit, up, down,
+			offset = _mm_set1_epi16(MOTION_SAD_OFFSET),
+			zero = _mm_setzero_si128();
+	int		i;
+
+	for (i = 0; i + 8 <= n; i += 8, mv += 8)
+		{
+		sad = _mm_packs_epi32(
+		        _mm_srai_epi32(_mm_loadu_si128((__m128i *) mv), 16),
+		        _mm_srai_epi32(_mm_loadu_si128((__m128i *) (mv + 4)), 16));
+		b = _mm_loadu_si128((__m128i *) (base + i));
+		limit = _mm_adds_epu16(_mm_adds_epu16(b, b), offset);
+		_mm_storel_epi64((__m128i *) (hit + i),
+		        _mm_packus_epi16(_mm_andnot_si128(
+		            _mm_cmpeq_epi16(_mm_subs_epu16(sad, limit), zero),
+		            _mm_set1_epi16(1)), zero));
+		up = _mm_srli_epi16(_mm_subs_epu16(sad, b), MOTION_SAD_SHIFT);
+		down = _mm_srli_epi16(_mm_subs_epu16(b, sad), MOTION_SAD_SHIFT);
+		_mm_storeu_si128((__m128i *) (base + i),
+		        _mm_sub_epi16(_mm_add_epi16(b, up), down));
+		}
+	sad_row_c(mv, base + i, hit + i, n - i);
+	}
+
+  /* Even and odd columns are the low and high bytes of 16 bit lanes.
+  |  psadbw sums each 8 byte half, the low half is the block.
+  */
+static void
+pixel_row_sse2(uint8_t *y0, uint8_t *y1, uint8_t *bg, uint16_t *sad, int n)
+	{
+	__m128i	a, c, b,
+			low = _mm_set1_epi16(0xff);
+	int		i;
+
+	for (i = 0; i < n; ++i, y0 += 16, y1 += 16, bg += 8)
+		{
+		a = _mm_avg_epu8(_mm_loadu_si128((__m128i *) y0),
+		                 _mm_loadu_si128((__m128i *) y1));
+		c = _mm_avg_epu16(_mm_and_si128(a, low), _mm_srli_epi16(a, 8));
+		c = _mm_packus_epi16(c, c);
+		b = _mm_loadl_epi64((__m128i *) bg);
+		sad[i] += _mm_cvtsi128_si32(_mm_sad_epu8(c, b));
+		_mm_storel_epi64((__m128i *) bg,
+		        _mm_avg_epu8(b, _mm_avg_epu8(b, _mm_avg_epu8(b, c))));
+		}
+	}
+
+static MotionKernels	kernels_simd =
+	{
+	"sse2", mag2_row_sse2, direction_row_sse2, noise_row_sse2, sad_row_sse2,
+	pixel_row_sse2
+	};
+#endif	/* HAVE_SSE2 */
+
+
+  /* A 32 bit ARM build with NEON enabled (make NEON=1) can still be run on
+  |  a Pi Zero/1, so check the cpu has NEON before using its kernels.
+  |  aarch64 and SSE2 cpus always have them.
+  */
+static boolean
+simd_cpu_ok(void)
+	{
+#if defined(HAVE_NEON) && defined(__arm__)
+	static int	neon = -1;
+
+	if (neon < 0)
+		neon = (getauxval(AT_HWCAP) & HWCAP_ARM_NEON) ? 1 : 0;
+	return neon;
+#else
+	return TRUE;
+#endif
+	}
+
+MotionKernels *
+motion_kernels_get(boolean simd)
+	{
+#if defined(HAVE_NEON) || defined(HAVE_SSE2)
+	if (simd && simd_cpu_ok())
+		return &kernels_simd;
+#endif
+	return &kernels_c;
+	}
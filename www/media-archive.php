@@ -177,9 +177,11 @@ function delete_file($media_dir, $fname)
 		{
 		$thumb = str_replace(".mp4", ".th.jpg", $fname);
 		$csv = str_replace(".mp4", ".csv", $fname);
+		$mstats = str_replace(".mp4", ".mstats", $fname);
 		unlink("$media_dir/videos/$fname");
 		unlink("$media_dir/thumbs/$thumb");
 		unlink("$media_dir/videos/$csv");
+		unlink("$media_dir/videos/$mstats");
 		}
 	if ("$media_mode" == "archive")
 		delete_empty_media_dir($media_dir);
@@ -197,6 +199,7 @@ function delete_day($media_dir, $ymd)
 		{
 		array_map('unlink', glob("$media_dir/videos/*$ymd*.mp4"));
 		array_map('unlink', glob("$media_dir/videos/*$ymd*.csv"));
+		array_map('unlink', glob("$media_dir/videos/*$ymd*.mstats"));
 		array_map('unlink', glob("$media_dir/videos/*$ymd*.h264"));
 		array_map('unlink', glob("$media_dir/thumbs/*$ymd*.th.jpg"));
 		}
@@ -216,6 +219,7 @@ function delete_all_files($media_dir)
 		{
 		array_map('unlink', glob("$media_dir/videos/*.mp4"));
 		array_map('unlink', glob("$media_dir/videos/*.csv"));
+		array_map('unlink', glob("$media_dir/videos/*.mstats"));
 		array_map('unlink', glob("$media_dir/videos/*.h264"));
 		array_map('unlink', glob("$media_dir/thumbs/*.th.jpg"));
 		}